@@ -0,0 +1,107 @@
+#ifndef libi8080_h
+#define libi8080_h
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Embedding interface of the Intel 8080 emulator (libi8080.a, libi8080.so).
+ *
+ * Each machine is an independent object: the library has no global state, so
+ * any number of machines can run at once, each on one thread at a time. A
+ * machine starts powered on with all registers and memory cleared and PC at
+ * 0x0100. Devices are attached as callbacks, which receive the context
+ * pointer they were attached with. An unrecognized opcode halts the machine
+ * with interrupts disabled and sets i8080_regs.faulted.
+ */
+
+#if defined(__GNUC__)
+#define I8080_API __attribute__((visibility("default")))
+#else
+#define I8080_API
+#endif
+
+typedef struct i8080 i8080;
+
+/* Ways of executing guest code. All of them give the same results. */
+enum {
+        I8080_ENGINE_INTERPRETER,
+        I8080_ENGINE_BLOCK_CACHE,
+        I8080_ENGINE_JIT,
+};
+
+typedef struct {
+        uint8_t a, f, b, c, d, e, h, l;
+        uint16_t sp, pc;
+        // Interrupt enable and halt flip-flops
+        bool inte, halted;
+        // Set when the machine halted on an unrecognized opcode
+        bool faulted;
+} i8080_regs;
+
+typedef uint8_t (*i8080_port_read_fn)(void *ctx, uint8_t port);
+typedef void (*i8080_port_write_fn)(void *ctx, uint8_t port, uint8_t byte);
+typedef void (*i8080_port_write_block_fn)(void *ctx, uint8_t port, const uint8_t *buf, size_t len);
+typedef uint8_t (*i8080_mmio_read_fn)(void *ctx, uint16_t addr);
+typedef void (*i8080_mmio_write_fn)(void *ctx, uint16_t addr, uint8_t byte);
+typedef void (*i8080_event_fn)(i8080 *cpu, void *ctx);
+
+
+/* Creation. i8080_new() returns NULL when out of memory. */
+I8080_API i8080 *i8080_new(void);
+I8080_API i8080 *i8080_fork(i8080 *parent);
+I8080_API void i8080_free(i8080 *cpu);
+I8080_API bool i8080_set_engine(i8080 *cpu, int engine);
+
+/* Programs. i8080_load() maps or reads a file; false with errno set on failure. */
+I8080_API bool i8080_load(i8080 *cpu, const char *path, uint16_t addr);
+I8080_API void i8080_load_mem(i8080 *cpu, uint16_t addr, const void *buf, size_t len);
+I8080_API bool i8080_save_state(i8080 *cpu, const char *path);
+I8080_API bool i8080_restore_state(i8080 *cpu, const char *path);
+
+/* Execution. Both return the states run; the run ends early on a halt. */
+I8080_API uint64_t i8080_step(i8080 *cpu);
+I8080_API uint64_t i8080_run(i8080 *cpu, uint64_t cycles);
+I8080_API uint64_t i8080_cycles(const i8080 *cpu);
+I8080_API void i8080_interrupt(i8080 *cpu, int vector);
+I8080_API void i8080_mask_interrupts(i8080 *cpu, uint8_t mask);
+
+/* Events at a cycle count, from device callbacks or between runs. False when
+ * out of memory. */
+I8080_API bool i8080_schedule_interrupt(i8080 *cpu, uint64_t when, int vector);
+I8080_API bool i8080_schedule_event(i8080 *cpu, uint64_t when, i8080_event_fn fn, void *ctx);
+I8080_API void i8080_cancel_events(i8080 *cpu, i8080_event_fn fn, void *ctx);
+
+/* State. Only while the machine is not running. */
+I8080_API void i8080_get_regs(const i8080 *cpu, i8080_regs *regs);
+I8080_API void i8080_set_regs(i8080 *cpu, const i8080_regs *regs);
+I8080_API uint8_t i8080_read(const i8080 *cpu, uint16_t addr);
+I8080_API void i8080_write(i8080 *cpu, uint16_t addr, uint8_t byte);
+I8080_API void i8080_read_mem(const i8080 *cpu, uint16_t addr, void *buf, size_t len);
+/* Hash of registers, interrupt state and memory, for finding duplicate states.
+ * Costs the memory pages stored to since the last call. */
+I8080_API uint64_t i8080_state_hash(i8080 *cpu);
+
+/* Memory pages of I8080_PAGE_SIZE bytes that may have changed since their
+ * dirty bits were last cleared: bit n % 64 of bitmap[n / 64] for page n. A
+ * new machine has every page dirty. */
+#define I8080_PAGE_SIZE 256
+#define I8080_DIRTY_WORDS 4
+I8080_API void i8080_dirty_pages(const i8080 *cpu, uint64_t bitmap[I8080_DIRTY_WORDS]);
+I8080_API void i8080_clear_dirty(i8080 *cpu, uint16_t addr, size_t len);
+
+/* Devices and memory map. */
+I8080_API void i8080_attach_port(i8080 *cpu, uint8_t port, i8080_port_read_fn read,
+                                 i8080_port_write_fn write, void *ctx);
+I8080_API void i8080_attach_port_buffered(i8080 *cpu, uint8_t port, i8080_port_read_fn read,
+                                          i8080_port_write_block_fn write_block, void *ctx);
+I8080_API void i8080_map_ram(i8080 *cpu, uint16_t addr, size_t len);
+I8080_API void i8080_map_rom(i8080 *cpu, uint16_t addr, size_t len);
+I8080_API void i8080_map_mmio(i8080 *cpu, uint16_t addr, size_t len, i8080_mmio_read_fn read,
+                              i8080_mmio_write_fn write, void *ctx);
+
+
+#endif
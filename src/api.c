@@ -0,0 +1,213 @@
+#include <stdlib.h>
+
+#include "i8080.h"
+#include "snapshot.h"
+
+
+/*
+ * The library interface in include/libi8080.h, over the emulator core. Only
+ * the functions declared there are exported from libi8080.
+ */
+
+
+i8080 *
+i8080_new(void)
+{
+        i8080 *cpu = malloc(sizeof *cpu);
+        if (!cpu)
+                return NULL;
+        reset(cpu);
+        // A bad guest must not take the host process down with it
+        cpu->halt_on_fault = true;
+        return cpu;
+}
+
+bool
+i8080_set_engine(i8080 *cpu, int engine)
+{
+        switch (engine) {
+                case I8080_ENGINE_INTERPRETER: { return select_engine(cpu, ENGINE_INTERPRETER); }
+                case I8080_ENGINE_BLOCK_CACHE: { return select_engine(cpu, ENGINE_BLOCK_CACHE); }
+                case I8080_ENGINE_JIT: { return select_engine(cpu, ENGINE_JIT); }
+        }
+        return false;
+}
+
+bool
+i8080_load(i8080 *cpu, const char *path, uint16_t addr)
+{
+        if (!load(cpu, path, addr))
+                return false;
+        invalidate_code(cpu, addr, ADDR_SPACE_SZ - (size_t)addr);
+        return true;
+}
+
+/* Copy len bytes into memory at addr, ignoring the memory map like load(). */
+void
+i8080_load_mem(i8080 *cpu, uint16_t addr, const void *buf, size_t len)
+{
+        mem_load(&cpu->mem, addr, buf, len);
+        invalidate_code(cpu, addr, len);
+}
+
+bool
+i8080_save_state(i8080 *cpu, const char *path)
+{
+        return save_state(cpu, path);
+}
+
+bool
+i8080_restore_state(i8080 *cpu, const char *path)
+{
+        return restore_state(cpu, path);
+}
+
+uint64_t
+i8080_step(i8080 *cpu)
+{
+        return step(cpu);
+}
+
+uint64_t
+i8080_run(i8080 *cpu, uint64_t cycles)
+{
+        return emulate_cycles(cpu, cycles);
+}
+
+uint64_t
+i8080_cycles(const i8080 *cpu)
+{
+        return cpu->cycles;
+}
+
+void
+i8080_interrupt(i8080 *cpu, int vector)
+{
+        request_interrupt(cpu, vector);
+}
+
+void
+i8080_mask_interrupts(i8080 *cpu, uint8_t mask)
+{
+        mask_interrupts(cpu, mask);
+}
+
+bool
+i8080_schedule_interrupt(i8080 *cpu, uint64_t when, int vector)
+{
+        return schedule_interrupt(cpu, when, vector);
+}
+
+bool
+i8080_schedule_event(i8080 *cpu, uint64_t when, i8080_event_fn fn, void *ctx)
+{
+        return schedule_event(cpu, when, fn, ctx);
+}
+
+void
+i8080_cancel_events(i8080 *cpu, i8080_event_fn fn, void *ctx)
+{
+        cancel_events(cpu, fn, ctx);
+}
+
+void
+i8080_get_regs(const i8080 *cpu, i8080_regs *regs)
+{
+        // Runs end with F materialized, so it is up to date here
+        regs->a = cpu->A;
+        regs->f = cpu->F;
+        regs->b = cpu->B; regs->c = cpu->C;
+        regs->d = cpu->D; regs->e = cpu->E;
+        regs->h = cpu->H; regs->l = cpu->L;
+        regs->sp = cpu->SP;
+        regs->pc = cpu->PC;
+        regs->inte = cpu->INTE;
+        regs->halted = cpu->halted;
+        regs->faulted = cpu->faulted;
+}
+
+void
+i8080_set_regs(i8080 *cpu, const i8080_regs *regs)
+{
+        cpu->A = regs->a;
+        flags_load(cpu, regs->f);
+        cpu->B = regs->b; cpu->C = regs->c;
+        cpu->D = regs->d; cpu->E = regs->e;
+        cpu->H = regs->h; cpu->L = regs->l;
+        cpu->SP = regs->sp;
+        cpu->PC = regs->pc;
+        cpu->INTE = regs->inte;
+        cpu->halted = regs->halted;
+        cpu->faulted = regs->faulted;
+}
+
+/* Reads and writes as the CPU does them, through the memory map. */
+uint8_t
+i8080_read(const i8080 *cpu, uint16_t addr)
+{
+        return mem_read(&cpu->mem, addr);
+}
+
+void
+i8080_write(i8080 *cpu, uint16_t addr, uint8_t byte)
+{
+        mem_write(&cpu->mem, addr, byte);
+        invalidate_code(cpu, addr, 1);
+}
+
+/* Copy memory out, with MMIO pages reading as zero. */
+void
+i8080_read_mem(const i8080 *cpu, uint16_t addr, void *buf, size_t len)
+{
+        mem_dump(&cpu->mem, addr, buf, len);
+}
+
+uint64_t
+i8080_state_hash(i8080 *cpu)
+{
+        return state_hash(cpu);
+}
+
+void
+i8080_dirty_pages(const i8080 *cpu, uint64_t bitmap[I8080_DIRTY_WORDS])
+{
+        dirty_pages(cpu, bitmap);
+}
+
+void
+i8080_clear_dirty(i8080 *cpu, uint16_t addr, size_t len)
+{
+        clear_dirty(cpu, addr, len);
+}
+
+void
+i8080_attach_port(i8080 *cpu, uint8_t port, i8080_port_read_fn read, i8080_port_write_fn write, void *ctx)
+{
+        attach_port(cpu, port, read, write, ctx);
+}
+
+void
+i8080_attach_port_buffered(i8080 *cpu, uint8_t port, i8080_port_read_fn read,
+                           i8080_port_write_block_fn write_block, void *ctx)
+{
+        attach_port_buffered(cpu, port, read, write_block, ctx);
+}
+
+void
+i8080_map_ram(i8080 *cpu, uint16_t addr, size_t len)
+{
+        map_ram(cpu, addr, len);
+}
+
+void
+i8080_map_rom(i8080 *cpu, uint16_t addr, size_t len)
+{
+        map_rom(cpu, addr, len);
+}
+
+void
+i8080_map_mmio(i8080 *cpu, uint16_t addr, size_t len, i8080_mmio_read_fn read,
+               i8080_mmio_write_fn write, void *ctx)
+{
+        map_mmio(cpu, addr, len, read, write, ctx);
+}
@@ -0,0 +1,291 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "snapshot.h"
+
+
+/* Machines a worker interleaves at once. */
+#define BATCH_WINDOW 8
+
+/*
+ * Unstarted jobs of one worker. The owner takes from the front, thieves from
+ * the back.
+ */
+typedef struct {
+        pthread_mutex_t lock;
+        size_t *jobs;
+        size_t head, tail;
+} job_queue;
+
+typedef struct {
+        const batch_job *jobs;
+        batch_result *results;
+        const batch_options *opts;
+        job_queue *queues;
+        unsigned nworkers;
+} batch;
+
+typedef struct {
+        batch *b;
+        unsigned id;
+        pthread_t thread;
+} worker;
+
+typedef struct {
+        i8080 *cpu;
+        size_t job;
+        // Cycle count the job started at
+        uint64_t start;
+} slot;
+
+
+static bool
+take_front(job_queue *q, size_t *job)
+{
+        bool ok = false;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) {
+                *job = q->jobs[q->head++];
+                ok = true;
+        }
+        pthread_mutex_unlock(&q->lock);
+        return ok;
+}
+
+static bool
+take_back(job_queue *q, size_t *job)
+{
+        bool ok = false;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) {
+                *job = q->jobs[--q->tail];
+                ok = true;
+        }
+        pthread_mutex_unlock(&q->lock);
+        return ok;
+}
+
+/* Next job for worker w: its own queue first, then the others' in turn. */
+static bool
+next_job(worker *w, size_t *job)
+{
+        batch *b = w->b;
+        if (take_front(&b->queues[w->id], job))
+                return true;
+        for (unsigned i = 1; i < b->nworkers; ++i)
+                if (take_back(&b->queues[(w->id + i) % b->nworkers], job))
+                        return true;
+        return false;
+}
+
+static void
+record(batch_result *r, const i8080 *cpu, batch_status status)
+{
+        r->status = status;
+        r->cycles = cpu->cycles;
+        r->A = cpu->A; r->B = cpu->B; r->C = cpu->C; r->D = cpu->D;
+        r->E = cpu->E; r->H = cpu->H; r->L = cpu->L; r->F = cpu->F;
+        r->PC = cpu->PC; r->SP = cpu->SP;
+}
+
+static i8080 *
+start_job(batch *b, size_t n)
+{
+        const batch_job *job = &b->jobs[n];
+        if (job->rom_len > ADDR_SPACE_SZ - (size_t)job->load_addr
+            || job->input_len > ADDR_SPACE_SZ - (size_t)job->input_addr)
+                goto fail;
+        i8080 *cpu = malloc(sizeof *cpu);
+        if (!cpu)
+                goto fail;
+        reset(cpu);
+        // One bad program must not end the whole batch
+        cpu->halt_on_fault = true;
+        if (job->state) {
+                if (!restore_state(cpu, job->state)) {
+                        release(cpu);
+                        free(cpu);
+                        goto fail;
+                }
+        } else {
+                if (job->rom_path && !load(cpu, job->rom_path, job->load_addr)) {
+                        release(cpu);
+                        free(cpu);
+                        goto fail;
+                }
+                mem_load(&cpu->mem, job->load_addr, job->rom, job->rom_len);
+                cpu->PC = job->entry;
+        }
+        mem_load(&cpu->mem, job->input_addr, job->input, job->input_len);
+        if (!select_engine(cpu, b->opts->engine))
+                select_engine(cpu, ENGINE_INTERPRETER);
+        return cpu;
+fail:
+        memset(&b->results[n], 0, sizeof b->results[n]);
+        b->results[n].status = BATCH_FAILED;
+        return NULL;
+}
+
+static void
+finish_job(batch *b, slot *s, batch_status status)
+{
+        record(&b->results[s->job], s->cpu, status);
+        release(s->cpu);
+        free(s->cpu);
+}
+
+/*
+ * Run one quantum of a machine. Returns true and fills in the status once
+ * the machine is done.
+ */
+static bool
+run_slice(batch *b, slot *s, batch_status *status)
+{
+        i8080 *cpu = s->cpu;
+        uint64_t max = b->jobs[s->job].max_cycles;
+        uint64_t budget = b->opts->quantum;
+        if (max && max - (cpu->cycles - s->start) < budget)
+                budget = max - (cpu->cycles - s->start);
+        emulate_cycles(cpu, budget);
+
+        // Nothing in a batch raises interrupts, so a halt is final.
+        if (cpu->faulted) {
+                *status = BATCH_FAULTED;
+                return true;
+        }
+        if (cpu->halted) {
+                *status = BATCH_HALTED;
+                return true;
+        }
+        if (max && cpu->cycles - s->start >= max) {
+                *status = BATCH_CYCLE_LIMIT;
+                return true;
+        }
+        return false;
+}
+
+static void *
+work(void *arg)
+{
+        worker *w = arg;
+        batch *b = w->b;
+        slot window[BATCH_WINDOW];
+        size_t active = 0;
+        // Queues are only ever emptied, so once none has work left the
+        // worker just finishes the machines it holds.
+        bool drained = false;
+
+        for (;;) {
+                while (!drained && active < BATCH_WINDOW) {
+                        size_t job;
+                        if (!next_job(w, &job)) {
+                                drained = true;
+                                break;
+                        }
+                        i8080 *cpu = start_job(b, job);
+                        if (cpu)
+                                window[active++] = (slot){ cpu, job, cpu->cycles };
+                }
+                if (!active)
+                        break;
+
+                for (size_t i = 0; i < active;) {
+                        batch_status status;
+                        if (run_slice(b, &window[i], &status)) {
+                                finish_job(b, &window[i], status);
+                                window[i] = window[--active];
+                        } else {
+                                ++i;
+                        }
+                }
+        }
+        return NULL;
+}
+
+static void
+free_queues(batch *b)
+{
+        for (unsigned i = 0; i < b->nworkers; ++i) {
+                pthread_mutex_destroy(&b->queues[i].lock);
+                free(b->queues[i].jobs);
+        }
+        free(b->queues);
+}
+
+/* Deal the n jobs onto one queue per worker. Returns false if out of memory. */
+static bool
+make_queues(batch *b, size_t n)
+{
+        b->queues = calloc(b->nworkers, sizeof *b->queues);
+        if (!b->queues)
+                return false;
+        size_t per = n / b->nworkers + 1;
+        for (unsigned i = 0; i < b->nworkers; ++i) {
+                pthread_mutex_init(&b->queues[i].lock, NULL);
+                b->queues[i].jobs = malloc(per * sizeof(size_t));
+                if (!b->queues[i].jobs) {
+                        free_queues(b);
+                        return false;
+                }
+        }
+        for (size_t j = 0; j < n; ++j) {
+                job_queue *q = &b->queues[j % b->nworkers];
+                q->jobs[q->tail++] = j;
+        }
+        return true;
+}
+
+/*
+ * Run every job to completion and store its outcome at the same index of
+ * results. Returns once all jobs are done. Short of memory or threads, it
+ * runs on fewer workers; with none at all, every job is BATCH_FAILED.
+ */
+void
+run_batch(const batch_job *jobs, batch_result *results, size_t n, const batch_options *opts)
+{
+        batch_options o = *opts;
+        if (!o.threads) {
+                long online = sysconf(_SC_NPROCESSORS_ONLN);
+                o.threads = online > 0 ? (unsigned)online : 1;
+        }
+        if ((size_t)o.threads > n)
+                o.threads = n ? (unsigned)n : 1;
+        if (!o.quantum)
+                o.quantum = BATCH_QUANTUM;
+
+        batch b = { jobs, results, &o, NULL, o.threads };
+        worker *workers;
+        for (;;) {
+                workers = calloc(b.nworkers, sizeof *workers);
+                if (workers && make_queues(&b, n))
+                        break;
+                free(workers);
+                if (b.nworkers == 1) {
+                        for (size_t j = 0; j < n; ++j) {
+                                memset(&results[j], 0, sizeof results[j]);
+                                results[j].status = BATCH_FAILED;
+                        }
+                        return;
+                }
+                b.nworkers = 1;
+        }
+
+        // The calling thread is worker 0. The queues of workers that could
+        // not be started are emptied by the others' stealing.
+        for (unsigned i = 0; i < b.nworkers; ++i)
+                workers[i] = (worker){ &b, i, 0 };
+        bool *started = calloc(b.nworkers, sizeof *started);
+        for (unsigned i = 1; started && i < b.nworkers; ++i)
+                started[i] = pthread_create(&workers[i].thread, NULL, work, &workers[i]) == 0;
+        work(&workers[0]);
+        for (unsigned i = 1; started && i < b.nworkers; ++i)
+                if (started[i])
+                        pthread_join(workers[i].thread, NULL);
+
+        free(started);
+        free_queues(&b);
+        free(workers);
+}
@@ -0,0 +1,76 @@
+#ifndef batch_h
+#define batch_h
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "i8080.h"
+
+
+/*
+ * Batch runner.
+ *
+ * Runs many independent machines to completion on a pool of worker threads.
+ * Jobs are dealt round-robin onto per-worker queues; a worker that runs dry
+ * steals unstarted jobs from the back of the other queues, so a few long jobs
+ * do not leave the rest of the pool idle. Each worker keeps a small window of
+ * machines in flight and time-slices them by cycle budget with
+ * emulate_cycles(). Nothing is shared between workers beyond the queue locks.
+ */
+
+typedef struct {
+        // Program image, copied to load_addr
+        const uint8_t *rom;
+        size_t rom_len;
+
+        // Program file, loaded with load() instead of copying rom, or NULL
+        const char *rom_path;
+
+        // Where the program goes and where execution starts, normally
+        // both BEGIN_ADDR
+        uint16_t load_addr;
+        uint16_t entry;
+
+        // Save state to start from instead of booting rom, or NULL
+        const char *state;
+
+        // Per-job data, copied to input_addr after the program. May be empty.
+        const uint8_t *input;
+        size_t input_len;
+        uint16_t input_addr;
+
+        // Stop the machine after running this many cycles. 0 for no limit.
+        uint64_t max_cycles;
+} batch_job;
+
+typedef enum {
+        BATCH_HALTED,           // HLT with interrupts disabled
+        BATCH_CYCLE_LIMIT,      // max_cycles reached first
+        BATCH_FAULTED,          // halted on an unrecognized opcode
+        BATCH_FAILED,           // the machine could not be set up
+} batch_status;
+
+typedef struct {
+        batch_status status;
+        uint64_t cycles;
+        uint8_t A, B, C, D, E, H, L, F;
+        uint16_t PC, SP;
+} batch_result;
+
+typedef struct {
+        // Worker threads. 0 for one per online processor.
+        unsigned threads;
+        // Cycles a machine runs before its worker moves to the next one
+        uint64_t quantum;
+        engine engine;
+} batch_options;
+
+/* Defaults for batch_options.quantum */
+#define BATCH_QUANTUM 100000
+
+
+void run_batch(const batch_job *jobs, batch_result *results, size_t n, const batch_options *opts);
+
+
+#endif
@@ -0,0 +1,415 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "libi8080.h"
+
+
+/*
+ * Emulator speed benchmark (make bench). Each workload is a small 8080
+ * program run to its HLT on every engine through the library interface. The
+ * fastest of a few runs gives the emulated MIPS and the host time per guest
+ * instruction, along with the host cache misses of that run when perf
+ * counters are available. Results go to a tab-separated file, one row per
+ * workload and engine, headed by the version label given with -v so files
+ * from different versions can be compared.
+ */
+
+#define BENCH_RUNS 3
+
+/* Arithmetic and logic on registers in three nested loops. */
+static const uint8_t arith_loop[] = {
+        0x31, 0x00, 0xF0,       //         LXI SP,0F000H
+        0x1E, 0x40,             //         MVI E,40H
+        0x06, 0x00,             // outer:  MVI B,0
+        0x0E, 0x00,             // middle: MVI C,0
+        0x7A,                   // inner:  MOV A,D
+        0x85,                   //         ADD L
+        0x8C,                   //         ADC H
+        0x27,                   //         DAA
+        0x57,                   //         MOV D,A
+        0xAC,                   //         XRA H
+        0x07,                   //         RLC
+        0x67,                   //         MOV H,A
+        0xD6, 0x07,             //         SUI 7
+        0xB2,                   //         ORA D
+        0x1F,                   //         RAR
+        0x6F,                   //         MOV L,A
+        0x24,                   //         INR H
+        0x0D,                   //         DCR C
+        0xC2, 0x09, 0x01,       //         JNZ inner
+        0x05,                   //         DCR B
+        0xC2, 0x07, 0x01,       //         JNZ middle
+        0x1D,                   //         DCR E
+        0xC2, 0x05, 0x01,       //         JNZ outer
+        0x76,                   //         HLT
+};
+
+/* Fill 16K, then copy it 256 times with MOV A,M / STAX D. */
+static const uint8_t copy_loop[] = {
+        0x31, 0x00, 0xF0,       //         LXI SP,0F000H
+        0x21, 0x00, 0x40,       //         LXI H,4000H
+        0x01, 0x00, 0x40,       //         LXI B,4000H
+        0x75,                   // fill:   MOV M,L
+        0x23,                   //         INX H
+        0x0B,                   //         DCX B
+        0x78,                   //         MOV A,B
+        0xB1,                   //         ORA C
+        0xC2, 0x09, 0x01,       //         JNZ fill
+        0x3E, 0x00,             //         MVI A,0
+        0x32, 0x00, 0xE0,       // pass:   STA 0E000H
+        0x21, 0x00, 0x40,       //         LXI H,4000H
+        0x11, 0x00, 0x80,       //         LXI D,8000H
+        0x01, 0x00, 0x40,       //         LXI B,4000H
+        0x7E,                   // copy:   MOV A,M
+        0x12,                   //         STAX D
+        0x23,                   //         INX H
+        0x13,                   //         INX D
+        0x0B,                   //         DCX B
+        0x78,                   //         MOV A,B
+        0xB1,                   //         ORA C
+        0xC2, 0x1F, 0x01,       //         JNZ copy
+        0x3A, 0x00, 0xE0,       //         LDA 0E000H
+        0x3D,                   //         DCR A
+        0xC2, 0x13, 0x01,       //         JNZ pass
+        0x76,                   //         HLT
+};
+
+/* Recursive Fibonacci of 20, 256 times: CALL, RET, PUSH and POP. */
+static const uint8_t recursive_calls[] = {
+        0x31, 0x00, 0xF0,       //         LXI SP,0F000H
+        0x06, 0x00,             //         MVI B,0
+        0x21, 0x00, 0x00,       // again:  LXI H,0
+        0x0E, 0x14,             //         MVI C,20
+        0xCD, 0x15, 0x01,       //         CALL fib
+        0x05,                   //         DCR B
+        0xC2, 0x05, 0x01,       //         JNZ again
+        0x22, 0x00, 0xE0,       //         SHLD 0E000H
+        0x76,                   //         HLT
+        0x79,                   // fib:    MOV A,C
+        0xFE, 0x02,             //         CPI 2
+        0xDA, 0x28, 0x01,       //         JC leaf
+        0x0D,                   //         DCR C
+        0xC5,                   //         PUSH B
+        0xCD, 0x15, 0x01,       //         CALL fib
+        0xC1,                   //         POP B
+        0x0D,                   //         DCR C
+        0xCD, 0x15, 0x01,       //         CALL fib
+        0x0C,                   //         INR C
+        0x0C,                   //         INR C
+        0xC9,                   //         RET
+        0x59,                   // leaf:   MOV E,C
+        0x16, 0x00,             //         MVI D,0
+        0x19,                   //         DAD D
+        0xC9,                   //         RET
+};
+
+/*
+ * An exerciser-style mix of most instruction groups over 64K operand pairs,
+ * folding the results into a CRC-16 eight times over.
+ */
+static const uint8_t instruction_mix[] = {
+        0x31, 0x00, 0xF0,       //         LXI SP,0F000H
+        0x21, 0xFF, 0xFF,       //         LXI H,0FFFFH
+        0x22, 0x02, 0xE0,       //         SHLD 0E002H
+        0x3E, 0x08,             //         MVI A,8
+        0x32, 0x00, 0xE0,       //         STA 0E000H
+        0x01, 0x00, 0x00,       // pass:   LXI B,0
+        0x79,                   // loop:   MOV A,C
+        0x80,                   //         ADD B
+        0xF5,                   //         PUSH PSW
+        0x91,                   //         SUB C
+        0x98,                   //         SBB B
+        0x2F,                   //         CMA
+        0xE6, 0xF7,             //         ANI 0F7H
+        0xF6, 0x05,             //         ORI 5
+        0xEE, 0xAA,             //         XRI 0AAH
+        0xFE, 0x80,             //         CPI 80H
+        0xDC, 0x65, 0x01,       //         CC rot
+        0xCE, 0x03,             //         ACI 3
+        0xDE, 0x01,             //         SBI 1
+        0x27,                   //         DAA
+        0x37,                   //         STC
+        0x3F,                   //         CMC
+        0x17,                   //         RAL
+        0x2A, 0x02, 0xE0,       //         LHLD 0E002H
+        0xCD, 0x6A, 0x01,       //         CALL crc
+        0x22, 0x02, 0xE0,       //         SHLD 0E002H
+        0xF1,                   //         POP PSW
+        0x57,                   //         MOV D,A
+        0x59,                   //         MOV E,C
+        0xEB,                   //         XCHG
+        0x09,                   //         DAD B
+        0x29,                   //         DAD H
+        0x23,                   //         INX H
+        0x1B,                   //         DCX D
+        0xD5,                   //         PUSH D
+        0xE3,                   //         XTHL
+        0xD1,                   //         POP D
+        0x22, 0x06, 0xE0,       //         SHLD 0E006H
+        0x3A, 0x06, 0xE0,       //         LDA 0E006H
+        0xBB,                   //         CMP E
+        0xEA, 0x49, 0x01,       //         JPE even
+        0x1C,                   //         INR E
+        0xFA, 0x4D, 0x01,       // even:   JM minus
+        0x1D,                   //         DCR E
+        0x7B,                   // minus:  MOV A,E
+        0xB7,                   //         ORA A
+        0xCC, 0x65, 0x01,       //         CZ rot
+        0x0C,                   //         INR C
+        0xC2, 0x11, 0x01,       //         JNZ loop
+        0x04,                   //         INR B
+        0xC2, 0x11, 0x01,       //         JNZ loop
+        0x3A, 0x00, 0xE0,       //         LDA 0E000H
+        0x3D,                   //         DCR A
+        0x32, 0x00, 0xE0,       //         STA 0E000H
+        0xC2, 0x0E, 0x01,       //         JNZ pass
+        0x76,                   //         HLT
+        0x0F,                   // rot:    RRC
+        0xD0,                   //         RNC
+        0x1F,                   //         RAR
+        0x07,                   //         RLC
+        0xC9,                   //         RET
+        0xAC,                   // crc:    XRA H
+        0x67,                   //         MOV H,A
+        0x16, 0x08,             //         MVI D,8
+        0x29,                   // bit:    DAD H
+        0xD2, 0x7A, 0x01,       //         JNC nox
+        0x7C,                   //         MOV A,H
+        0xEE, 0x10,             //         XRI 10H
+        0x67,                   //         MOV H,A
+        0x7D,                   //         MOV A,L
+        0xEE, 0x21,             //         XRI 21H
+        0x6F,                   //         MOV L,A
+        0x15,                   // nox:    DCR D
+        0xC2, 0x6E, 0x01,       //         JNZ bit
+        0xC9,                   //         RET
+};
+
+typedef struct {
+        const char *name;
+        const uint8_t *code;
+        size_t len;
+} workload;
+
+static const workload workloads[] = {
+        { "arith", arith_loop, sizeof arith_loop },
+        { "memcopy", copy_loop, sizeof copy_loop },
+        { "calls", recursive_calls, sizeof recursive_calls },
+        { "mix", instruction_mix, sizeof instruction_mix },
+};
+
+#define WORKLOAD_COUNT (sizeof workloads / sizeof workloads[0])
+
+static const char *engine_names[] = {
+        [I8080_ENGINE_INTERPRETER] = "interp",
+        [I8080_ENGINE_BLOCK_CACHE] = "block",
+        [I8080_ENGINE_JIT] = "jit",
+};
+
+#define ENGINE_COUNT (sizeof engine_names / sizeof engine_names[0])
+
+typedef struct {
+        uint64_t insns;
+        uint64_t cycles;
+        double seconds;
+        // Host cache misses, or -1 if they cannot be counted
+        int64_t cache_misses;
+} result;
+
+
+/* Counter of the calling thread's cache misses, or -1 if unavailable. */
+static int
+counter_open(void)
+{
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        return -1;
+#endif
+}
+
+static void
+counter_start(int fd)
+{
+#ifdef __linux__
+        if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+}
+
+static int64_t
+counter_stop(int fd)
+{
+#ifdef __linux__
+        uint64_t n;
+        if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(fd, &n, sizeof n) == sizeof n)
+                        return (int64_t)n;
+        }
+#endif
+        return -1;
+}
+
+static double
+now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static i8080 *
+machine(const workload *w, int engine)
+{
+        i8080 *cpu = i8080_new();
+        if (!cpu) {
+                perror("i8080_new");
+                exit(EXIT_FAILURE);
+        }
+        if (!i8080_set_engine(cpu, engine)) {
+                i8080_free(cpu);
+                return NULL;
+        }
+        i8080_load_mem(cpu, 0x100, w->code, w->len);
+        return cpu;
+}
+
+static bool
+halted(const i8080 *cpu)
+{
+        i8080_regs regs;
+        i8080_get_regs(cpu, &regs);
+        return regs.halted;
+}
+
+/* Instructions to the HLT, counted once by single-stepping. */
+static uint64_t
+count_insns(const workload *w)
+{
+        i8080 *cpu = machine(w, I8080_ENGINE_INTERPRETER);
+        uint64_t n = 0;
+        while (i8080_step(cpu))
+                ++n;
+        i8080_free(cpu);
+        return n;
+}
+
+/* Fastest of BENCH_RUNS runs on one engine. False if it is not available. */
+static bool
+measure(const workload *w, int engine, int counter, result *res)
+{
+        res->seconds = -1;
+        for (int run = 0; run < BENCH_RUNS; ++run) {
+                i8080 *cpu = machine(w, engine);
+                if (!cpu)
+                        return false;
+
+                counter_start(counter);
+                double start = now();
+                do
+                        i8080_run(cpu, UINT64_MAX);
+                while (!halted(cpu));
+                double seconds = now() - start;
+                int64_t misses = counter_stop(counter);
+
+                if (res->seconds < 0 || seconds < res->seconds) {
+                        res->seconds = seconds;
+                        res->cache_misses = misses;
+                }
+                res->cycles = i8080_cycles(cpu);
+                i8080_free(cpu);
+        }
+        return true;
+}
+
+static void
+usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-o results] [-v version]\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+        const char *out_path = NULL;
+        const char *version = "unknown";
+        int c;
+        while ((c = getopt(argc, argv, "o:v:")) != -1) {
+                switch (c) {
+                        case 'o': { out_path = optarg; break; }
+                        case 'v': { version = optarg; break; }
+                        default: usage(argv[0]);
+                }
+        }
+        if (optind != argc)
+                usage(argv[0]);
+
+        FILE *out = NULL;
+        if (out_path && !(out = fopen(out_path, "w"))) {
+                perror(out_path);
+                return EXIT_FAILURE;
+        }
+        if (out)
+                fprintf(out, "# i8080 %s\n"
+                        "workload\tengine\tinsns\tcycles\tseconds\tmips\tns_per_insn\tcache_misses\n",
+                        version);
+
+        int counter = counter_open();
+        if (counter < 0)
+                fprintf(stderr, "cache misses not counted: %s\n", strerror(errno));
+
+        printf("%-10s %-8s %12s %10s %10s %14s\n", "workload", "engine", "insns", "MIPS", "ns/insn", "cache misses");
+        for (size_t i = 0; i < WORKLOAD_COUNT; ++i) {
+                const workload *w = &workloads[i];
+                uint64_t insns = count_insns(w);
+
+                for (int e = 0; e < (int)ENGINE_COUNT; ++e) {
+                        result res = { .insns = insns };
+                        if (!measure(w, e, counter, &res))
+                                continue;
+                        double mips = res.insns / res.seconds / 1e6;
+                        double ns = res.seconds * 1e9 / res.insns;
+
+                        char misses[24] = "-";
+                        if (res.cache_misses >= 0)
+                                snprintf(misses, sizeof misses, "%" PRId64, res.cache_misses);
+                        printf("%-10s %-8s %12" PRIu64 " %10.1f %10.2f %14s\n",
+                               w->name, engine_names[e], res.insns, mips, ns, misses);
+                        if (out)
+                                fprintf(out, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%.6f\t%.2f\t%.3f\t%s\n",
+                                        w->name, engine_names[e], res.insns, res.cycles,
+                                        res.seconds, mips, ns, misses);
+                }
+        }
+
+        if (counter >= 0)
+                close(counter);
+        if (out && fclose(out) != 0) {
+                perror(out_path);
+                return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+
+#include "block.h"
+
+
+/* First and last page touched by a block. The last may wrap around to page 0. */
+static inline uint8_t
+first_page(const block *b)
+{
+        return b->start >> 8;
+}
+
+static inline uint8_t
+last_page(const block *b)
+{
+        return (uint16_t)(b->start + b->size - 1) >> 8;
+}
+
+block_cache *
+block_cache_new(void)
+{
+        return calloc(1, sizeof(block_cache));
+}
+
+void
+block_cache_free(block_cache *bc)
+{
+        if (!bc)
+                return;
+
+        for (size_t i = 0; i < 0x10000; ++i)
+                free(bc->map[i]);
+        block_cache_reclaim(bc);
+        free(bc);
+}
+
+void
+block_cache_insert(block_cache *bc, block *b)
+{
+        b->valid = true;
+        bc->map[b->start] = b;
+
+        ++bc->code_page[first_page(b)];
+        if (last_page(b) != first_page(b))
+                ++bc->code_page[last_page(b)];
+}
+
+static void
+retire(block_cache *bc, block *b)
+{
+        bc->map[b->start] = NULL;
+        b->valid = false;
+
+        --bc->code_page[first_page(b)];
+        if (last_page(b) != first_page(b))
+                --bc->code_page[last_page(b)];
+
+        // The block may be the one executing, so it is only freed later
+        b->next_retired = bc->retired;
+        bc->retired = b;
+}
+
+/*
+ * Retire every block overlapping the page. Only blocks starting on the page or
+ * at most BLOCK_MAX_BYTES before it can reach into it.
+ */
+void
+block_cache_invalidate_page(block_cache *bc, uint8_t page)
+{
+        uint16_t base = (uint16_t)page << 8;
+        uint16_t addr = base - BLOCK_MAX_BYTES;
+
+        for (unsigned i = 0; i < BLOCK_MAX_BYTES + 256 && bc->code_page[page]; ++i, ++addr) {
+                block *b = bc->map[addr];
+                if (b && (first_page(b) == page || last_page(b) == page))
+                        retire(bc, b);
+        }
+}
+
+void
+block_cache_reclaim(block_cache *bc)
+{
+        while (bc->retired) {
+                block *b = bc->retired;
+                bc->retired = b->next_retired;
+                free(b);
+        }
+}
@@ -0,0 +1,93 @@
+#ifndef block_h
+#define block_h
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "idiom.h"
+
+
+/*
+ * Translation cache of basic blocks.
+ *
+ * A block is the straight-line run of instructions starting at some guest
+ * address, up to and including the first instruction that can transfer
+ * control. Each instruction is decoded once into a micro-op carrying its
+ * handler and its already assembled immediate operand, so executing a cached
+ * block involves no fetch or decode. Common pairs and triples of instructions
+ * share one handler, a superinstruction: the first micro-op of the sequence
+ * runs all of them, and the others are kept for runs that go one instruction
+ * at a time.
+ *
+ * Blocks are looked up by the guest address of their first instruction. A
+ * store into a page holding decoded code retires every block overlapping that
+ * page; retired blocks are freed by block_cache_reclaim() once no block is
+ * executing.
+ */
+
+/* Longest straight-line run decoded into one block. */
+#define BLOCK_MAX_OPS 32
+
+/* An instruction is at most three bytes long. */
+#define BLOCK_MAX_BYTES (3 * BLOCK_MAX_OPS)
+
+struct i8080;
+
+typedef struct uop uop;
+typedef void (*uop_fn)(struct i8080 *cpu, const uop *u);
+
+/* A block compiled to host code. */
+typedef void (*native_fn)(struct i8080 *cpu);
+
+struct uop {
+        uop_fn fn;
+        // Immediate data of the instruction, already assembled
+        uint16_t operand;
+        // Address of the instruction that follows in memory
+        uint16_t next_pc;
+        uint8_t cycles;
+        uint8_t op;
+        // Instructions the handler runs: more than 1 for a superinstruction
+        uint8_t span;
+};
+
+typedef struct block {
+        uint16_t start;
+        // Bytes of guest code covered
+        uint16_t size;
+        // Number of micro-ops
+        uint16_t len;
+        // Cleared when the guest overwrites the code of the block
+        bool valid;
+        // Times the block was interpreted, and its host code once compiled
+        uint32_t execs;
+        native_fn native;
+        // Copy or fill loop the block is, if any
+        idiom loop;
+        struct block *next_retired;
+        uop ops[];
+} block;
+
+typedef struct block_cache {
+        block *map[0x10000];
+        // Number of live blocks overlapping each 256-byte page
+        uint16_t code_page[256];
+        block *retired;
+} block_cache;
+
+
+block_cache *block_cache_new(void);
+void block_cache_free(block_cache *bc);
+void block_cache_insert(block_cache *bc, block *b);
+void block_cache_invalidate_page(block_cache *bc, uint8_t page);
+void block_cache_reclaim(block_cache *bc);
+
+static inline block *
+block_cache_lookup(const block_cache *bc, uint16_t pc)
+{
+        return bc->map[pc];
+}
+
+
+#endif
@@ -0,0 +1,758 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpm.h"
+
+
+/* Where the stubs live: the BDOS entry is also the top of the TPA. */
+#define CPM_BDOS 0xFE06
+#define CPM_BIOS 0xFF00
+#define CPM_BIOS_STUBS 0xFF40
+#define CPM_BIOS_CALLS 17
+
+#define CPM_FCB1 0x005C
+#define CPM_FCB2 0x006C
+#define CPM_DMA 0x0080
+
+/* Disk I/O unit of CP/M, and the records in one logical extent. */
+#define CPM_RECORD 128
+#define CPM_EXTENT_RECORDS 128
+
+/* Host files kept open at once, and the size of the block read ahead. */
+#define CPM_MAX_FILES 16
+#define CPM_BLOCK 4096
+
+/* Byte offsets into a file control block. */
+#define FCB_DR 0
+#define FCB_NAME 1
+#define FCB_EX 12
+#define FCB_S2 14
+#define FCB_RC 15
+#define FCB_D0 16
+#define FCB_CR 32
+#define FCB_R0 33
+#define FCB_SZ 36
+
+/* The 8.3 name of a file in FCB form: upper case, padded with spaces. */
+typedef char fcb_name[11];
+
+typedef struct {
+        fcb_name name;
+        int fd;
+        // Host file contents from block * CPM_BLOCK on, len bytes of them;
+        // block is -1 when nothing is cached
+        off_t block;
+        size_t len;
+        uint8_t buf[CPM_BLOCK];
+} cpm_file;
+
+typedef struct {
+        fcb_name name;
+        uint32_t records;
+} dir_entry;
+
+struct cpm {
+        i8080 *cpu;
+        char *dir;
+        uint16_t dma;
+        uint8_t drive;
+        uint8_t user;
+
+        cpm_file files[CPM_MAX_FILES];
+        unsigned victim;
+
+        // Matches of the last Search First not yet returned
+        dir_entry *found;
+        size_t found_len, found_next;
+
+        // Console byte read by a status check, or -1
+        int pending;
+};
+
+
+/* ------------------------------------------------------------------ memory */
+
+/* Copy a transfer into guest memory a page at a time. The TPA is all RAM. */
+static void
+store(cpm *sys, uint16_t addr, const void *buf, size_t len)
+{
+        mem_load(&sys->cpu->mem, addr, buf, len);
+        invalidate_code(sys->cpu, addr, len);
+}
+
+static void
+fetch(cpm *sys, uint16_t addr, void *buf, size_t len)
+{
+        mem_dump(&sys->cpu->mem, addr, buf, len);
+}
+
+static uint16_t
+reg_DE(const i8080 *cpu)
+{
+        return (uint16_t)(cpu->D << 8 | cpu->E);
+}
+
+
+/* ----------------------------------------------------------------- console */
+
+static void
+con_out(uint8_t c)
+{
+        putchar(c);
+}
+
+static bool
+con_ready(cpm *sys)
+{
+        if (sys->pending >= 0)
+                return true;
+        fflush(stdout);
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        return poll(&pfd, 1, 0) > 0;
+}
+
+/* Next console byte, with newlines turned into CP/M's CR. ^Z at end of input. */
+static uint8_t
+con_in(cpm *sys)
+{
+        uint8_t c;
+        if (sys->pending >= 0) {
+                c = (uint8_t)sys->pending;
+                sys->pending = -1;
+                return c;
+        }
+        fflush(stdout);
+        if (read(STDIN_FILENO, &c, 1) != 1)
+                return 0x1A;
+        return c == '\n' ? '\r' : c;
+}
+
+/* Function 10: read a line into the buffer at addr, max bytes first. */
+static void
+con_read_line(cpm *sys, uint16_t addr)
+{
+        uint8_t max = mem_read(&sys->cpu->mem, addr);
+        uint8_t line[256];
+        size_t n = 0;
+        while (n < max) {
+                uint8_t c = con_in(sys);
+                if (c == '\r' || (c == 0x1A && !n))
+                        break;
+                line[n++] = c;
+        }
+        uint8_t count = (uint8_t)n;
+        store(sys, addr + 1, &count, 1);
+        store(sys, addr + 2, line, n);
+}
+
+
+/* ------------------------------------------------------------------- names */
+
+static void
+name_of_fcb(const uint8_t *fcb, fcb_name name)
+{
+        for (int i = 0; i < 11; ++i)
+                name[i] = (char)toupper(fcb[FCB_NAME + i] & 0x7F);
+}
+
+/* The FCB name of a host file name, false if it is not a valid 8.3 name. */
+static bool
+name_of_host(const char *host, fcb_name name)
+{
+        const char *dot = strchr(host, '.');
+        size_t len = strlen(host);
+        size_t base = dot ? (size_t)(dot - host) : len;
+        if (!base || base > 8 || len - base > 4)
+                return false;
+
+        memset(name, ' ', sizeof(fcb_name));
+        for (size_t i = 0; i < len; ++i) {
+                unsigned char c = (unsigned char)host[i];
+                if (i == base)
+                        continue;
+                if (c <= ' ' || c >= 0x7F || strchr(".?*:;<>=,[]", c))
+                        return false;
+                name[i < base ? i : 8 + i - base - 1] = (char)toupper(c);
+        }
+        return true;
+}
+
+/* Lower-case host name for a new file. */
+static void
+host_of_name(const fcb_name name, char *host)
+{
+        size_t n = 0;
+        for (int i = 0; i < 8 && name[i] != ' '; ++i)
+                host[n++] = (char)tolower((unsigned char)name[i]);
+        if (name[8] != ' ') {
+                host[n++] = '.';
+                for (int i = 8; i < 11 && name[i] != ' '; ++i)
+                        host[n++] = (char)tolower((unsigned char)name[i]);
+        }
+        host[n] = '\0';
+}
+
+static bool
+name_matches(const fcb_name pattern, const fcb_name name)
+{
+        for (int i = 0; i < 11; ++i)
+                if (pattern[i] != '?' && pattern[i] != name[i])
+                        return false;
+        return true;
+}
+
+static void
+host_path(const cpm *sys, const char *host, char *path, size_t size)
+{
+        snprintf(path, size, "%s/%s", sys->dir, host);
+}
+
+/*
+ * Host path of the file with the given name, whatever its case. Returns false
+ * and the path a new file would get if there is none.
+ */
+static bool
+find_file(const cpm *sys, const fcb_name name, char *path, size_t size)
+{
+        DIR *d = opendir(sys->dir);
+        struct dirent *ent;
+        fcb_name other;
+        while (d && (ent = readdir(d))) {
+                if (name_of_host(ent->d_name, other) && !memcmp(other, name, sizeof(fcb_name))) {
+                        host_path(sys, ent->d_name, path, size);
+                        closedir(d);
+                        return true;
+                }
+        }
+        if (d)
+                closedir(d);
+        char host[13];
+        host_of_name(name, host);
+        host_path(sys, host, path, size);
+        return false;
+}
+
+
+/* ------------------------------------------------------------------- files */
+
+static cpm_file *
+lookup_file(cpm *sys, const fcb_name name)
+{
+        for (size_t i = 0; i < CPM_MAX_FILES; ++i)
+                if (sys->files[i].fd >= 0 && !memcmp(sys->files[i].name, name, sizeof(fcb_name)))
+                        return &sys->files[i];
+        return NULL;
+}
+
+static void
+close_file(cpm_file *f)
+{
+        if (f && f->fd >= 0) {
+                close(f->fd);
+                f->fd = -1;
+        }
+}
+
+/*
+ * The open host file for name, opened (or with create, created empty) if need
+ * be. Programs copy and reuse FCBs freely, so files are known by name rather
+ * than by FCB. Returns NULL if there is no such file.
+ */
+static cpm_file *
+open_file(cpm *sys, const fcb_name name, bool create)
+{
+        cpm_file *f = lookup_file(sys, name);
+        if (f && !create)
+                return f;
+        close_file(f);
+
+        char path[4096];
+        bool exists = find_file(sys, name, path, sizeof path);
+        int fd;
+        if (create)
+                fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        else if (!exists)
+                return NULL;
+        else if ((fd = open(path, O_RDWR)) < 0)
+                fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return NULL;
+
+        for (size_t i = 0; i < CPM_MAX_FILES && !f; ++i)
+                if (sys->files[i].fd < 0)
+                        f = &sys->files[i];
+        if (!f) {
+                f = &sys->files[sys->victim++ % CPM_MAX_FILES];
+                close_file(f);
+        }
+        memcpy(f->name, name, sizeof(fcb_name));
+        f->fd = fd;
+        f->block = -1;
+        return f;
+}
+
+static uint32_t
+file_records(const cpm_file *f)
+{
+        struct stat st;
+        if (fstat(f->fd, &st) < 0)
+                return 0;
+        return (uint32_t)((st.st_size + CPM_RECORD - 1) / CPM_RECORD);
+}
+
+/* Record number the sequential calls are at. */
+static uint32_t
+seq_record(const uint8_t *fcb)
+{
+        uint32_t extent = (uint32_t)(fcb[FCB_S2] & 0x3F) << 5 | (fcb[FCB_EX] & 0x1F);
+        return extent * CPM_EXTENT_RECORDS + (fcb[FCB_CR] & 0x7F);
+}
+
+/* Move the sequential position to rec, with RC for the extent it is in. */
+static void
+seek_record(const cpm_file *f, uint8_t *fcb, uint32_t rec)
+{
+        uint32_t extent = rec / CPM_EXTENT_RECORDS;
+        fcb[FCB_CR] = rec % CPM_EXTENT_RECORDS;
+        fcb[FCB_EX] = extent & 0x1F;
+        fcb[FCB_S2] = (uint8_t)(extent >> 5);
+
+        uint32_t records = f ? file_records(f) : 0;
+        uint32_t first = extent * CPM_EXTENT_RECORDS;
+        uint32_t left = records > first ? records - first : 0;
+        fcb[FCB_RC] = (uint8_t)(left < CPM_EXTENT_RECORDS ? left : CPM_EXTENT_RECORDS);
+}
+
+static uint32_t
+random_record(const uint8_t *fcb)
+{
+        return fcb[FCB_R0] | fcb[FCB_R0 + 1] << 8 | (uint32_t)fcb[FCB_R0 + 2] << 16;
+}
+
+/*
+ * Read record rec into the DMA buffer. Reads go through a block of the file
+ * read ahead in one host call. The last record of a file is padded with ^Z,
+ * CP/M's end of text. Returns the BDOS result, 1 past the end of the file.
+ */
+static uint8_t
+read_record(cpm *sys, cpm_file *f, uint32_t rec)
+{
+        off_t pos = (off_t)rec * CPM_RECORD;
+        off_t block = pos / CPM_BLOCK;
+        if (f->block != block) {
+                ssize_t n = pread(f->fd, f->buf, CPM_BLOCK, block * CPM_BLOCK);
+                f->block = n < 0 ? -1 : block;
+                f->len = n < 0 ? 0 : (size_t)n;
+        }
+        size_t off = (size_t)(pos % CPM_BLOCK);
+        if (f->block < 0 || off >= f->len)
+                return 1;
+
+        uint8_t record[CPM_RECORD];
+        size_t n = f->len - off < CPM_RECORD ? f->len - off : CPM_RECORD;
+        memcpy(record, f->buf + off, n);
+        memset(record + n, 0x1A, CPM_RECORD - n);
+        store(sys, sys->dma, record, CPM_RECORD);
+        return 0;
+}
+
+/* Write the DMA buffer to record rec, keeping the read-ahead block current. */
+static uint8_t
+write_record(cpm *sys, cpm_file *f, uint32_t rec)
+{
+        uint8_t record[CPM_RECORD];
+        fetch(sys, sys->dma, record, CPM_RECORD);
+
+        off_t pos = (off_t)rec * CPM_RECORD;
+        if (pwrite(f->fd, record, CPM_RECORD, pos) != CPM_RECORD)
+                return 2;
+        if (f->block == pos / CPM_BLOCK) {
+                size_t off = (size_t)(pos % CPM_BLOCK);
+                memcpy(f->buf + off, record, CPM_RECORD);
+                if (f->len < off + CPM_RECORD)
+                        f->len = off + CPM_RECORD;
+        }
+        return 0;
+}
+
+
+/* -------------------------------------------------------------- directory */
+
+static int
+compare_entries(const void *a, const void *b)
+{
+        return memcmp(((const dir_entry *)a)->name, ((const dir_entry *)b)->name, sizeof(fcb_name));
+}
+
+/* Collect the files matching pattern, in name order, for Search First/Next. */
+static void
+search(cpm *sys, const fcb_name pattern)
+{
+        sys->found_len = sys->found_next = 0;
+        DIR *d = opendir(sys->dir);
+        if (!d)
+                return;
+
+        size_t cap = 0;
+        struct dirent *ent;
+        fcb_name name;
+        while ((ent = readdir(d))) {
+                char path[4096];
+                struct stat st;
+                if (!name_of_host(ent->d_name, name) || !name_matches(pattern, name))
+                        continue;
+                host_path(sys, ent->d_name, path, sizeof path);
+                if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+                        continue;
+                if (sys->found_len == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        dir_entry *grown = realloc(sys->found, cap * sizeof *grown);
+                        if (!grown)
+                                break;
+                        sys->found = grown;
+                }
+                dir_entry *e = &sys->found[sys->found_len++];
+                memcpy(e->name, name, sizeof(fcb_name));
+                e->records = (uint32_t)((st.st_size + CPM_RECORD - 1) / CPM_RECORD);
+        }
+        closedir(d);
+        qsort(sys->found, sys->found_len, sizeof *sys->found, compare_entries);
+}
+
+/* Put the next match into the DMA buffer as a directory entry. */
+static uint8_t
+search_next(cpm *sys)
+{
+        if (sys->found_next >= sys->found_len)
+                return 0xFF;
+
+        const dir_entry *e = &sys->found[sys->found_next++];
+        uint8_t dirent[32] = { sys->user };
+        memcpy(dirent + FCB_NAME, e->name, sizeof(fcb_name));
+        if (e->records) {
+                uint32_t last = e->records - 1;
+                dirent[FCB_EX] = (last / CPM_EXTENT_RECORDS) & 0x1F;
+                dirent[FCB_S2] = (uint8_t)(last / CPM_EXTENT_RECORDS >> 5);
+                dirent[FCB_RC] = last % CPM_EXTENT_RECORDS + 1;
+        }
+        store(sys, sys->dma, dirent, sizeof dirent);
+        return 0;
+}
+
+
+/* -------------------------------------------------------------------- BDOS */
+
+static uint16_t
+bdos_file(cpm *sys, uint8_t func, uint16_t addr)
+{
+        uint8_t fcb[FCB_SZ];
+        fetch(sys, addr, fcb, sizeof fcb);
+        fcb_name name;
+        name_of_fcb(fcb, name);
+
+        cpm_file *f = NULL;
+        uint8_t ret = 0;
+        switch (func) {
+                case 15: {      // Open File
+                        if (!(f = open_file(sys, name, false)))
+                                return 0xFF;
+                        memset(fcb + FCB_D0, 0, 16);
+                        seek_record(f, fcb, seq_record(fcb));
+                        break;
+                }
+                case 16: {      // Close File
+                        char path[4096];
+                        if (!lookup_file(sys, name) && !find_file(sys, name, path, sizeof path))
+                                return 0xFF;
+                        close_file(lookup_file(sys, name));
+                        return 0;
+                }
+                case 17: {      // Search For First
+                        if (fcb[FCB_DR] == '?')
+                                memset(name, '?', sizeof name);
+                        search(sys, name);
+                        return search_next(sys);
+                }
+                case 19: {      // Delete File
+                        search(sys, name);
+                        if (!sys->found_len)
+                                return 0xFF;
+                        for (size_t i = 0; i < sys->found_len; ++i) {
+                                char path[4096];
+                                close_file(lookup_file(sys, sys->found[i].name));
+                                if (find_file(sys, sys->found[i].name, path, sizeof path))
+                                        unlink(path);
+                        }
+                        sys->found_len = 0;
+                        return 0;
+                }
+                case 20:        // Read Sequential
+                case 21: {      // Write Sequential
+                        if (!(f = open_file(sys, name, false)))
+                                return func == 20 ? 1 : 2;
+                        uint32_t rec = seq_record(fcb);
+                        ret = func == 20 ? read_record(sys, f, rec) : write_record(sys, f, rec);
+                        seek_record(f, fcb, ret ? rec : rec + 1);
+                        break;
+                }
+                case 22: {      // Make File
+                        if (!(f = open_file(sys, name, true)))
+                                return 0xFF;
+                        memset(fcb + FCB_D0, 0, 16);
+                        seek_record(f, fcb, seq_record(fcb));
+                        break;
+                }
+                case 23: {      // Rename File
+                        char from[4096], to[4096];
+                        fcb_name new_name;
+                        name_of_fcb(fcb + FCB_D0, new_name);
+                        close_file(lookup_file(sys, name));
+                        if (!find_file(sys, name, from, sizeof from))
+                                return 0xFF;
+                        find_file(sys, new_name, to, sizeof to);
+                        return rename(from, to) < 0 ? 0xFF : 0;
+                }
+                case 30: {      // Set File Attributes
+                        char path[4096];
+                        return find_file(sys, name, path, sizeof path) ? 0 : 0xFF;
+                }
+                case 33:        // Read Random
+                case 34:        // Write Random
+                case 40: {      // Write Random with Zero Fill
+                        if (fcb[FCB_R0 + 2])
+                                return 6;
+                        if (!(f = open_file(sys, name, false)))
+                                return func == 33 ? 1 : 2;
+                        uint32_t rec = random_record(fcb);
+                        ret = func == 33 ? read_record(sys, f, rec) : write_record(sys, f, rec);
+                        // Sequential calls carry on from the same record
+                        seek_record(f, fcb, rec);
+                        break;
+                }
+                case 35: {      // Compute File Size
+                        if (!(f = open_file(sys, name, false)))
+                                return 0xFF;
+                        uint32_t records = file_records(f);
+                        fcb[FCB_R0] = (uint8_t)records;
+                        fcb[FCB_R0 + 1] = (uint8_t)(records >> 8);
+                        fcb[FCB_R0 + 2] = (uint8_t)(records >> 16);
+                        break;
+                }
+                case 36: {      // Set Random Record
+                        uint32_t rec = seq_record(fcb);
+                        fcb[FCB_R0] = (uint8_t)rec;
+                        fcb[FCB_R0 + 1] = (uint8_t)(rec >> 8);
+                        fcb[FCB_R0 + 2] = (uint8_t)(rec >> 16);
+                        break;
+                }
+        }
+        store(sys, addr, fcb, sizeof fcb);
+        return ret;
+}
+
+/*
+ * BDOS call: function in C, parameter in E or DE. The result goes into HL,
+ * and as CP/M 2.2 does, also into A (low byte) and B (high byte).
+ */
+static void
+bdos(void *ctx, uint8_t port, uint8_t byte)
+{
+        (void)port;
+        (void)byte;
+        cpm *sys = ctx;
+        i8080 *cpu = sys->cpu;
+        uint16_t de = reg_DE(cpu);
+        uint16_t ret = 0;
+
+        switch (cpu->C) {
+                case 1: { ret = con_in(sys); break; }
+                case 2: { con_out(cpu->E); break; }
+                case 3: { ret = 0x1A; break; }          // Reader input
+                case 6: {                               // Direct console I/O
+                        if (cpu->E == 0xFF)
+                                ret = con_ready(sys) ? con_in(sys) : 0;
+                        else if (cpu->E == 0xFE)
+                                ret = con_ready(sys) ? 0xFF : 0;
+                        else
+                                con_out(cpu->E);
+                        break;
+                }
+                case 9: {                               // Print string up to '$'
+                        uint16_t a = de;
+                        for (size_t n = 0; n < ADDR_SPACE_SZ && mem_read(&cpu->mem, a) != '$'; ++n)
+                                con_out(mem_read(&cpu->mem, a++));
+                        break;
+                }
+                case 10: { con_read_line(sys, de); break; }
+                case 11: { ret = con_ready(sys) ? 0xFF : 0; break; }
+                case 12: { ret = 0x0022; break; }       // Version 2.2
+                case 13: { sys->dma = CPM_DMA; sys->drive = 0; break; }
+                case 14: { sys->drive = cpu->E & 0x0F; break; }
+                case 18: { ret = search_next(sys); break; }
+                case 24: { ret = (uint16_t)(1 << sys->drive); break; }
+                case 25: { ret = sys->drive; break; }
+                case 26: { sys->dma = de; break; }
+                case 32: {                              // Get/set user code
+                        if (cpu->E == 0xFF)
+                                ret = sys->user;
+                        else
+                                sys->user = cpu->E & 0x0F;
+                        break;
+                }
+                case 15: case 16: case 17: case 19: case 20: case 21: case 22:
+                case 23: case 30: case 33: case 34: case 35: case 36: case 40: {
+                        ret = bdos_file(sys, cpu->C, de);
+                        break;
+                }
+        }
+
+        cpu->L = (uint8_t)ret;
+        cpu->H = (uint8_t)(ret >> 8);
+        cpu->A = cpu->L;
+        cpu->B = cpu->H;
+}
+
+/*
+ * BIOS call, the number of the jump table entry in A. There are no disks at
+ * this level; everything goes through the BDOS.
+ */
+static void
+bios(void *ctx, uint8_t port, uint8_t func)
+{
+        (void)port;
+        cpm *sys = ctx;
+        i8080 *cpu = sys->cpu;
+
+        switch (func) {
+                case 2: { cpu->A = con_ready(sys) ? 0xFF : 0; break; }  // CONST
+                case 3: { cpu->A = con_in(sys); break; }                // CONIN
+                case 4: { con_out(cpu->C); break; }                     // CONOUT
+                case 7: { cpu->A = 0x1A; break; }                       // READER
+                case 9: { cpu->H = cpu->L = 0; break; }                 // SELDSK
+                case 13: case 14: { cpu->A = 1; break; }                // READ, WRITE
+                case 15: { cpu->A = 0xFF; break; }                      // LISTST
+                case 16: { cpu->H = cpu->B; cpu->L = cpu->C; break; }   // SECTRAN
+                default: { cpu->A = 0; break; }
+        }
+}
+
+
+/* ------------------------------------------------------------------- setup */
+
+/* The FCB the CCP makes of an argument "[d:]name[.ext]", * filling with ?. */
+static void
+parse_fcb(const char *arg, uint8_t *fcb)
+{
+        memset(fcb, 0, 16);
+        memset(fcb + FCB_NAME, ' ', 11);
+        if (!arg)
+                return;
+        if (isalpha((unsigned char)arg[0]) && arg[1] == ':') {
+                fcb[FCB_DR] = (uint8_t)(toupper((unsigned char)arg[0]) - 'A' + 1);
+                arg += 2;
+        }
+        for (int field = 0, at = FCB_NAME, end = FCB_NAME + 8; *arg; ++arg) {
+                if (*arg == '.' && !field) {
+                        field = 1;
+                        at = FCB_NAME + 8;
+                        end = FCB_NAME + 11;
+                } else if (*arg == '*') {
+                        while (at < end)
+                                fcb[at++] = '?';
+                } else if (at < end) {
+                        fcb[at++] = (uint8_t)toupper((unsigned char)*arg);
+                }
+        }
+}
+
+cpm *
+cpm_attach(i8080 *cpu, const char *dir, int argc, char *const argv[])
+{
+        cpm *sys = calloc(1, sizeof *sys);
+        if (!sys || !(sys->dir = strdup(dir))) {
+                free(sys);
+                return NULL;
+        }
+        sys->cpu = cpu;
+        sys->dma = CPM_DMA;
+        sys->pending = -1;
+        for (size_t i = 0; i < CPM_MAX_FILES; ++i)
+                sys->files[i].fd = -1;
+
+        // Page zero: warm boot and BDOS entry jumps, IOBYTE and drive
+        const uint8_t page_zero[8] = {
+                0xC3, (CPM_BIOS + 3) & 0xFF, (CPM_BIOS + 3) >> 8,
+                0, 0,
+                0xC3, CPM_BDOS & 0xFF, CPM_BDOS >> 8,
+        };
+        store(sys, 0, page_zero, sizeof page_zero);
+
+        // Function 0 is a warm boot, the rest go to the host
+        const uint8_t bdos_stub[] = {
+                0x79,                           // MOV A,C
+                0xB7,                           // ORA A
+                0xCA, 0x00, 0x00,               // JZ 0
+                0xD3, CPM_BDOS_PORT,            // OUT CPM_BDOS_PORT
+                0xC9,                           // RET
+        };
+        store(sys, CPM_BDOS, bdos_stub, sizeof bdos_stub);
+
+        // Boot and warm boot halt; the rest go to the host with their number
+        for (uint8_t i = 0; i < CPM_BIOS_CALLS; ++i) {
+                uint16_t stub = CPM_BIOS_STUBS + i * 5;
+                const uint8_t jump[] = { 0xC3, stub & 0xFF, stub >> 8 };
+                const uint8_t halt[] = { 0xF3, 0x76 };                  // DI; HLT
+                const uint8_t call[] = { 0x3E, i, 0xD3, CPM_BIOS_PORT, 0xC9 };  // MVI A,i; OUT; RET
+                store(sys, CPM_BIOS + i * 3, jump, sizeof jump);
+                if (i < 2)
+                        store(sys, stub, halt, sizeof halt);
+                else
+                        store(sys, stub, call, sizeof call);
+        }
+
+        // Default FCBs and the command tail, as the CCP leaves them
+        uint8_t fcbs[32];
+        parse_fcb(argc > 0 ? argv[0] : NULL, fcbs);
+        parse_fcb(argc > 1 ? argv[1] : NULL, fcbs + 16);
+        store(sys, CPM_FCB1, fcbs, sizeof fcbs);
+
+        uint8_t tail[128] = { 0 };
+        size_t n = 0;
+        for (int i = 0; i < argc; ++i) {
+                if (n < sizeof tail - 1)
+                        tail[1 + n++] = ' ';
+                for (const char *c = argv[i]; *c && n < sizeof tail - 1; ++c)
+                        tail[1 + n++] = (uint8_t)toupper((unsigned char)*c);
+        }
+        tail[0] = (uint8_t)n;
+        store(sys, CPM_DMA, tail, sizeof tail);
+
+        // Returning from the program lands on the warm boot at 0
+        const uint8_t ret_addr[2] = { 0, 0 };
+        cpu->SP = (CPM_BDOS & 0xFF00) - 2;
+        store(sys, cpu->SP, ret_addr, sizeof ret_addr);
+        cpu->PC = BEGIN_ADDR;
+
+        attach_port(cpu, CPM_BDOS_PORT, NULL, bdos, sys);
+        attach_port(cpu, CPM_BIOS_PORT, NULL, bios, sys);
+        return sys;
+}
+
+/* Close every file and flush the console. The machine must not run after. */
+void
+cpm_detach(cpm *sys)
+{
+        fflush(stdout);
+        for (size_t i = 0; i < CPM_MAX_FILES; ++i)
+                close_file(&sys->files[i]);
+        free(sys->found);
+        free(sys->dir);
+        free(sys);
+}
@@ -0,0 +1,35 @@
+#ifndef cpm_h
+#define cpm_h
+
+
+#include "i8080.h"
+
+
+/*
+ * CP/M 2.2 system calls, handled on the host.
+ *
+ * cpm_attach() turns a machine with a .COM program at BEGIN_ADDR into a
+ * CP/M system: page zero, a BDOS entry at 0x0005 and a BIOS jump table, all
+ * of them stubs that pass the call to the host through an OUT to
+ * CPM_BDOS_PORT or CPM_BIOS_PORT. Console calls go to stdin and stdout. Disk
+ * calls work on the files in one host directory, which every drive letter
+ * refers to; file names are matched without regard to case. Records are read
+ * and written with one host call each, straight between the file and the DMA
+ * buffer.
+ *
+ * The program ends with a warm boot (JMP 0, RET from the top level or BDOS
+ * function 0), which halts the CPU with interrupts disabled. A forked machine
+ * would share the parent's CP/M state and must not be run.
+ */
+
+#define CPM_BDOS_PORT 0xFE
+#define CPM_BIOS_PORT 0xFF
+
+typedef struct cpm cpm;
+
+
+cpm *cpm_attach(i8080 *cpu, const char *dir, int argc, char *const argv[]);
+void cpm_detach(cpm *sys);
+
+
+#endif
@@ -0,0 +1,412 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "i8080.h"
+
+
+/*
+ * Differential tester. A reference machine, stepped one instruction at a
+ * time through dispatch(), runs next to a candidate on another engine, both
+ * from the same image. Each time the candidate has run its budget of states,
+ * by default a single instruction or block, the reference catches up to the
+ * same cycle count and the two are compared: registers, flags, interrupt and
+ * halt state, console output and memory. The first difference is reported
+ * along with the instructions the reference ran last.
+ *
+ * The image is a ROM, a CP/M program using only BDOS console output (the
+ * usual CPU exercisers), or with -R one random stream per seed: all of
+ * memory filled with implemented opcodes other than HLT and random
+ * registers, run until an unrecognized opcode turns up or the cycle limit.
+ *
+ * Memory is compared page by page, skipping pages both machines still share
+ * from the fork they were created by, so a check costs about as much as the
+ * pages written since.
+ *
+ * Both machines share one build, so build options such as lazy flags are
+ * checked another way: with -D the reference runs alone and prints a digest
+ * of its state after every instruction, to be compared with the output of
+ * another build (see the difftest target of the Makefile). -DD prints each
+ * state instead, to find where two builds part.
+ */
+
+/* Instructions of reference history shown with a difference. */
+#define DIFF_HISTORY 16
+
+/* Default cycle limit of a random stream. */
+#define DIFF_STREAM_CYCLES 100000
+
+/* BDOS entry of -C, and the port its stub hands calls to the host on. */
+#define DIFF_BDOS 0xFE00
+#define DIFF_BDOS_PORT 0xFE
+
+typedef struct {
+        i8080 *cpu;
+        // Where console output goes: stdout for the reference, nowhere for
+        // the candidate
+        FILE *out;
+        uint64_t written;
+} console;
+
+typedef struct {
+        uint16_t pc;
+        opcode op;
+        uint64_t cycles;
+} step_record;
+
+typedef struct {
+        engine candidate;
+        uint64_t budget;
+        uint64_t max_cycles;
+        // 1 to print a digest of the reference's run, 2 each of its states
+        int digest;
+} diff_options;
+
+static const char *engine_names[] = {
+        [ENGINE_INTERPRETER] = "interp",
+        [ENGINE_BLOCK_CACHE] = "block",
+        [ENGINE_JIT] = "jit",
+};
+
+
+static void
+usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [-e interp|block|jit | -D[D]] [-b budget] [-c max_cycles] [-l load_addr]\n"
+                "          [-p entry] [-C] ROM\n"
+                "       %s [-e interp|block|jit | -D[D]] [-b budget] [-c max_cycles] -R seed [-N streams]\n",
+                prog, prog);
+        exit(EXIT_FAILURE);
+}
+
+static engine
+parse_engine(const char *name, const char *prog)
+{
+        for (size_t i = 0; i < sizeof engine_names / sizeof engine_names[0]; ++i)
+                if (!strcmp(name, engine_names[i]))
+                        return (engine)i;
+        usage(prog);
+        return ENGINE_INTERPRETER;
+}
+
+/* xorshift64*, for random streams reproducible from their seed. */
+static uint64_t
+next_random(uint64_t *state)
+{
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        return *state * 0x2545F4914F6CDD1DULL;
+}
+
+
+/* ---------------------------------------------------------------- console */
+
+/* BDOS functions 2 (character in E) and 9 (string at DE up to '$'). */
+static void
+bdos_out(void *ctx, uint8_t port, uint8_t byte)
+{
+        console *con = ctx;
+        i8080 *cpu = con->cpu;
+
+        if (cpu->C == 2) {
+                if (con->out)
+                        fputc(cpu->E, con->out);
+                ++con->written;
+        } else if (cpu->C == 9) {
+                uint16_t addr = (uint16_t)(cpu->D << 8 | cpu->E);
+                for (uint8_t c; (c = mem_read(&cpu->mem, addr)) != '$'; ++addr) {
+                        if (con->out)
+                                fputc(c, con->out);
+                        ++con->written;
+                }
+        }
+}
+
+/*
+ * Make the machine just enough of a CP/M system for programs that only
+ * write to the console: warm boot halts, BDOS goes to bdos_out().
+ */
+static void
+setup_cpm(i8080 *cpu)
+{
+        const uint8_t page_zero[8] = {
+                0xF3, 0x76, 0x00, 0x00, 0x00,           // DI; HLT
+                0xC3, DIFF_BDOS & 0xFF, DIFF_BDOS >> 8, // JMP DIFF_BDOS
+        };
+        const uint8_t bdos[] = { 0xD3, DIFF_BDOS_PORT, 0xC9 };  // OUT; RET
+        mem_load(&cpu->mem, 0, page_zero, sizeof page_zero);
+        mem_load(&cpu->mem, DIFF_BDOS, bdos, sizeof bdos);
+        // Returning from the program warm boots
+        cpu->SP = DIFF_BDOS - 2;
+        mem_load(&cpu->mem, cpu->SP, (const uint8_t[]){ 0, 0 }, 2);
+}
+
+
+/* ------------------------------------------------------------- comparison */
+
+static void
+print_regs(const char *who, const i8080 *cpu)
+{
+        fprintf(stderr, "  %-9s A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X PC=%04X SP=%04X"
+                       " INTE=%d halted=%d cycles=%" PRIu64 "\n",
+                       who, cpu->A, cpu->F, cpu->B, cpu->C, cpu->D, cpu->E, cpu->H, cpu->L, cpu->PC, cpu->SP,
+                       cpu->INTE, cpu->halted, cpu->cycles);
+}
+
+/* First address at which the memories differ, -1 if none. */
+static long
+memory_difference(const i8080 *ref, const i8080 *cand)
+{
+        for (size_t p = 0; p < PAGE_COUNT; ++p) {
+                const uint8_t *a = ref->mem.rd[p], *b = cand->mem.rd[p];
+                // Still shared since the fork, or both MMIO
+                if (a == b)
+                        continue;
+                if (!a || !b)
+                        return (long)(p << PAGE_SHIFT);
+                for (size_t i = 0; i < PAGE_SZ; ++i)
+                        if (a[i] != b[i])
+                                return (long)(p << PAGE_SHIFT | i);
+        }
+        return -1;
+}
+
+static bool
+same_state(const i8080 *ref, const i8080 *cand, const console *ref_con, const console *cand_con)
+{
+        return ref->A == cand->A && ref->F == cand->F
+            && ref->B == cand->B && ref->C == cand->C
+            && ref->D == cand->D && ref->E == cand->E
+            && ref->H == cand->H && ref->L == cand->L
+            && ref->PC == cand->PC && ref->SP == cand->SP
+            && ref->INTE == cand->INTE && ref->halted == cand->halted
+            && ref->cycles == cand->cycles
+            && ref_con->written == cand_con->written
+            && memory_difference(ref, cand) < 0;
+}
+
+static void
+report(const i8080 *ref, const i8080 *cand, const console *ref_con, const console *cand_con,
+       const diff_options *opts, uint16_t run_pc, uint64_t run_cycles,
+       const step_record *history, uint64_t steps)
+{
+        fprintf(stderr, "difference after %" PRIu64 " instructions, in the %s run from PC=%04X at cycle %" PRIu64 "\n",
+                       steps, engine_names[opts->candidate], run_pc, run_cycles);
+        print_regs("reference", ref);
+        print_regs(engine_names[opts->candidate], cand);
+        if (ref_con->written != cand_con->written)
+                fprintf(stderr, "  console output: %" PRIu64 " bytes against %" PRIu64 "\n",
+                               ref_con->written, cand_con->written);
+        long addr = memory_difference(ref, cand);
+        if (addr >= 0)
+                fprintf(stderr, "  memory first differs at %04lX: %02X against %02X\n", addr,
+                               mem_read(&ref->mem, (uint16_t)addr), mem_read(&cand->mem, (uint16_t)addr));
+
+        fprintf(stderr, "  last instructions of the reference:\n");
+        uint64_t first = steps > DIFF_HISTORY ? steps - DIFF_HISTORY : 0;
+        for (uint64_t i = first; i < steps; ++i) {
+                const step_record *r = &history[i % DIFF_HISTORY];
+                fprintf(stderr, "    %04X  %-10s cycle %" PRIu64 "\n", r->pc, opcode_name(r->op), r->cycles);
+        }
+}
+
+/*
+ * Run ref and cand, forks of one another, side by side until both halt or the
+ * cycle limit. Returns false, after reporting it, at the first difference.
+ */
+static bool
+run_pair(i8080 *ref, i8080 *cand, console *ref_con, console *cand_con, const diff_options *opts)
+{
+        step_record history[DIFF_HISTORY];
+        uint64_t steps = 0;
+
+        for (;;) {
+                uint16_t run_pc = cand->PC;
+                uint64_t run_cycles = cand->cycles;
+                emulate_cycles(cand, opts->budget);
+
+                while (ref->cycles < cand->cycles && !ref->halted) {
+                        history[steps++ % DIFF_HISTORY] =
+                                (step_record){ ref->PC, mem_read(&ref->mem, ref->PC), ref->cycles };
+                        step(ref);
+                }
+                if (!same_state(ref, cand, ref_con, cand_con)) {
+                        fflush(stdout);
+                        report(ref, cand, ref_con, cand_con, opts, run_pc, run_cycles, history, steps);
+                        return false;
+                }
+                // Nothing raises interrupts here, so a halt is for good
+                if (ref->halted || (opts->max_cycles && ref->cycles >= opts->max_cycles))
+                        break;
+        }
+        // Guest output first
+        fflush(stdout);
+        fprintf(stderr, "same after %" PRIu64 " instructions, %" PRIu64 " cycles%s\n", steps, ref->cycles,
+                       ref->faulted ? ", ended at an unrecognized opcode" : "");
+        return true;
+}
+
+/* Fork the candidate off ref and compare the two. */
+static bool
+diff(i8080 *ref, bool cpm, const diff_options *opts)
+{
+        ref->halt_on_fault = true;
+        i8080 *cand = i8080_fork(ref);
+        if (!cand || !select_engine(cand, opts->candidate)) {
+                perror("i8080_fork");
+                exit(EXIT_FAILURE);
+        }
+
+        console ref_con = { ref, stdout }, cand_con = { cand, NULL };
+        if (cpm) {
+                attach_port(ref, DIFF_BDOS_PORT, NULL, bdos_out, &ref_con);
+                attach_port(cand, DIFF_BDOS_PORT, NULL, bdos_out, &cand_con);
+        }
+
+        bool same = run_pair(ref, cand, &ref_con, &cand_con, opts);
+        i8080_free(cand);
+        return same;
+}
+
+
+/* ----------------------------------------------------------------- digest */
+
+static uint64_t
+digest_mix(uint64_t h, uint64_t word)
+{
+        h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+        return h ^ h >> 29;
+}
+
+/*
+ * Step ref alone until it halts or reaches the cycle limit and print a
+ * digest of its registers and cycle count after each instruction and of its
+ * memory at the end, or with opts->digest 2 each state as it goes.
+ */
+static void
+digest(i8080 *ref, const diff_options *opts)
+{
+        uint64_t h = 0, steps = 0;
+
+        ref->halt_on_fault = true;
+        while (!ref->halted && (!opts->max_cycles || ref->cycles < opts->max_cycles)) {
+                step(ref);
+                ++steps;
+                uint64_t regs = (uint64_t)ref->A << 56 | (uint64_t)ref->F << 48
+                              | (uint64_t)ref->B << 40 | (uint64_t)ref->C << 32
+                              | (uint64_t)ref->D << 24 | (uint64_t)ref->E << 16
+                              | (uint64_t)ref->H << 8 | ref->L;
+                uint64_t where = (uint64_t)ref->PC << 48 | (uint64_t)ref->SP << 32 | (uint32_t)ref->cycles;
+                h = digest_mix(digest_mix(h, regs), where);
+                if (opts->digest > 1)
+                        printf("%" PRIu64 ": A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X"
+                               " PC=%04X SP=%04X cycles=%" PRIu64 "\n",
+                               steps, ref->A, ref->F, ref->B, ref->C, ref->D, ref->E, ref->H, ref->L,
+                               ref->PC, ref->SP, ref->cycles);
+        }
+        h = digest_mix(h, state_hash(ref));
+        printf("digest %016" PRIx64 " after %" PRIu64 " instructions, %" PRIu64 " cycles\n",
+               h, steps, ref->cycles);
+}
+
+/* Random stream number seed: see the top of the file. */
+static bool
+diff_stream(uint64_t seed, const diff_options *opts)
+{
+        static uint8_t valid[256];
+        static size_t nvalid;
+        if (!nvalid)
+                for (int op = 0; op < 256; ++op)
+                        if (strcmp(opcode_name((opcode)op), "???") && op != 0x76)  // HLT
+                                valid[nvalid++] = (uint8_t)op;
+
+        uint64_t rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+        static uint8_t image[ADDR_SPACE_SZ];
+        for (size_t i = 0; i < ADDR_SPACE_SZ; ++i)
+                image[i] = valid[next_random(&rng) % nvalid];
+
+        i8080 ref;
+        reset(&ref);
+        mem_load(&ref.mem, 0, image, ADDR_SPACE_SZ);
+        uint64_t r = next_random(&rng);
+        ref.A = (uint8_t)r; ref.B = (uint8_t)(r >> 8);
+        ref.C = (uint8_t)(r >> 16); ref.D = (uint8_t)(r >> 24);
+        ref.E = (uint8_t)(r >> 32); ref.H = (uint8_t)(r >> 40);
+        ref.L = (uint8_t)(r >> 48);
+        // Bit 1 of F always reads 1, bits 3 and 5 always 0
+        flags_load(&ref, (uint8_t)(((r >> 56) & 0xD5) | 0x02));
+        r = next_random(&rng);
+        ref.PC = (uint16_t)r;
+        ref.SP = (uint16_t)(r >> 16);
+
+        bool same = true;
+        if (opts->digest) {
+                printf("stream %" PRIu64 ":%s", seed, opts->digest > 1 ? "\n" : " ");
+                digest(&ref, opts);
+        } else {
+                fprintf(stderr, "stream %" PRIu64 ": ", seed);
+                same = diff(&ref, false, opts);
+        }
+        release(&ref);
+        return same;
+}
+
+int
+main(int argc, char *argv[])
+{
+        diff_options opts = { ENGINE_JIT, 1, 0, 0 };
+        uint16_t load_addr = BEGIN_ADDR, entry = BEGIN_ADDR;
+        bool entry_set = false, cpm = false, random = false;
+        uint64_t seed = 0, streams = 1;
+        int c;
+
+        while ((c = getopt(argc, argv, "e:b:c:l:p:CR:N:D")) != -1) {
+                switch (c) {
+                        case 'e': { opts.candidate = parse_engine(optarg, argv[0]); break; }
+                        case 'b': { opts.budget = strtoull(optarg, NULL, 0); break; }
+                        case 'c': { opts.max_cycles = strtoull(optarg, NULL, 0); break; }
+                        case 'l': { load_addr = (uint16_t)strtoul(optarg, NULL, 0); break; }
+                        case 'p': { entry = (uint16_t)strtoul(optarg, NULL, 0); entry_set = true; break; }
+                        case 'C': { cpm = true; break; }
+                        case 'R': { random = true; seed = strtoull(optarg, NULL, 0); break; }
+                        case 'N': { streams = strtoull(optarg, NULL, 0); break; }
+                        case 'D': { ++opts.digest; break; }
+                        default: usage(argv[0]);
+                }
+        }
+        if (!opts.budget)
+                opts.budget = 1;
+
+        if (random) {
+                if (!opts.max_cycles)
+                        opts.max_cycles = DIFF_STREAM_CYCLES;
+                for (uint64_t i = 0; i < streams; ++i)
+                        if (!diff_stream(seed + i, &opts))
+                                return EXIT_FAILURE;
+                return EXIT_SUCCESS;
+        }
+
+        if (optind >= argc)
+                usage(argv[0]);
+        if (!entry_set)
+                entry = load_addr;
+        i8080 ref;
+        init_at(&ref, argv[optind], load_addr, entry);
+        if (cpm)
+                setup_cpm(&ref);
+        if (opts.digest) {
+                console con = { &ref, stdout };
+                if (cpm)
+                        attach_port(&ref, DIFF_BDOS_PORT, NULL, bdos_out, &con);
+                digest(&ref, &opts);
+                release(&ref);
+                return EXIT_SUCCESS;
+        }
+        bool same = diff(&ref, cpm, &opts);
+        release(&ref);
+        return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
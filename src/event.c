@@ -0,0 +1,92 @@
+#include <stdlib.h>
+
+#include "event.h"
+
+
+static bool
+before(const event *a, const event *b)
+{
+        return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static void
+sift_up(event_queue *q, size_t i)
+{
+        event e = q->heap[i];
+        while (i) {
+                size_t parent = (i - 1) / 2;
+                if (!before(&e, &q->heap[parent]))
+                        break;
+                q->heap[i] = q->heap[parent];
+                i = parent;
+        }
+        q->heap[i] = e;
+}
+
+static void
+sift_down(event_queue *q, size_t i)
+{
+        event e = q->heap[i];
+        for (;;) {
+                size_t child = 2 * i + 1;
+                if (child >= q->len)
+                        break;
+                if (child + 1 < q->len && before(&q->heap[child + 1], &q->heap[child]))
+                        ++child;
+                if (!before(&q->heap[child], &e))
+                        break;
+                q->heap[i] = q->heap[child];
+                i = child;
+        }
+        q->heap[i] = e;
+}
+
+/* Queue an event. Returns false if out of memory. */
+bool
+event_push(event_queue *q, uint64_t when, event_fn fn, void *ctx, int irq)
+{
+        if (q->len == q->cap) {
+                size_t cap = q->cap ? q->cap * 2 : 16;
+                event *heap = realloc(q->heap, cap * sizeof *heap);
+                if (!heap)
+                        return false;
+                q->heap = heap;
+                q->cap = cap;
+        }
+        q->heap[q->len] = (event){ when, q->seq++, fn, ctx, irq };
+        sift_up(q, q->len++);
+        return true;
+}
+
+/* Take the first event off a queue that is not empty. */
+event
+event_pop(event_queue *q)
+{
+        event first = q->heap[0];
+        if (--q->len) {
+                q->heap[0] = q->heap[q->len];
+                sift_down(q, 0);
+        }
+        return first;
+}
+
+/* Drop every callback to fn with ctx. */
+void
+event_cancel(event_queue *q, event_fn fn, void *ctx)
+{
+        size_t kept = 0;
+        for (size_t i = 0; i < q->len; ++i)
+                if (q->heap[i].fn != fn || q->heap[i].ctx != ctx || !fn)
+                        q->heap[kept++] = q->heap[i];
+        q->len = kept;
+        for (size_t i = q->len / 2; i-- > 0;)
+                sift_down(q, i);
+}
+
+void
+event_queue_free(event_queue *q)
+{
+        free(q->heap);
+        q->heap = NULL;
+        q->len = q->cap = 0;
+}
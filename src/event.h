@@ -0,0 +1,53 @@
+#ifndef event_h
+#define event_h
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Events in guest time.
+ *
+ * A queue of actions keyed on the cycle count at which they are due: raising
+ * an interrupt line, or calling a device back. Events due at the same cycle
+ * run in the order they were scheduled. The queue is a binary min-heap, so the
+ * next deadline is always at the front.
+ */
+
+struct i8080;
+
+typedef void (*event_fn)(struct i8080 *cpu, void *ctx);
+
+typedef struct {
+        uint64_t when;
+        // Order of scheduling, to break ties
+        uint64_t seq;
+        // Callback, or NULL to raise interrupt line irq
+        event_fn fn;
+        void *ctx;
+        int irq;
+} event;
+
+typedef struct {
+        event *heap;
+        size_t len, cap;
+        uint64_t seq;
+} event_queue;
+
+
+bool event_push(event_queue *q, uint64_t when, event_fn fn, void *ctx, int irq);
+event event_pop(event_queue *q);
+void event_cancel(event_queue *q, event_fn fn, void *ctx);
+void event_queue_free(event_queue *q);
+
+/* Cycle count the first event is due at, UINT64_MAX if there is none. */
+static inline uint64_t
+event_next(const event_queue *q)
+{
+        return q->len ? q->heap[0].when : UINT64_MAX;
+}
+
+
+#endif
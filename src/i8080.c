@@ -1,7 +1,13 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "i8080.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
 
 
 /* -------------------------------------------------------------------------- |
@@ -244,7 +250,10 @@
 
 /*** IMMEDIATE INSTRUCTIONS ***/
 
-#define LXI 0x01
+#define LXI_BC 0x01  /* LXI B (Load register pair immediate). The third byte of the instruction is loaded into the register B, and the second byte into the register C. */
+#define LXI_DE 0x11  /* LXI D (Load register pair immediate). The third byte of the instruction is loaded into the register D, and the second byte into the register E. */
+#define LXI_HL 0x21  /* LXI H (Load register pair immediate). The third byte of the instruction is loaded into the register H, and the second byte into the register L. */
+#define LXI_SP 0x31  /* LXI SP (Load register pair immediate). The two bytes of immediate data replace the contents of the stack pointer, the third byte being the most significant. */
 
 #define MVI_B 0x06  /* MVI B (Move Immediate Data). The byte of immediate data is stored in the register B. */
 #define MVI_C 0x0E  /* MVI C (Move Immediate Data). The byte of immediate data is stored in the register C. */
@@ -319,6 +328,7 @@
 #define RST_000 0xC7  /* RST 000 (Restart). The contents of the program counter PC are pushed onto the stack, providing a return address for later use by a RETURN instruction. Program execution continues at the memory address 0000 0000 00XX X000 where XXX is the suffix of the instruction, a number in the range 000 to 111 (in base 2). */
 #define RST_001 0xCF  /* RST 001 (Restart). The contents of the program counter PC are pushed onto the stack, providing a return address for later use by a RETURN instruction. Program execution continues at the memory address 0000 0000 00XX X000 where XXX is the suffix of the instruction, a number in the range 000 to 111 (in base 2). */
 #define RST_010 0xD7  /* RST 010 (Restart). The contents of the program counter PC are pushed onto the stack, providing a return address for later use by a RETURN instruction. Program execution continues at the memory address 0000 0000 00XX X000 where XXX is the suffix of the instruction, a number in the range 000 to 111 (in base 2). */
+#define RST_011 0xDF  /* RST 011 (Restart). The contents of the program counter PC are pushed onto the stack, providing a return address for later use by a RETURN instruction. Program execution continues at the memory address 0000 0000 00XX X000 where XXX is the suffix of the instruction, a number in the range 000 to 111 (in base 2). */
 #define RST_100 0xE7  /* RST 100 (Restart). The contents of the program counter PC are pushed onto the stack, providing a return address for later use by a RETURN instruction. Program execution continues at the memory address 0000 0000 00XX X000 where XXX is the suffix of the instruction, a number in the range 000 to 111 (in base 2). */
 #define RST_101 0xEF  /* RST 101 (Restart). The contents of the program counter PC are pushed onto the stack, providing a return address for later use by a RETURN instruction. Program execution continues at the memory address 0000 0000 00XX X000 where XXX is the suffix of the instruction, a number in the range 000 to 111 (in base 2). */
 #define RST_110 0xF7  /* RST 110 (Restart). The contents of the program counter PC are pushed onto the stack, providing a return address for later use by a RETURN instruction. Program execution continues at the memory address 0000 0000 00XX X000 where XXX is the suffix of the instruction, a number in the range 000 to 111 (in base 2). */
@@ -333,7 +343,7 @@
 
 /*** INPUT/OUTPUT INSTRUCTIONS ***/
 
-#define IN 0xDD  /* IN (Input). An eight-bit data byte is read from input device number exp and replaces the contents of the accumulator register A. */
+#define IN 0xDB  /* IN (Input). An eight-bit data byte is read from input device number exp and replaces the contents of the accumulator register A. */
 #define OUT 0xD3  /* OUT (Output). The contents of the accumulator register A are arent to output device number exp. */
 
 
@@ -343,6 +353,180 @@
 
 
 
+/* -------------------------------------------------------------------------- |
+ |                                                                            |
+ |                             INSTRUCTION TIMING                             |
+ |                                                                            |
+ | -------------------------------------------------------------------------- */
+
+/*
+ * Number of states (T-states) taken by each instruction, indexed by opcode.
+ *
+ * Conditional calls and returns are listed with their cost when the condition
+ * is false; taking the branch costs CYCLES_COND_TAKEN more. Conditional jumps
+ * take 10 states either way. Unimplemented opcodes carry the cost of the
+ * documented instruction they alias on the chip.
+ */
+static const uint8_t cycle_table[256] = {
+     /*  x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xA  xB  xC  xD  xE  xF */
+         4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,  /* 0x */
+         4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,  /* 1x */
+         4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5,  7,  4,  /* 2x */
+         4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5,  7,  4,  /* 3x */
+         5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  /* 4x */
+         5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  /* 5x */
+         5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  /* 6x */
+         7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5,  /* 7x */
+         4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  /* 8x */
+         4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  /* 9x */
+         4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  /* Ax */
+         4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  /* Bx */
+         5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,  /* Cx */
+         5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,  /* Dx */
+         5, 10, 10, 18, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11,  /* Ex */
+         5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11,  /* Fx */
+};
+
+/*
+ * Length in bytes of each instruction, opcode included, indexed by opcode.
+ */
+static const uint8_t length_table[256] = {
+     /*  x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xA  xB  xC  xD  xE  xF */
+         1,  3,  1,  1,  1,  1,  2,  1,  1,  1,  1,  1,  1,  1,  2,  1,  /* 0x */
+         1,  3,  1,  1,  1,  1,  2,  1,  1,  1,  1,  1,  1,  1,  2,  1,  /* 1x */
+         1,  3,  3,  1,  1,  1,  2,  1,  1,  1,  3,  1,  1,  1,  2,  1,  /* 2x */
+         1,  3,  3,  1,  1,  1,  2,  1,  1,  1,  3,  1,  1,  1,  2,  1,  /* 3x */
+         1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 4x */
+         1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 5x */
+         1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 6x */
+         1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 7x */
+         1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 8x */
+         1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 9x */
+         1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* Ax */
+         1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* Bx */
+         1,  1,  3,  3,  3,  1,  2,  1,  1,  1,  3,  3,  3,  3,  2,  1,  /* Cx */
+         1,  1,  3,  2,  3,  1,  2,  1,  1,  1,  3,  2,  3,  3,  2,  1,  /* Dx */
+         1,  1,  3,  1,  3,  1,  2,  1,  1,  1,  3,  1,  3,  3,  2,  1,  /* Ex */
+         1,  1,  3,  1,  3,  1,  2,  1,  1,  1,  3,  1,  3,  3,  2,  1,  /* Fx */
+};
+
+/* Extra states spent by a conditional CALL or RET whose condition holds. */
+#define CYCLES_COND_TAKEN 6
+
+/* States spent acknowledging an interrupt, which executes an RST. */
+#define CYCLES_INTERRUPT 11
+
+
+/* -------------------------------------------------------------------------- |
+ |                                                                            |
+ |                                FLAG TABLES                                 |
+ |                                                                            |
+ | -------------------------------------------------------------------------- */
+
+/*
+ * Sign, Zero and Parity bits of a result byte, indexed by the byte.
+ */
+const uint8_t szp_table[256] = {
+        0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+};
+
+/*
+ * Carry and Auxiliary Carry bits of an addition, indexed by the carry vector
+ * a ^ b ^ result of the 9-bit result. Bit 8 of the vector is the carry out of
+ * bit 7 and bit 4 the carry out of bit 3.
+ */
+static const uint8_t add_cy_ac_table[512] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+};
+
+/*
+ * Carry and Auxiliary Carry bits of a subtraction, indexed like
+ * add_cy_ac_table. Bit 8 of the vector is the borrow into bit 7, which sets
+ * Carry. The 8080 subtracts by adding the two's complement, so Auxiliary
+ * Carry is set when there is no borrow out of bit 3.
+ */
+static const uint8_t sub_cy_ac_table[512] = {
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+};
+
+
 /* -------------------------------------------------------------------------- |
  |                                                                            |
  |                      INSTRUCTION SUPPORTING FUNCTIONS                      |
@@ -355,113 +539,140 @@ pack_u16(uint8_t R_HI, uint8_t R_LO)
         return ((uint16_t)R_HI << 8) | (uint16_t) R_LO;
 }
 
+/*
+ * Sign, Zero and Parity all follow from the result byte alone. With lazy flags
+ * only the byte is kept, and the bits are worked out when something reads them.
+ */
 inline static void
-update_sign_flag(i8080 *cpu, uint8_t x)
+update_szp_flags(i8080 *cpu, uint8_t x)
 {
-        flag_write(cpu, F_S, x & F_S);
+#if I8080_LAZY_FLAGS
+        cpu->szp_result = x;
+        cpu->szp_lazy = true;
+#else
+        cpu->F = (cpu->F & ~F_SZP) | szp_bits(x);
+#endif
 }
 
-inline static void
-update_zero_flag(i8080 *cpu, uint8_t x)
+/* a + b + carry, setting all five condition bits. */
+inline static uint8_t
+alu_add(i8080 *cpu, uint8_t a, uint8_t b, uint8_t carry)
 {
-        flag_write(cpu, F_Z, (x == 0) ? F_Z : 0);
+        uint16_t res = a + b + carry;
+        flag_write(cpu, F_CY | F_AC, add_cy_ac_table[a ^ b ^ res]);
+        update_szp_flags(cpu, res);
+        return res;
 }
 
-inline static void
-update_parity_flag(i8080 *cpu, uint16_t x)
+/* a - b - borrow, setting all five condition bits. */
+inline static uint8_t
+alu_sub(i8080 *cpu, uint8_t a, uint8_t b, uint8_t borrow)
 {
-        flag_write(cpu, F_P, parity(x) ? F_P : 0);
+        uint16_t res = (a - b - borrow) & 0x1FF;
+        flag_write(cpu, F_CY | F_AC, sub_cy_ac_table[a ^ b ^ res]);
+        update_szp_flags(cpu, res);
+        return res;
 }
 
+/* Logical operations reset Carry; AND sets Auxiliary Carry from bit 3 of the operands. */
 inline static void
-update_carry_flag(i8080 *cpu, uint16_t res)
+update_logic_flags(i8080 *cpu, uint8_t res, uint8_t ac)
 {
-        flag_write(cpu, F_CY, (res > 0xFF) ? F_CY : 0);
+        flag_write(cpu, F_CY | F_AC, ac);
+        update_szp_flags(cpu, res);
 }
 
-inline static void
-update_carry_flag_on_borrow(i8080 *cpu, uint16_t mend, uint16_t send)
+inline static uint8_t
+immediate_byte(i8080 *cpu)
 {
-        // Set the carry flag if the minuend is smaller than the subtrahend
-        flag_write(cpu, F_CY, (mend < send) ? F_CY : 0);
+        return mem_read(&cpu->mem, cpu->PC++);
 }
 
-inline static void
-update_aux_carry_flag(i8080 *cpu, uint8_t x)
+inline static uint16_t
+immediate_byte_pair_lo_first(i8080 *cpu)
 {
-        flag_write(cpu, F_AC, (x & 0x10) ? F_AC : 0);
+        uint8_t lo = immediate_byte(cpu);
+        uint8_t hi = immediate_byte(cpu);
+        return pack_u16(hi, lo);
 }
 
 inline static void
-update_aux_carry_flag_on_borrow(i8080 *cpu, uint16_t mend, uint16_t send)
+write_mem_at(i8080 *cpu, uint16_t addr, uint8_t byte)
 {
-        // Set the auxiliary carry flag if the lower nibble of the minuend
-        // is smaller than the lower nibble of the subtrahend
-        flag_write(cpu, F_AC, ((mend & 0x0F) < (send & 0x0F)) ? F_CY : 0);
+#if I8080_TRACE
+        if (__builtin_expect(cpu->trace != NULL, 0))
+                trace_write(cpu->trace, addr, byte);
+#endif
+        mem_write(&cpu->mem, addr, byte);
+        // Stores into translated code retire the blocks decoded from it
+        if (cpu->bcache && cpu->bcache->code_page[addr >> 8])
+                block_cache_invalidate_page(cpu->bcache, addr >> 8);
 }
 
-inline static uint8_t
-immediate_byte(i8080 *cpu)
+inline static void
+push_stack_PC(i8080 *cpu)
 {
-        return cpu->mem[cpu->PC + 1];
+        write_mem_at(cpu, --cpu->SP, (uint8_t)(cpu->PC >> 8));
+        write_mem_at(cpu, --cpu->SP, (uint8_t)(cpu->PC & 0x00FF));
 }
 
-inline static uint8_t *
-immediate_pbyte(i8080 *cpu)
+inline static void
+subroutine_return(i8080 *cpu)
 {
-        return &cpu->mem[cpu->PC + 1];
+        uint8_t ret_addr_lo = stack_pop(cpu);
+        uint8_t ret_addr_hi = stack_pop(cpu);
+        cpu->PC = pack_u16(ret_addr_hi, ret_addr_lo);
 }
 
-inline static uint16_t
-immediate_byte_pair_lo_first(i8080 *cpu)
+inline static void
+call_subroutine(i8080 *cpu, uint16_t addr)
 {
-        return pack_u16(cpu->mem[cpu->PC + 2], cpu->mem[cpu->PC + 1]);
+        push_stack_PC(cpu);
+        cpu->PC = addr;
 }
 
-inline static uint16_t
-immediate_byte_pair_hi_first(i8080 *cpu)
+inline static void
+jump_if(i8080 *cpu, bool cond, uint16_t addr)
 {
-        return pack_u16(cpu->mem[cpu->PC + 1], cpu->mem[cpu->PC + 2]);
+        if (cond)
+                cpu->PC = addr;
 }
 
 inline static void
-push_stack_PC(i8080 *cpu)
+call_if(i8080 *cpu, bool cond, uint16_t addr)
 {
-        cpu->mem[--cpu->SP] = (uint8_t)(cpu->PC >> 8);
-        cpu->mem[--cpu->SP] = (uint8_t)(cpu->PC & 0x00FF);
+        if (cond) {
+                push_stack_PC(cpu);
+                cpu->PC = addr;
+                cpu->cycles += CYCLES_COND_TAKEN;
+        }
 }
 
 inline static void
-subroutine_return(i8080 *cpu)
+return_if(i8080 *cpu, bool cond)
 {
-        uint8_t ret_addr_lo = stack_pop(cpu);
-        uint8_t ret_addr_hi = stack_pop(cpu);
-        cpu->PC = pack_u16(ret_addr_hi, ret_addr_lo);
+        if (cond) {
+                subroutine_return(cpu);
+                cpu->cycles += CYCLES_COND_TAKEN;
+        }
 }
 
 inline static void
-call_from_immediate_data(i8080 *cpu)
+write_mem(i8080 *cpu, uint8_t hi, uint8_t lo, uint8_t byte)
 {
-        uint8_t addr_lo = cpu->mem[cpu->PC + 1];
-        uint8_t addr_hi = cpu->mem[cpu->PC + 2];
-        uint16_t addr_ret = cpu->PC + 3;
-        uint8_t addr_ret_hi = (uint8_t)(addr_ret >> 8);
-        uint8_t addr_ret_lo = (uint8_t)(addr_ret & 0x00FF);
-        cpu->mem[--cpu->SP] = addr_ret_hi;
-        cpu->mem[--cpu->SP] = addr_ret_lo;
-        cpu->PC = pack_u16(addr_hi, addr_lo);
+        write_mem_at(cpu, pack_u16(hi, lo), byte);
 }
 
 inline static void
-write_mem(i8080 *cpu, uint8_t hi, uint8_t lo, uint8_t byte)
+write_mem_HL(i8080 *cpu, uint8_t byte)
 {
-        cpu->mem[pack_u16(hi, lo)] = byte;
+        write_mem(cpu, cpu->H, cpu->L, byte);
 }
 
 inline static uint8_t
 read_mem(i8080 *cpu, uint8_t hi, uint8_t lo)
 {
-        return cpu->mem[pack_u16(hi, lo)];
+        return mem_read(&cpu->mem, pack_u16(hi, lo));
 }
 
 inline static uint8_t
@@ -482,10 +693,17 @@ read_mem_DE(i8080 *cpu)
         return read_mem(cpu, cpu->D, cpu->E);
 }
 
+/* For handlers taking their operand by pointer. Not to be written through. */
 inline static uint8_t *
 read_memp(i8080 *cpu, uint8_t hi, uint8_t lo)
 {
-        return &cpu->mem[pack_u16(hi, lo)];
+        uint16_t addr = pack_u16(hi, lo);
+        const uint8_t *p = cpu->mem.rd[addr >> PAGE_SHIFT];
+        if (!p) {
+                cpu->mmio_latch = mem_read_slow(&cpu->mem, addr);
+                return &cpu->mmio_latch;
+        }
+        return (uint8_t *)&p[addr & (PAGE_SZ - 1)];
 }
 
 inline static uint8_t *
@@ -516,208 +734,145 @@ read_memp_DE(i8080 *cpu)
 inline static void
 OP_ADC(i8080 *cpu, uint8_t *reg)
 {
-        uint8_t carry = flag_get(cpu, F_CY);
-        uint16_t sum = cpu->A + *reg + carry;
-        cpu->A = sum & 0xFF;
-        uint8_t half = (cpu->A & 0xF) + (*reg & 0xF) + carry;
-        update_aux_carry_flag(cpu, half);
-        update_carry_flag(cpu, sum);
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, sum);
+        cpu->A = alu_add(cpu, cpu->A, *reg, flag_get(cpu, F_CY));
 }
 
 inline static void
 OP_ADD(i8080 *cpu, uint8_t *reg)
 {
-        uint16_t sum = cpu->A + *reg;
-        cpu->A = sum & 0xFF;
-        uint8_t half = (cpu->A & 0xF) + (*reg & 0xF);
-        update_aux_carry_flag(cpu, half);
-        update_carry_flag(cpu, sum);
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, sum);
+        cpu->A = alu_add(cpu, cpu->A, *reg, 0);
 }
 
 inline static void
-OP_ACI(i8080 *cpu)
+OP_ACI(i8080 *cpu, uint8_t byte)
 {
-        uint8_t carry = flag_get(cpu, F_CY);
-        uint8_t byte = cpu->mem[cpu->PC + 1];
-        uint16_t sum = cpu->A + byte + carry;
-        cpu->A = sum & 0xFF;
-        uint8_t half = (cpu->A & 0xF) + byte + carry;
-        update_carry_flag(cpu, sum);
-        update_sign_flag(cpu, sum);
-        update_zero_flag(cpu, sum);
-        update_parity_flag(cpu, sum);
-        update_aux_carry_flag(cpu, half);
+        cpu->A = alu_add(cpu, cpu->A, byte, flag_get(cpu, F_CY));
 }
 
 inline static void
-OP_ADI(i8080 *cpu)
+OP_ADI(i8080 *cpu, uint8_t byte)
 {
-        uint8_t byte = cpu->mem[cpu->PC + 1];
-        uint16_t sum = cpu->A + byte;
-        cpu->A = sum & 0xFF;
-        uint8_t half = (cpu->A & 0xF) + byte;
-        update_carry_flag(cpu, sum);
-        update_sign_flag(cpu, sum);
-        update_zero_flag(cpu, sum);
-        update_parity_flag(cpu, sum);
-        update_aux_carry_flag(cpu, half);
+        cpu->A = alu_add(cpu, cpu->A, byte, 0);
 }
 
 inline static void
 OP_ANA(i8080 *cpu, uint8_t reg)
 {
+        uint8_t ac = ((cpu->A | reg) & 0x08) ? F_AC : 0;
         cpu->A &= reg;
-        flag_clear(cpu, F_CY);
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, cpu->A);
+        update_logic_flags(cpu, cpu->A, ac);
 }
 
 inline static void
-OP_ANI(i8080 *cpu)
+OP_ANI(i8080 *cpu, uint8_t byte)
 {
-        cpu->A &= cpu->mem[cpu->PC + 1];
-        flag_clear(cpu, F_CY);
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, cpu->A);
+        OP_ANA(cpu, byte);
 }
 
 inline static void
-OP_CALL(i8080 *cpu)
+OP_CALL(i8080 *cpu, uint16_t addr)
 {
-        call_from_immediate_data(cpu);
+        call_subroutine(cpu, addr);
 }
 
 inline static void
-OP_CC(i8080 *cpu)
+OP_CC(i8080 *cpu, uint16_t addr)
 {
-        if (flag_get(cpu, F_CY))
-                call_from_immediate_data(cpu);
+        call_if(cpu, flag_get(cpu, F_CY), addr);
 }
 
 inline static void
-OP_CM(i8080 *cpu)
+OP_CM(i8080 *cpu, uint16_t addr)
 {
-        if (flag_get(cpu, F_S))
-                call_from_immediate_data(cpu);
+        call_if(cpu, flag_get(cpu, F_S), addr);
 }
 
 inline static void
 OP_CMP(i8080 *cpu, uint8_t *reg)
 {
-        uint16_t sum = cpu->A - *reg;
-        update_carry_flag_on_borrow(cpu, cpu->A, *reg);
-        update_aux_carry_flag_on_borrow(cpu, cpu->A, *reg);
-        update_sign_flag(cpu, sum);
-        update_zero_flag(cpu, sum);
-        update_parity_flag(cpu, sum);
+        alu_sub(cpu, cpu->A, *reg, 0);
 }
 
 inline static void
-OP_CNC(i8080 *cpu)
+OP_CNC(i8080 *cpu, uint16_t addr)
 {
-        if (!flag_get(cpu, F_CY))
-                call_from_immediate_data(cpu);
+        call_if(cpu, !flag_get(cpu, F_CY), addr);
 }
 
 inline static void
-OP_CNZ(i8080 *cpu)
+OP_CNZ(i8080 *cpu, uint16_t addr)
 {
-        if (!flag_get(cpu, F_Z))
-                call_from_immediate_data(cpu);
+        call_if(cpu, !flag_get(cpu, F_Z), addr);
 }
 
 inline static void
-OP_CP(i8080 *cpu)
+OP_CP(i8080 *cpu, uint16_t addr)
 {
-        if (!flag_get(cpu, F_S))
-                call_from_immediate_data(cpu);
+        call_if(cpu, !flag_get(cpu, F_S), addr);
 }
 
 inline static void
-OP_CPE(i8080 *cpu)
+OP_CPE(i8080 *cpu, uint16_t addr)
 {
-        if (flag_get(cpu, F_P))
-                call_from_immediate_data(cpu);
+        call_if(cpu, flag_get(cpu, F_P), addr);
 }
 
 inline static void
-OP_CPI(i8080 *cpu)
+OP_CPI(i8080 *cpu, uint8_t byte)
 {
-        uint8_t byte = cpu->mem[cpu->PC + 1];
-        uint16_t sum = cpu->A - byte;
-        update_carry_flag_on_borrow(cpu, cpu->A, byte);
-        update_aux_carry_flag_on_borrow(cpu, cpu->A, byte);
-        update_sign_flag(cpu, sum);
-        update_zero_flag(cpu, sum);
-        update_parity_flag(cpu, sum);
+        alu_sub(cpu, cpu->A, byte, 0);
 }
 
 inline static void
-OP_CPO(i8080 *cpu)
+OP_CPO(i8080 *cpu, uint16_t addr)
 {
-        if (!flag_get(cpu, F_P))
-                call_from_immediate_data(cpu);
+        call_if(cpu, !flag_get(cpu, F_P), addr);
 }
 
 inline static void
-OP_CZ(i8080 *cpu)
+OP_CZ(i8080 *cpu, uint16_t addr)
 {
-        if (flag_get(cpu, F_Z))
-                call_from_immediate_data(cpu);
+        call_if(cpu, flag_get(cpu, F_Z), addr);
 }
 
 inline static void
 OP_DAA(i8080 *cpu)
 {
         uint8_t corr = 0;
+        uint8_t carry = flag_get(cpu, F_CY);
 
-        if (((cpu->A & 0x0F) > 9) || flag_get(cpu, F_AC)) {
-                uint8_t lo = cpu->A & 0x0F;
-                uint16_t inc = cpu->A + 6;
-                cpu->A = inc & 0xFF;
-                flag_write(cpu, F_AC, (lo + 6 > 0x0F) ? F_AC : 0);
-        }
-
-        if (((cpu->A >> 4) > 9) || flag_get(cpu, F_CY)) {
-                uint16_t hi = cpu->A & 0xF0;
-                uint16_t tmp = ((cpu->A >> 4) + 6) & 0x0F;
-                cpu->A = (cpu->A & ~0xF0) | tmp;
-                flag_write(cpu, F_CY, (hi + 6 > 0xFF) ? F_CY : 0);
+        if (((cpu->A & 0x0F) > 9) || flag_get(cpu, F_AC))
+                corr |= 0x06;
 
+        if ((cpu->A > 0x99) || carry) {
+                corr |= 0x60;
+                carry = F_CY;
         }
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, cpu->A);
+
+        uint16_t res = cpu->A + corr;
+        flag_write(cpu, F_CY | F_AC, carry | (add_cy_ac_table[cpu->A ^ corr ^ res] & F_AC));
+        update_szp_flags(cpu, res);
+        cpu->A = res;
 }
 
 inline static void
 OP_DAD_BC(i8080 *cpu)
 {
         uint16_t HL = pack_u16(cpu->H, cpu->L);
-        uint16_t BC = pack_u16(cpu->B, cpu->C);
-        uint32_t sum = HL + BC;
+        uint32_t sum = HL + pack_u16(cpu->B, cpu->C);
         flag_write(cpu, F_CY, (sum > 0xFFFF) ? F_CY : 0);
-        cpu->H = sum & 0x00F0;
-        cpu->L = sum & 0x000F;
+        cpu->H = (uint8_t)(sum >> 8);
+        cpu->L = (uint8_t)(sum & 0xFF);
 }
 
 inline static void
 OP_DAD_DE(i8080 *cpu)
 {
         uint16_t HL = pack_u16(cpu->H, cpu->L);
-        uint16_t DE = pack_u16(cpu->D, cpu->E);
-        uint32_t sum = HL + DE;
+        uint32_t sum = HL + pack_u16(cpu->D, cpu->E);
         flag_write(cpu, F_CY, (sum > 0xFFFF) ? F_CY : 0);
-        cpu->H = sum & 0x00F0;
-        cpu->L = sum & 0x000F;
+        cpu->H = (uint8_t)(sum >> 8);
+        cpu->L = (uint8_t)(sum & 0xFF);
 }
 
 inline static void
@@ -726,8 +881,8 @@ OP_DAD_HL(i8080 *cpu)
         uint16_t HL = pack_u16(cpu->H, cpu->L);
         uint32_t sum = HL + HL;
         flag_write(cpu, F_CY, (sum > 0xFFFF) ? F_CY : 0);
-        cpu->H = sum & 0x00F0;
-        cpu->L = sum & 0x000F;
+        cpu->H = (uint8_t)(sum >> 8);
+        cpu->L = (uint8_t)(sum & 0xFF);
 }
 
 inline static void
@@ -736,18 +891,26 @@ OP_DAD_SP(i8080 *cpu)
         uint16_t HL = pack_u16(cpu->H, cpu->L);
         uint32_t sum = HL + cpu->SP;
         flag_write(cpu, F_CY, (sum > 0xFFFF) ? F_CY : 0);
-        cpu->H = sum & 0x00F0;
-        cpu->L = sum & 0x000F;
+        cpu->H = (uint8_t)(sum >> 8);
+        cpu->L = (uint8_t)(sum & 0xFF);
 }
 
 inline static void
 OP_DCR(i8080 *cpu, uint8_t *reg)
 {
-        --(*reg);
-        update_sign_flag(cpu, *reg);
-        update_zero_flag(cpu, *reg);
-        update_parity_flag(cpu, *reg);
-        update_aux_carry_flag(cpu, *reg);
+        uint16_t res = (*reg - 1) & 0x1FF;
+        // The Carry bit is not affected
+        flag_write(cpu, F_AC, sub_cy_ac_table[*reg ^ 1 ^ res] & F_AC);
+        update_szp_flags(cpu, res);
+        *reg = res;
+}
+
+inline static void
+OP_DCR_M(i8080 *cpu)
+{
+        uint8_t byte = read_mem_HL(cpu);
+        OP_DCR(cpu, &byte);
+        write_mem_HL(cpu, byte);
 }
 
 inline static void
@@ -774,31 +937,42 @@ inline static void
 OP_EI(i8080 *cpu)
 {
         cpu->INTE = true;
+        cpu->ei_cycles = cpu->cycles;
+        // A pending interrupt is taken once the next instruction has run
+        if (interrupt_pending(cpu))
+                check_soon(cpu);
 }
 
 inline static void
 OP_HLT(i8080 *cpu)
 {
         cpu->halted = true;
+        // Have the engine notice the halt
+        check_soon(cpu);
 }
 
 inline static void
-OP_IN(i8080 *cpu, uint8_t *reg)
+OP_IN(i8080 *cpu, uint8_t port)
 {
+        cpu->A = port_in(&cpu->io, port);
 }
 
 inline static void
 OP_INR(i8080 *cpu, uint8_t *reg)
 {
-        uint8_t carry = flag_get(cpu, F_CY);
-        uint16_t ans = *reg + carry + 1;
-        *reg = ans & 0xFF;
-        uint8_t half = (*reg & 0xF) + carry + 1;
-        update_carry_flag(cpu, ans);
-        update_sign_flag(cpu, ans);
-        update_zero_flag(cpu, ans);
-        update_parity_flag(cpu, ans);
-        update_aux_carry_flag(cpu, half);
+        uint16_t res = *reg + 1;
+        // The Carry bit is not affected
+        flag_write(cpu, F_AC, add_cy_ac_table[*reg ^ 1 ^ res] & F_AC);
+        update_szp_flags(cpu, res);
+        *reg = res;
+}
+
+inline static void
+OP_INR_M(i8080 *cpu)
+{
+        uint8_t byte = read_mem_HL(cpu);
+        OP_INR(cpu, &byte);
+        write_mem_HL(cpu, byte);
 }
 
 inline static void
@@ -816,71 +990,63 @@ OP_INX_PAIR(i8080 *cpu, uint8_t *rega, uint8_t *regb)
 }
 
 inline static void
-OP_JC(i8080 *cpu)
+OP_JC(i8080 *cpu, uint16_t addr)
 {
-        if (flag_get(cpu, F_CY))
-                cpu->PC = immediate_byte_pair_lo_first(cpu);
+        jump_if(cpu, flag_get(cpu, F_CY), addr);
 }
 
 inline static void
-OP_JM(i8080 *cpu)
+OP_JM(i8080 *cpu, uint16_t addr)
 {
-        if (flag_get(cpu, F_S))
-                cpu->PC = immediate_byte_pair_lo_first(cpu);
+        jump_if(cpu, flag_get(cpu, F_S), addr);
 }
 
 inline static void
-OP_JMP(i8080 *cpu)
+OP_JMP(i8080 *cpu, uint16_t addr)
 {
-        cpu->PC = immediate_byte_pair_lo_first(cpu);
+        cpu->PC = addr;
 }
 
 inline static void
-OP_JNC(i8080 *cpu)
+OP_JNC(i8080 *cpu, uint16_t addr)
 {
-        if (!flag_get(cpu, F_CY))
-                cpu->PC = immediate_byte_pair_lo_first(cpu);
+        jump_if(cpu, !flag_get(cpu, F_CY), addr);
 }
 
 inline static void
-OP_JNZ(i8080 *cpu)
+OP_JNZ(i8080 *cpu, uint16_t addr)
 {
-        if (!flag_get(cpu, F_Z))
-                cpu->PC = immediate_byte_pair_lo_first(cpu);
+        jump_if(cpu, !flag_get(cpu, F_Z), addr);
 }
 
 inline static void
-OP_JP(i8080 *cpu)
+OP_JP(i8080 *cpu, uint16_t addr)
 {
-        if (!flag_get(cpu, F_S))
-                cpu->PC = immediate_byte_pair_lo_first(cpu);
+        jump_if(cpu, !flag_get(cpu, F_S), addr);
 }
 
 inline static void
-OP_JPE(i8080 *cpu)
+OP_JPE(i8080 *cpu, uint16_t addr)
 {
-        if (flag_get(cpu, F_P))
-                cpu->PC = immediate_byte_pair_lo_first(cpu);
+        jump_if(cpu, flag_get(cpu, F_P), addr);
 }
 
 inline static void
-OP_JPO(i8080 *cpu)
+OP_JPO(i8080 *cpu, uint16_t addr)
 {
-        if (!flag_get(cpu, F_P))
-                cpu->PC = immediate_byte_pair_lo_first(cpu);
+        jump_if(cpu, !flag_get(cpu, F_P), addr);
 }
 
 inline static void
-OP_JZ(i8080 *cpu)
+OP_JZ(i8080 *cpu, uint16_t addr)
 {
-        if (flag_get(cpu, F_Z))
-                cpu->PC = immediate_byte_pair_lo_first(cpu);
+        jump_if(cpu, flag_get(cpu, F_Z), addr);
 }
 
 inline static void
-OP_LDA(i8080 *cpu)
+OP_LDA(i8080 *cpu, uint16_t addr)
 {
-        cpu->A = cpu->mem[immediate_byte_pair_lo_first(cpu)];
+        cpu->A = mem_read(&cpu->mem, addr);
 }
 
 inline static void
@@ -890,31 +1056,37 @@ OP_LDAX(i8080 *cpu, uint8_t *mem)
 }
 
 inline static void
-OP_LHLD(i8080 *cpu)
+OP_LHLD(i8080 *cpu, uint16_t addr)
 {
-        uint16_t addr = immediate_byte_pair_lo_first(cpu);
-        cpu->L = cpu->mem[addr];
-        cpu->H = cpu->mem[addr + 1];
+        cpu->L = mem_read(&cpu->mem, addr);
+        cpu->H = mem_read(&cpu->mem, addr + 1);
+}
+
+inline static void
+OP_LXI_PAIR(i8080 *cpu, uint8_t *rega, uint8_t *regb, uint16_t word)
+{
+        *rega = (uint8_t)(word >> 8);
+        *regb = (uint8_t)(word & 0xFF);
+}
+
+inline static void
+OP_LXI_SP(i8080 *cpu, uint16_t word)
+{
+        cpu->SP = word;
 }
 
 inline static void
 OP_ORA(i8080 *cpu, uint8_t *req)
 {
         cpu->A |= *req;
-        flag_clear(cpu, F_CY);
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, cpu->A);
+        update_logic_flags(cpu, cpu->A, 0);
 }
 
 inline static void
-OP_ORI(i8080 *cpu)
+OP_ORI(i8080 *cpu, uint8_t byte)
 {
-        cpu->A |= cpu->mem[cpu->PC + 1];
-        flag_clear(cpu, F_CY);
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, cpu->A);
+        cpu->A |= byte;
+        update_logic_flags(cpu, cpu->A, 0);
 }
 
 inline static void
@@ -924,14 +1096,27 @@ OP_MOV(uint8_t *dst, uint8_t *src)
 }
 
 inline static void
-OP_MVI(i8080 *cpu, uint8_t *req)
+OP_MOV_M(i8080 *cpu, uint8_t reg)
+{
+        write_mem_HL(cpu, reg);
+}
+
+inline static void
+OP_MVI(i8080 *cpu, uint8_t *req, uint8_t byte)
 {
-        *req = cpu->mem[cpu->PC++];
+        *req = byte;
 }
 
 inline static void
-OP_OUT(i8080 *cpu, uint8_t *reg)
+OP_MVI_M(i8080 *cpu, uint8_t byte)
 {
+        write_mem_HL(cpu, byte);
+}
+
+inline static void
+OP_OUT(i8080 *cpu, uint8_t port)
+{
+        port_out(&cpu->io, port, cpu->A);
 }
 
 inline static void
@@ -943,82 +1128,79 @@ OP_PCHL(i8080 *cpu)
 inline static void
 OP_POP_BC(i8080 *cpu)
 {
-        cpu->C = cpu->mem[cpu->SP++];
-        cpu->B = cpu->mem[cpu->SP++];
+        cpu->C = mem_read(&cpu->mem, cpu->SP++);
+        cpu->B = mem_read(&cpu->mem, cpu->SP++);
 }
 
 inline static void
 OP_POP_DE(i8080 *cpu)
 {
-        cpu->E = cpu->mem[cpu->SP++];
-        cpu->D = cpu->mem[cpu->SP++];
+        cpu->E = mem_read(&cpu->mem, cpu->SP++);
+        cpu->D = mem_read(&cpu->mem, cpu->SP++);
 }
 
 inline static void
 OP_POP_HL(i8080 *cpu)
 {
-        cpu->L = cpu->mem[cpu->SP++];
-        cpu->H = cpu->mem[cpu->SP++];
+        cpu->L = mem_read(&cpu->mem, cpu->SP++);
+        cpu->H = mem_read(&cpu->mem, cpu->SP++);
 }
 
 inline static void
 OP_POP_PSW(i8080 *cpu)
 {
-        cpu->F = cpu->mem[cpu->SP++];
-        cpu->A = cpu->mem[cpu->SP++];
+        flags_load(cpu, mem_read(&cpu->mem, cpu->SP++));
+        cpu->A = mem_read(&cpu->mem, cpu->SP++);
 }
 
 inline static void
 OP_PUSH_BC(i8080 *cpu)
 {
-        cpu->mem[--cpu->SP] = cpu->B;
-        cpu->mem[--cpu->SP] = cpu->C;
+        write_mem_at(cpu, --cpu->SP, cpu->B);
+        write_mem_at(cpu, --cpu->SP, cpu->C);
 }
 
 inline static void
 OP_PUSH_DE(i8080 *cpu)
 {
-        cpu->mem[--cpu->SP] = cpu->D;
-        cpu->mem[--cpu->SP] = cpu->E;
+        write_mem_at(cpu, --cpu->SP, cpu->D);
+        write_mem_at(cpu, --cpu->SP, cpu->E);
 }
 
 inline static void
 OP_PUSH_HL(i8080 *cpu)
 {
-        cpu->mem[--cpu->SP] = cpu->H;
-        cpu->mem[--cpu->SP] = cpu->L;
+        write_mem_at(cpu, --cpu->SP, cpu->H);
+        write_mem_at(cpu, --cpu->SP, cpu->L);
 }
 
 inline static void
 OP_PUSH_PSW(i8080 *cpu)
 {
-        cpu->mem[--cpu->SP] = cpu->A;
-        cpu->mem[--cpu->SP] = cpu->F;
+        write_mem_at(cpu, --cpu->SP, cpu->A);
+        write_mem_at(cpu, --cpu->SP, flags_read(cpu));
 }
 
 inline static void
 OP_RAL(i8080 *cpu)
 {
-        uint8_t hi = cpu->A >> 7;
-        flag_write(cpu, F_CY, hi ? F_CY : 0);
-        cpu->A = ((cpu->A >> 1) & ~(1 << 7)) | (hi << 7);
-
+        uint8_t carry = flag_get(cpu, F_CY);
+        flag_write(cpu, F_CY, (cpu->A & 0x80) ? F_CY : 0);
+        cpu->A = (uint8_t)(cpu->A << 1) | carry;
 }
 
 inline static void
 OP_RAR(i8080 *cpu)
 {
-        uint8_t lo = cpu->A & 0x01;
-        flag_write(cpu, F_CY, lo ? F_CY : 0);
-        cpu->A = ((cpu->A >> 1) & ~(1 << 7)) | (lo << 7);
-
+        uint8_t carry = flag_get(cpu, F_CY);
+        flag_write(cpu, F_CY, (cpu->A & 0x01) ? F_CY : 0);
+        cpu->A = (cpu->A >> 1) | (carry << 7);
 }
 
 inline static void
 OP_RC(i8080 *cpu)
 {
-        if (flag_get(cpu, F_CY))
-                subroutine_return(cpu);
+        return_if(cpu, flag_get(cpu, F_CY));
 }
 
 inline static void
@@ -1032,43 +1214,37 @@ OP_RLC(i8080 *cpu)
 {
         uint8_t hi = cpu->A >> 7;
         flag_write(cpu, F_CY, hi ? F_CY : 0);
-        cpu->A = ((cpu->A << 1) & ~0x01) | hi;
-
+        cpu->A = (uint8_t)(cpu->A << 1) | hi;
 }
 
 inline static void
 OP_RM(i8080 *cpu)
 {
-        if (flag_get(cpu, F_S))
-                subroutine_return(cpu);
+        return_if(cpu, flag_get(cpu, F_S));
 }
 
 inline static void
 OP_RNC(i8080 *cpu)
 {
-        if (!flag_get(cpu, F_CY))
-                subroutine_return(cpu);
+        return_if(cpu, !flag_get(cpu, F_CY));
 }
 
 inline static void
 OP_RP(i8080 *cpu)
 {
-        if (!flag_get(cpu, F_S))
-                subroutine_return(cpu);
+        return_if(cpu, !flag_get(cpu, F_S));
 }
 
 inline static void
 OP_RPE(i8080 *cpu)
 {
-        if (flag_get(cpu, F_P))
-                subroutine_return(cpu);
+        return_if(cpu, flag_get(cpu, F_P));
 }
 
 inline static void
 OP_RPO(i8080 *cpu)
 {
-        if (!flag_get(cpu, F_P))
-                subroutine_return(cpu);
+        return_if(cpu, !flag_get(cpu, F_P));
 }
 
 inline static void
@@ -1076,106 +1252,94 @@ OP_RRC(i8080 *cpu)
 {
         uint8_t lo = cpu->A & 0x01;
         flag_write(cpu, F_CY, lo ? F_CY : 0);
-        cpu->A = ((cpu->A >> 1) & ~(1 << 7)) | (lo << 7);
-
+        cpu->A = (cpu->A >> 1) | (lo << 7);
 }
 
 inline static void
 OP_RST_000(i8080 *cpu)
 {
         push_stack_PC(cpu);
-        cpu->PC = 0x00C7;
+        cpu->PC = 0x0000;
 }
 
 inline static void
 OP_RST_001(i8080 *cpu)
 {
         push_stack_PC(cpu);
-        cpu->PC = 0x00CF;
+        cpu->PC = 0x0008;
 }
 
 inline static void
 OP_RST_010(i8080 *cpu)
 {
         push_stack_PC(cpu);
-        cpu->PC = 0x00D7;
+        cpu->PC = 0x0010;
+}
+
+inline static void
+OP_RST_011(i8080 *cpu)
+{
+        push_stack_PC(cpu);
+        cpu->PC = 0x0018;
 }
 
 inline static void
 OP_RST_100(i8080 *cpu)
 {
         push_stack_PC(cpu);
-        cpu->PC = 0x00E7;
+        cpu->PC = 0x0020;
 }
 
 inline static void
 OP_RST_101(i8080 *cpu)
 {
         push_stack_PC(cpu);
-        cpu->PC = 0x00EF;
+        cpu->PC = 0x0028;
 }
 
 inline static void
 OP_RST_110(i8080 *cpu)
 {
         push_stack_PC(cpu);
-        cpu->PC = 0x00F7;
+        cpu->PC = 0x0030;
 }
 
 inline static void
 OP_RST_111(i8080 *cpu)
 {
         push_stack_PC(cpu);
-        cpu->PC = 0x00FF;
+        cpu->PC = 0x0038;
 }
 
 inline static void
 OP_RZ(i8080 *cpu)
 {
-        if (flag_get(cpu, F_Z))
-                subroutine_return(cpu);
+        return_if(cpu, flag_get(cpu, F_Z));
 }
 
 inline static void
 OP_RNZ(i8080 *cpu)
 {
-        if (!flag_get(cpu, F_Z))
-                subroutine_return(cpu);
+        return_if(cpu, !flag_get(cpu, F_Z));
 }
 
 inline static void
 OP_SBB(i8080 *cpu, uint8_t *reg)
 {
-        uint16_t send = *reg + flag_get(cpu, F_CY);
-        uint16_t sum = cpu->A - send;
-        update_carry_flag_on_borrow(cpu, cpu->A, send);
-        update_aux_carry_flag_on_borrow(cpu, cpu->A, send);
-        cpu->A = sum & 0xFF;
-        update_sign_flag(cpu, sum);
-        update_zero_flag(cpu, sum);
-        update_parity_flag(cpu, sum);
+        cpu->A = alu_sub(cpu, cpu->A, *reg, flag_get(cpu, F_CY));
 }
 
 inline static void
-OP_SBI(i8080 *cpu)
+OP_SBI(i8080 *cpu, uint8_t byte)
 {
-        uint8_t carry = flag_get(cpu, F_CY);
-        uint16_t byte = cpu->mem[cpu->PC + 1] + carry;
-        uint16_t sum = cpu->A - byte;
-        update_carry_flag_on_borrow(cpu, cpu->A, byte);
-        update_aux_carry_flag_on_borrow(cpu, cpu->A, byte);
-        cpu->A = sum & 0xFF;
-        update_sign_flag(cpu, sum);
-        update_zero_flag(cpu, sum);
-        update_parity_flag(cpu, sum);
+        cpu->A = alu_sub(cpu, cpu->A, byte, flag_get(cpu, F_CY));
 }
 
 inline static void
-OP_SHLD(i8080 *cpu)
+OP_SHLD(i8080 *cpu, uint16_t addr)
 {
-        uint16_t addr = immediate_byte_pair_lo_first(cpu);
-        cpu->mem[addr] = cpu->L;
-        cpu->mem[addr + 1] = cpu->H;
+        write_mem_at(cpu, addr, cpu->L);
+        write_mem_at(cpu, addr + 1, cpu->H);
 }
 
 inline static void
@@ -1185,40 +1349,27 @@ OP_SPHL(i8080 *cpu)
 }
 
 inline static void
-OP_STA(i8080 *cpu)
+OP_STA(i8080 *cpu, uint16_t addr)
 {
-        cpu->mem[immediate_byte_pair_lo_first(cpu)] = cpu->A;
+        write_mem_at(cpu, addr, cpu->A);
 }
 
 inline static void
-OP_STAX(i8080 *cpu, uint8_t *mem)
+OP_STAX(i8080 *cpu, uint8_t hi, uint8_t lo)
 {
-        *mem = cpu->A;
+        write_mem(cpu, hi, lo, cpu->A);
 }
 
 inline static void
 OP_SUB(i8080 *cpu, uint8_t *reg)
 {
-        uint16_t sum = cpu->A - *reg;
-        update_carry_flag_on_borrow(cpu, cpu->A, *reg);
-        update_aux_carry_flag_on_borrow(cpu, cpu->A, *reg);
-        cpu->A = sum & 0xFF;
-        update_sign_flag(cpu, sum);
-        update_zero_flag(cpu, sum);
-        update_parity_flag(cpu, sum);
+        cpu->A = alu_sub(cpu, cpu->A, *reg, 0);
 }
 
 inline static void
-OP_SUI(i8080 *cpu)
+OP_SUI(i8080 *cpu, uint8_t byte)
 {
-        uint8_t byte = cpu->mem[cpu->PC + 1];
-        uint16_t sum = cpu->A - byte;
-        update_carry_flag_on_borrow(cpu, cpu->A, byte);
-        update_aux_carry_flag_on_borrow(cpu, cpu->A, byte);
-        cpu->A = sum & 0xFF;
-        update_sign_flag(cpu, sum);
-        update_zero_flag(cpu, sum);
-        update_parity_flag(cpu, sum);
+        cpu->A = alu_sub(cpu, cpu->A, byte, 0);
 }
 
 inline static void
@@ -1235,29 +1386,26 @@ OP_XCHG(i8080 *cpu)
 inline static void
 OP_XTHL(i8080 *cpu)
 {
-        cpu->L = cpu->mem[cpu->SP];
-        cpu->H = cpu->mem[cpu->SP + 1];
+        uint8_t lo = mem_read(&cpu->mem, cpu->SP);
+        uint8_t hi = mem_read(&cpu->mem, cpu->SP + 1);
+        write_mem_at(cpu, cpu->SP, cpu->L);
+        write_mem_at(cpu, cpu->SP + 1, cpu->H);
+        cpu->L = lo;
+        cpu->H = hi;
 }
 
 inline static void
 OP_XRA(i8080 *cpu, uint8_t *req)
 {
         cpu->A ^= *req;
-        flag_clear(cpu, F_CY);
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, cpu->A);
-        update_aux_carry_flag(cpu, cpu->A);
+        update_logic_flags(cpu, cpu->A, 0);
 }
 
 inline static void
-OP_XRI(i8080 *cpu)
+OP_XRI(i8080 *cpu, uint8_t byte)
 {
-        cpu->A ^= cpu->mem[cpu->PC + 1];
-        flag_clear(cpu, F_CY);
-        update_sign_flag(cpu, cpu->A);
-        update_zero_flag(cpu, cpu->A);
-        update_parity_flag(cpu, cpu->A);
+        cpu->A ^= byte;
+        update_logic_flags(cpu, cpu->A, 0);
 }
 
 
@@ -1267,343 +1415,1109 @@ OP_XRI(i8080 *cpu)
  |                                                                            |
  | -------------------------------------------------------------------------- */
 
+/* Immediate operands of instructions.def, fetched from the instruction stream. */
+#define IMM8 immediate_byte(cpu)
+#define IMM16 immediate_byte_pair_lo_first(cpu)
+
+static inline void dispatch(i8080 *cpu, opcode op);
+static void run_blocks(i8080 *cpu);
+
+/*
+ * Observers of each instruction about to run at pc, called before its states
+ * are added. Compiled code bypasses them, so it is not run while any is on.
+ */
+#if I8080_PROFILE
+#define PROFILING(cpu) ((cpu)->prof != NULL)
+#else
+#define PROFILING(cpu) false
+#endif
+
+#if I8080_TRACE
+#define TRACING(cpu) ((cpu)->trace != NULL)
+#else
+#define TRACING(cpu) false
+#endif
+
+#define HOOKED(cpu) (PROFILING(cpu) || TRACING(cpu))
+
+#define HOOK_STEP(cpu, pc, op)                                                  \
+        do {                                                                    \
+                if (__builtin_expect(HOOKED(cpu), 0))                           \
+                        observe_step(cpu, pc, op);                              \
+        } while (0)
+
+inline static void
+observe_step(i8080 *cpu, uint16_t pc, opcode op)
+{
+        if (PROFILING(cpu))
+                profile_step(cpu->prof, pc, op, cpu->SP, cpu->cycles);
+        if (TRACING(cpu)) {
+                trace_record *r = trace_next(cpu->trace);
+                r->kind = TRACE_INSN;
+                r->op = op;
+                r->addr = pc;
+                r->sp = cpu->SP;
+                r->a = cpu->A;
+                r->f = flags_read(cpu);
+                r->b = cpu->B;
+                r->c = cpu->C;
+                r->d = cpu->D;
+                r->e = cpu->E;
+                r->h = cpu->H;
+                r->l = cpu->L;
+                r->cycles = (uint16_t)cpu->cycles;
+                trace_commit(cpu->trace);
+        }
+}
+
+/*
+ * The guest ran into an opcode the 8080 does not have. The recent history
+ * goes to the trace dump file, if there is one, and then the emulator gives
+ * up. With halt_on_fault set the CPU halts with interrupts disabled instead,
+ * PC past the opcode.
+ */
+static void
+fault(i8080 *cpu, opcode op)
+{
+        if (!cpu->halt_on_fault)
+                fprintf(stderr, "Unrecognized opcode %02X\n", op);
+        if (TRACING(cpu) && cpu->trace->dump_path) {
+                if (trace_dump(cpu->trace, cpu->trace->dump_path))
+                        fprintf(stderr, "Trace written to %s\n", cpu->trace->dump_path);
+                else
+                        perror(cpu->trace->dump_path);
+        }
+        if (cpu->halt_on_fault) {
+                cpu->faulted = true;
+                cpu->INTE = false;
+                cpu->halted = true;
+                check_soon(cpu);
+                return;
+        }
+        exit(1);
+}
+
+/*
+ * Raise interrupt line int_num (0 to 7, for RST int_num). Requests stay
+ * pending until taken; the lowest unmasked line goes first, as with an 8259
+ * in fixed priority mode. May be called from any thread. A CPU sleeping in
+ * wait_for_interrupt() is woken up; a running one picks the request up at the
+ * next instruction boundary with interrupts enabled, which is not the one
+ * right after EI.
+ */
 void
 request_interrupt(i8080 *cpu, int int_num)
 {
-        cpu->int_pending = int_num;
+        pthread_mutex_lock(&cpu->int_lock);
+        __atomic_or_fetch(&cpu->int_pending, 1 << (int_num & 7), __ATOMIC_SEQ_CST);
+        __atomic_store_n(&cpu->deadline, 0, __ATOMIC_SEQ_CST);
+        pthread_cond_signal(&cpu->int_cond);
+        pthread_mutex_unlock(&cpu->int_lock);
+}
+
+/* Mask off the interrupt lines set in mask. Requests on them wait. */
+void
+mask_interrupts(i8080 *cpu, uint8_t mask)
+{
+        cpu->int_mask = mask;
+        __atomic_store_n(&cpu->deadline, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Events in guest time. Each is due at the first instruction boundary at or
+ * past cycle count when; the block engine and the JIT only get there between
+ * blocks. A CPU halted with interrupts enabled lets time pass up to the next
+ * event. Scheduling is for the thread running the CPU, from device callbacks
+ * or between runs. Events are neither saved in save states nor forked.
+ * Return false if out of memory.
+ */
+bool
+schedule_interrupt(i8080 *cpu, uint64_t when, int int_num)
+{
+        if (!event_push(&cpu->events, when, NULL, NULL, int_num & 7))
+                return false;
+        if (when < cpu->deadline)
+                __atomic_store_n(&cpu->deadline, when, __ATOMIC_RELAXED);
+        return true;
+}
+
+bool
+schedule_event(i8080 *cpu, uint64_t when, event_fn fn, void *ctx)
+{
+        if (!event_push(&cpu->events, when, fn, ctx, 0))
+                return false;
+        if (when < cpu->deadline)
+                __atomic_store_n(&cpu->deadline, when, __ATOMIC_RELAXED);
+        return true;
+}
+
+void
+cancel_events(i8080 *cpu, event_fn fn, void *ctx)
+{
+        event_cancel(&cpu->events, fn, ctx);
 }
 
 void
 handle_interrupt(i8080 *cpu)
 {
+        int pending = __atomic_load_n(&cpu->int_pending, __ATOMIC_ACQUIRE) & ~cpu->int_mask;
+        int int_num = __builtin_ctz((unsigned)pending);
+        __atomic_and_fetch(&cpu->int_pending, ~(1 << int_num), __ATOMIC_ACQ_REL);
+
         cpu->INTE = false;
+        // An interrupt is the only way out of the halted state
+        cpu->halted = false;
 
-        cpu->mem[--cpu->SP] = (cpu->PC >> 8) & 0xFF;
-        cpu->mem[--cpu->SP] = cpu->PC & 0xFF;
+        push_stack_PC(cpu);
 
-        cpu->PC = 8 * cpu->int_pending;
+        cpu->PC = 8 * int_num;
 
-        cpu->int_pending = 0;
+        cpu->cycles += CYCLES_INTERRUPT;
 }
 
-void
-emulate(i8080 *cpu)
+/* Raise or call back everything due by now, in order. */
+static void
+run_due_events(i8080 *cpu)
+{
+        while (event_next(&cpu->events) <= cpu->cycles) {
+                event e = event_pop(&cpu->events);
+                if (e.fn)
+                        e.fn(cpu, e.ctx);
+                else
+                        request_interrupt(cpu, e.irq);
+        }
+}
+
+/*
+ * Work out the next deadline. A request from another thread either comes
+ * before the deadline is stored, and is seen by the check after it, or it
+ * lowers the deadline again itself.
+ */
+static void
+update_deadline(i8080 *cpu)
+{
+        uint64_t deadline = cpu->run_until;
+        uint64_t next = event_next(&cpu->events);
+        if (next < deadline)
+                deadline = next;
+        __atomic_store_n(&cpu->deadline, deadline, __ATOMIC_SEQ_CST);
+        if (cpu->INTE && (__atomic_load_n(&cpu->int_pending, __ATOMIC_SEQ_CST) & ~cpu->int_mask))
+                __atomic_store_n(&cpu->deadline, 0, __ATOMIC_SEQ_CST);
+}
+
+inline static bool
+deadline_reached(const i8080 *cpu)
+{
+        return cpu->cycles >= __atomic_load_n(&cpu->deadline, __ATOMIC_RELAXED);
+}
+
+/*
+ * What the engines do at a deadline, between two instructions: run the events
+ * due, take an interrupt, and while halted let time pass up to the next
+ * event. Returns false when the run is over.
+ */
+static bool
+service(i8080 *cpu)
+{
+        for (;;) {
+                run_due_events(cpu);
+                if (interrupt_acceptable(cpu))
+                        handle_interrupt(cpu);
+
+                if (cpu->cycles >= cpu->run_until)
+                        break;
+                if (!cpu->halted) {
+                        update_deadline(cpu);
+                        return true;
+                }
+                // Only an interrupt can end the halt, so only if one can be taken
+                uint64_t next = event_next(&cpu->events);
+                if (!cpu->INTE || next >= cpu->run_until)
+                        break;
+                cpu->cycles = next;
+        }
+        update_deadline(cpu);
+        return false;
+}
+
+/*
+ * Block the calling thread until request_interrupt() is called. Used by
+ * emulate() while the CPU is halted, so that an idle guest costs no host CPU
+ * time.
+ */
+static void
+wait_for_interrupt(i8080 *cpu)
+{
+        pthread_mutex_lock(&cpu->int_lock);
+        while (!interrupt_pending(cpu))
+                pthread_cond_wait(&cpu->int_cond, &cpu->int_lock);
+        pthread_mutex_unlock(&cpu->int_lock);
+}
+
+#if I8080_THREADED_DISPATCH
+
+/*
+ * Threaded engine. Every handler ends with its own fetch and indirect jump
+ * through the label table instead of returning to a shared switch, so each
+ * opcode gets a separate branch history and there is no bounds check on the
+ * opcode byte. Only the deadline is checked between instructions; everything
+ * behind it goes through the slow path.
+ */
+static void
+run(i8080 *cpu)
+{
+        static const void *const handlers[256] = {
+                [0 ... 255] = &&unrecognized,
+#define INSTR(code, body) [code] = &&op_##code,
+#include "instructions.def"
+#undef INSTR
+        };
+        opcode op;
+
+#define NEXT                                                                    \
+        do {                                                                    \
+                if (deadline_reached(cpu))                                      \
+                        goto slow;                                              \
+                op = mem_read(&cpu->mem, cpu->PC++);                            \
+                HOOK_STEP(cpu, cpu->PC - 1, op);                                \
+                cpu->cycles += cycle_table[op];                                 \
+                goto *handlers[op];                                             \
+        } while (0)
+
+slow:
+        if (!service(cpu))
+                return;
+
+        op = mem_read(&cpu->mem, cpu->PC++);
+        HOOK_STEP(cpu, cpu->PC - 1, op);
+        cpu->cycles += cycle_table[op];
+        goto *handlers[op];
+
+#define INSTR(code, body) op_##code: { body; } NEXT;
+#include "instructions.def"
+#undef INSTR
+
+unrecognized:
+        fault(cpu, op);
+#undef NEXT
+}
+
+#else
+
+static void
+run(i8080 *cpu)
 {
         opcode op;
         for (;;) {
-                if (cpu->halted)
-                        continue;
+                if (deadline_reached(cpu) && !service(cpu))
+                        return;
 
-                if (cpu->INTE && cpu->int_pending != 0)
-                        handle_interrupt(cpu);
+                op = mem_read(&cpu->mem, cpu->PC++);
+                HOOK_STEP(cpu, cpu->PC - 1, op);
+                cpu->cycles += cycle_table[op];
+                dispatch(cpu, op);
+        }
+}
 
-                op = cpu->mem[cpu->PC++];
+#endif
+
+/* Make everything the guest did visible before returning to the caller. */
+static void
+end_run(i8080 *cpu)
+{
+        port_flush(&cpu->io);
+        if (PROFILING(cpu))
+                profile_flush(cpu->prof, cpu->cycles);
+        // Callers see F as if flags were computed eagerly
+        flags_materialize(cpu);
+}
+
+uint64_t
+emulate_cycles(i8080 *cpu, uint64_t budget)
+{
+        uint64_t start = cpu->cycles;
+
+        // The run ends at the first instruction boundary at or past the
+        // budget, or as soon as the CPU halts
+        cpu->run_until = (budget > UINT64_MAX - start) ? UINT64_MAX : start + budget;
+        // Start with a visit to service() for whatever is already due
+        check_soon(cpu);
+        if (cpu->bcache)
+                run_blocks(cpu);
+        else
+                run(cpu);
+        end_run(cpu);
+
+        return cpu->cycles - start;
+}
+
+/*
+ * Run a single instruction whatever the engine, after the events due and a
+ * pending interrupt. Returns the states spent, 0 if the CPU is halted.
+ */
+uint64_t
+step(i8080 *cpu)
+{
+        uint64_t start = cpu->cycles;
+
+        run_due_events(cpu);
+        if (interrupt_acceptable(cpu))
+                handle_interrupt(cpu);
+        if (!cpu->halted) {
+                opcode op = mem_read(&cpu->mem, cpu->PC++);
+                HOOK_STEP(cpu, cpu->PC - 1, op);
+                cpu->cycles += cycle_table[op];
                 dispatch(cpu, op);
         }
+        end_run(cpu);
+
+        return cpu->cycles - start;
+}
+
+/*
+ * Switch the CPU to the block engine, which runs guest code from a cache of
+ * pre-decoded basic blocks. Returns false if the cache cannot be allocated.
+ */
+bool
+enable_block_cache(i8080 *cpu)
+{
+        if (!cpu->bcache)
+                cpu->bcache = block_cache_new();
+        return cpu->bcache != NULL;
 }
 
 void
-init(i8080 *cpu, const char *path)
+disable_block_cache(i8080 *cpu)
+{
+        disable_jit(cpu);
+        block_cache_free(cpu->bcache);
+        cpu->bcache = NULL;
+}
+
+/*
+ * Forget the compiled code of every block. Their execution counts start over,
+ * so that blocks still hot get compiled again.
+ */
+static void
+drop_native_code(block_cache *bc)
+{
+        for (size_t i = 0; i < 0x10000; ++i) {
+                block *b = bc->map[i];
+                if (b) {
+                        b->native = NULL;
+                        b->execs = 0;
+                }
+        }
+}
+
+/*
+ * Compile hot blocks to host code. Implies the block engine, which stays the
+ * fallback for blocks not yet hot. Returns false on hosts without a code
+ * generator or if no executable memory is available.
+ */
+bool
+enable_jit(i8080 *cpu)
+{
+        if (!enable_block_cache(cpu))
+                return false;
+        if (!cpu->jit)
+                cpu->jit = jit_new();
+        return cpu->jit != NULL;
+}
+
+void
+disable_jit(i8080 *cpu)
+{
+        if (cpu->bcache)
+                drop_native_code(cpu->bcache);
+        jit_free(cpu->jit);
+        cpu->jit = NULL;
+}
+
+/*
+ * Attach a device to an I/O port. Either callback may be NULL. The context
+ * pointer is passed back to the callbacks unchanged.
+ */
+void
+attach_port(i8080 *cpu, uint8_t num, port_read_fn read, port_write_fn write, void *ctx)
+{
+        port_flush(&cpu->io);
+        cpu->io.ports[num] = (port){ .read = read, .write = write, .ctx = ctx };
+}
+
+/*
+ * Attach a device whose output is buffered: runs of consecutive OUTs to the
+ * port reach the device through a single write_block call.
+ */
+void
+attach_port_buffered(i8080 *cpu, uint8_t num, port_read_fn read, port_write_block_fn write_block, void *ctx)
+{
+        port_flush(&cpu->io);
+        cpu->io.ports[num] = (port){ .read = read, .write_block = write_block, .ctx = ctx };
+}
+
+/*
+ * Profile everything the machine runs from now on. Returns false if the
+ * profiler was built out or is out of memory.
+ */
+bool
+enable_profiler(i8080 *cpu)
+{
+        if (!I8080_PROFILE)
+                return false;
+        if (!cpu->prof)
+                cpu->prof = profile_new();
+        return cpu->prof != NULL;
+}
+
+void
+disable_profiler(i8080 *cpu)
+{
+        profile_free(cpu->prof);
+        cpu->prof = NULL;
+}
+
+/*
+ * Record the last records instructions and stores, written to dump_path if
+ * the guest faults (dump_path may be NULL). Returns false if the recorder
+ * was built out or is out of memory.
+ */
+bool
+enable_trace(i8080 *cpu, size_t records, const char *dump_path)
+{
+        if (!I8080_TRACE)
+                return false;
+        disable_trace(cpu);
+        cpu->trace = trace_new(records, dump_path);
+        return cpu->trace != NULL;
+}
+
+void
+disable_trace(i8080 *cpu)
+{
+        trace_free(cpu->trace);
+        cpu->trace = NULL;
+}
+
+static const char *const opcode_names[256] = {
+#define INSTR(code, body) [code] = #code,
+#include "instructions.def"
+#undef INSTR
+};
+
+/* Mnemonic of an opcode as named in instructions.def, or "???". */
+const char *
+opcode_name(opcode op)
+{
+        return opcode_names[op] ? opcode_names[op] : "???";
+}
+
+/* Retire blocks decoded from the pages overlapping [addr, addr + len). */
+void
+invalidate_code(i8080 *cpu, uint16_t addr, size_t len)
+{
+        if (!cpu->bcache || !len)
+                return;
+        size_t last = ((size_t)addr + len - 1) >> PAGE_SHIFT;
+        if (last >= PAGE_COUNT)
+                last = PAGE_COUNT - 1;
+        for (size_t i = addr >> PAGE_SHIFT; i <= last; ++i)
+                if (cpu->bcache->code_page[i])
+                        block_cache_invalidate_page(cpu->bcache, (uint8_t)i);
+}
+
+/*
+ * Copy out the dirty bitmap: bit n % 64 of bitmap[n / 64] is set if page n,
+ * of PAGE_SZ bytes, may have changed since its bit was last cleared.
+ */
+void
+dirty_pages(const i8080 *cpu, uint64_t bitmap[PAGE_COUNT / 64])
+{
+        memcpy(bitmap, cpu->mem.dirty, sizeof cpu->mem.dirty);
+}
+
+/* Clear the dirty bits of the pages overlapping [addr, addr + len). */
+void
+clear_dirty(i8080 *cpu, uint16_t addr, size_t len)
+{
+        if (!len)
+                return;
+        size_t last = ((size_t)addr + len - 1) >> PAGE_SHIFT;
+        if (last >= PAGE_COUNT)
+                last = PAGE_COUNT - 1;
+        mem_clear_dirty(&cpu->mem, (uint8_t)(addr >> PAGE_SHIFT), last - (addr >> PAGE_SHIFT) + 1);
+}
+
+static void
+map_pages(i8080 *cpu, uint16_t addr, size_t len, mem_type type, const mmio *dev)
+{
+        if (!len)
+                return;
+        size_t last = ((size_t)addr + len - 1) >> PAGE_SHIFT;
+        if (last >= PAGE_COUNT)
+                last = PAGE_COUNT - 1;
+        for (size_t i = addr >> PAGE_SHIFT; i <= last; ++i) {
+                // Code decoded from the page may no longer be there
+                if (cpu->bcache && cpu->bcache->code_page[i])
+                        block_cache_invalidate_page(cpu->bcache, (uint8_t)i);
+                mem_set_type(&cpu->mem, (uint8_t)i, type, dev);
+        }
+}
+
+/*
+ * Memory map. Each call covers the whole 256-byte pages overlapping
+ * [addr, addr + len). All memory is RAM to begin with. ROM keeps its
+ * contents and ignores stores; load() and mem_load() still fill it.
+ */
+void
+map_ram(i8080 *cpu, uint16_t addr, size_t len)
+{
+        map_pages(cpu, addr, len, MEM_RAM, NULL);
+}
+
+void
+map_rom(i8080 *cpu, uint16_t addr, size_t len)
+{
+        map_pages(cpu, addr, len, MEM_ROM, NULL);
+}
+
+/*
+ * Attach a memory-mapped device. Every read and write in its pages goes to
+ * the callbacks, with the full address; reads without a read callback yield
+ * 0xFF. Code is never cached from MMIO pages.
+ */
+void
+map_mmio(i8080 *cpu, uint16_t addr, size_t len, mmio_read_fn read, mmio_write_fn write, void *ctx)
+{
+        mmio dev = { read, write, ctx };
+        map_pages(cpu, addr, len, MEM_MMIO, &dev);
+}
+
+/*
+ * Run until the CPU halts with interrupts disabled. While halted with
+ * interrupts enabled and no events left, the thread sleeps until
+ * request_interrupt() is called.
+ */
+void
+emulate(i8080 *cpu)
+{
+        for (;;) {
+                emulate_cycles(cpu, UINT64_MAX);
+
+                if (!cpu->halted)
+                        continue;
+                if (!cpu->INTE)
+                        return;
+                wait_for_interrupt(cpu);
+        }
+}
+
+/*
+ * Power-on state: registers and memory cleared, execution starting at
+ * BEGIN_ADDR.
+ */
+void
+reset(i8080 *cpu)
 {
         memset(cpu, 0, sizeof *cpu);
-        load(cpu, path);
+        mem_init(&cpu->mem);
+        pthread_mutex_init(&cpu->int_lock, NULL);
+        pthread_cond_init(&cpu->int_cond, NULL);
+        cpu->ei_cycles = UINT64_MAX;
         cpu->PC = BEGIN_ADDR;
 }
 
-static void
-load(i8080 *cpu, const char *path)
+/* Free what the CPU holds besides the structure itself. */
+void
+release(i8080 *cpu)
+{
+        disable_block_cache(cpu);
+        disable_profiler(cpu);
+        disable_trace(cpu);
+        mem_free(&cpu->mem);
+        event_queue_free(&cpu->events);
+        pthread_mutex_destroy(&cpu->int_lock);
+        pthread_cond_destroy(&cpu->int_cond);
+}
+
+/*
+ * Clone a stopped machine. The clone shares all of the parent's memory and
+ * gets its own copy of a page when either of them first writes to it. Its
+ * devices are the parent's, and it runs on the same engine with an empty
+ * translation cache. Scheduled events are not copied. Returns NULL if out of
+ * memory.
+ */
+i8080 *
+i8080_fork(i8080 *parent)
+{
+        i8080 *cpu = malloc(sizeof *cpu);
+        if (!cpu)
+                return NULL;
+        reset(cpu);
+
+        cpu->A = parent->A;
+        cpu->B = parent->B; cpu->C = parent->C;
+        cpu->D = parent->D; cpu->E = parent->E;
+        cpu->H = parent->H; cpu->L = parent->L;
+        cpu->PC = parent->PC;
+        cpu->SP = parent->SP;
+        cpu->F = parent->F;
+        cpu->szp_result = parent->szp_result;
+        cpu->szp_lazy = parent->szp_lazy;
+        cpu->INTE = parent->INTE;
+        cpu->ei_cycles = parent->ei_cycles;
+        cpu->halted = parent->halted;
+        cpu->halt_on_fault = parent->halt_on_fault;
+        cpu->faulted = parent->faulted;
+        cpu->int_pending = __atomic_load_n(&parent->int_pending, __ATOMIC_ACQUIRE);
+        cpu->int_mask = parent->int_mask;
+        cpu->io = parent->io;
+        cpu->cycles = parent->cycles;
+        mem_share(&cpu->mem, &parent->mem);
+
+        if (parent->jit)
+                enable_jit(cpu);
+        else if (parent->bcache)
+                enable_block_cache(cpu);
+        return cpu;
+}
+
+/*
+ * Hash of what the program can observe of the machine: registers, flags,
+ * interrupt state and memory. The cycle count, devices and events are left
+ * out, so states reached along different paths hash the same. Only the
+ * memory pages stored to since the last call are hashed again. Not while the
+ * machine is running.
+ */
+uint64_t
+state_hash(i8080 *cpu)
+{
+        uint64_t regs = (uint64_t)cpu->A << 56 | (uint64_t)cpu->F << 48
+                      | (uint64_t)cpu->B << 40 | (uint64_t)cpu->C << 32
+                      | (uint64_t)cpu->D << 24 | (uint64_t)cpu->E << 16
+                      | (uint64_t)cpu->H << 8 | cpu->L;
+        uint64_t rest = (uint64_t)cpu->PC << 48 | (uint64_t)cpu->SP << 32
+                      | (uint64_t)(uint8_t)__atomic_load_n(&cpu->int_pending, __ATOMIC_ACQUIRE) << 16
+                      | (uint64_t)cpu->int_mask << 8
+                      | (uint64_t)(cpu->INTE | cpu->halted << 1 | cpu->faulted << 2);
+        uint64_t h = mem_hash(&cpu->mem);
+        h = (h ^ regs) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+        h = (h ^ rest) * 0x9E3779B97F4A7C15ull;
+        return h ^ h >> 32;
+}
+
+/* Dispose of a machine from i8080_fork(). */
+void
+i8080_free(i8080 *cpu)
+{
+        release(cpu);
+        free(cpu);
+}
+
+void
+init(i8080 *cpu, const char *path)
 {
-        FILE *file = fopen(path, "rb");
-        if (!file) {
+        init_at(cpu, path, BEGIN_ADDR, BEGIN_ADDR);
+}
+
+/* Power on with the image in path loaded at addr and execution at entry. */
+void
+init_at(i8080 *cpu, const char *path, uint16_t addr, uint16_t entry)
+{
+        reset(cpu);
+        if (!load(cpu, path, addr)) {
                 perror(path);
                 exit(1);
         }
+        cpu->PC = entry;
+}
 
-        size_t n = fread(cpu->mem + BEGIN_ADDR, 1, ADDR_SPACE_SZ - BEGIN_ADDR, file);
-        fclose(file);
+bool
+select_engine(i8080 *cpu, engine e)
+{
+        switch (e) {
+                case ENGINE_INTERPRETER: { disable_block_cache(cpu); return true; }
+                case ENGINE_BLOCK_CACHE: { disable_jit(cpu); return enable_block_cache(cpu); }
+                case ENGINE_JIT: { return enable_jit(cpu); }
+        }
+        return false;
+}
+
+/*
+ * Load the image in path into memory from addr on. What does not fit below
+ * the top of memory is left out. When addr is page aligned the image is
+ * mapped rather than read, so every machine loading the same file shares a
+ * single copy of it until it writes there. Returns false with errno set if
+ * the file cannot be read.
+ */
+bool
+load(i8080 *cpu, const char *path, uint16_t addr)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return false;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+                close(fd);
+                return false;
+        }
+        size_t room = ADDR_SPACE_SZ - (size_t)addr;
+        size_t len = (size_t)st.st_size < room ? (size_t)st.st_size : room;
+
+        bool ok = true;
+        if (!S_ISREG(st.st_mode) || !len || !mem_map_file(&cpu->mem, addr, fd, 0, len)) {
+                // Unaligned, empty, or not a regular file
+                uint8_t *buf = malloc(ADDR_SPACE_SZ);
+                size_t n = 0;
+                ssize_t got = 1;
+                while (buf && n < room && (got = read(fd, buf + n, room - n)) > 0)
+                        n += (size_t)got;
+                ok = buf && got >= 0;
+                if (ok)
+                        mem_load(&cpu->mem, addr, buf, n);
+                free(buf);
+        }
+        close(fd);
+        return ok;
 }
 
 static inline void
 dispatch(i8080 *cpu, opcode op)
 {
         switch (op) {
-                case ADC_B: { OP_ADC(cpu, &cpu->B); break; }
-                case ADC_C: { OP_ADC(cpu, &cpu->C); break; }
-                case ADC_D: { OP_ADC(cpu, &cpu->D); break; }
-                case ADC_E: { OP_ADC(cpu, &cpu->E); break; }
-                case ADC_H: { OP_ADC(cpu, &cpu->H); break; }
-                case ADC_L: { OP_ADC(cpu, &cpu->L); break; }
-                case ADC_M: { OP_ADC(cpu, read_memp_HL(cpu)); break; }
-                case ADC_A: { OP_ADC(cpu, &cpu->A); break; }
-
-                case ADD_B: { OP_ADD(cpu, &cpu->B); break; }
-                case ADD_C: { OP_ADD(cpu, &cpu->C); break; }
-                case ADD_D: { OP_ADD(cpu, &cpu->D); break; }
-                case ADD_E: { OP_ADD(cpu, &cpu->E); break; }
-                case ADD_H: { OP_ADD(cpu, &cpu->H); break; }
-                case ADD_L: { OP_ADD(cpu, &cpu->L); break; }
-                case ADD_M: { OP_ADD(cpu, read_memp_HL(cpu)); break; }
-                case ADD_A: { OP_ADD(cpu, &cpu->A); break; }
-
-                case ADI: { OP_ADI(cpu); break; }
-                case ACI: { OP_ACI(cpu); break; }
-
-                case ANA_B: { OP_ANA(cpu, cpu->B); break; }
-                case ANA_C: { OP_ANA(cpu, cpu->C); break; }
-                case ANA_D: { OP_ANA(cpu, cpu->D); break; }
-                case ANA_E: { OP_ANA(cpu, cpu->E); break; }
-                case ANA_H: { OP_ANA(cpu, cpu->H); break; }
-                case ANA_L: { OP_ANA(cpu, cpu->L); break; }
-                case ANA_M: { OP_ANA(cpu, read_mem_HL(cpu)); break; }
-                case ANA_A: { OP_ANA(cpu, cpu->A); break; }
-
-                case ANI: { OP_ANI(cpu); break; }
-
-                case CMP_B: { OP_CMP(cpu, &cpu->B); break; }
-                case CMP_C: { OP_CMP(cpu, &cpu->C); break; }
-                case CMP_D: { OP_CMP(cpu, &cpu->D); break; }
-                case CMP_E: { OP_CMP(cpu, &cpu->E); break; }
-                case CMP_H: { OP_CMP(cpu, &cpu->H); break; }
-                case CMP_L: { OP_CMP(cpu, &cpu->L); break; }
-                case CMP_M: { OP_CMP(cpu, read_memp_HL(cpu)); break; }
-                case CMP_A: { OP_CMP(cpu, &cpu->A); break; }
-
-                case CMA: { cpu->A ^= 0xFF; break; }
-                case CMC: { flag_toggle(cpu, F_CY); break; }
-                case CPI: { OP_CPI(cpu); break; }
-
-                case DAA: { OP_DAA(cpu); break; }
-
-                case DAD_BC: { OP_DAD_BC(cpu); break; }
-                case DAD_DE: { OP_DAD_DE(cpu); break; }
-                case DAD_HL: { OP_DAD_HL(cpu); break; }
-                case DAD_SP: { OP_DAD_SP(cpu); break; }
-
-                case DCX_BC: { OP_DCX_PAIR(cpu, &cpu->B, &cpu->C); break; }
-                case DCX_DE: { OP_DCX_PAIR(cpu, &cpu->D, &cpu->E); break; }
-                case DCX_HL: { OP_DCX_PAIR(cpu, &cpu->H, &cpu->L); break; }
-                case DCX_SP: { OP_DCX(cpu, &cpu->SP); break; }
-
-                case DCR_B: { OP_DCR(cpu, &cpu->B); break; }
-                case DCR_C: { OP_DCR(cpu, &cpu->C); break; }
-                case DCR_D: { OP_DCR(cpu, &cpu->D); break; }
-                case DCR_E: { OP_DCR(cpu, &cpu->E); break; }
-                case DCR_H: { OP_DCR(cpu, &cpu->H); break; }
-                case DCR_L: { OP_DCR(cpu, &cpu->L); break; }
-                case DCR_M: { OP_DCR(cpu, read_memp_HL(cpu)); break; }
-                case DCR_A: { OP_DCR(cpu, &cpu->A); break; }
-
-                case DI: { OP_DI(cpu); break; }
-
-                case CALL: { OP_CALL(cpu); break; }
-                case CC: { OP_CC(cpu); break; }
-                case CNC: { OP_CNC(cpu); break; }
-                case CZ: { OP_CZ(cpu); break; }
-                case CNZ: { OP_CNZ(cpu); break; }
-                case CM: { OP_CM(cpu); break; }
-                case CP: { OP_CP(cpu); break; }
-                case CPE: { OP_CPE(cpu); break; }
-                case CPO: { OP_CPO(cpu); break; }
-
-                case EI: { OP_EI(cpu); break; }
-                case HLT: { OP_HLT(cpu); break; }
-
-                case INR_B: { OP_INR(cpu, &cpu->B); break; }
-                case INR_C: { OP_INR(cpu, &cpu->C); break; }
-                case INR_D: { OP_INR(cpu, &cpu->D); break; }
-                case INR_E: { OP_INR(cpu, &cpu->E); break; }
-                case INR_H: { OP_INR(cpu, &cpu->H); break; }
-                case INR_L: { OP_INR(cpu, &cpu->L); break; }
-                case INR_M: { OP_INR(cpu, read_memp_HL(cpu)); break; }
-                case INR_A: { OP_INR(cpu, &cpu->A); break; }
-
-                case INX_BC: { OP_INX_PAIR(cpu, &cpu->B, &cpu->C); break; }
-                case INX_DE: { OP_INX_PAIR(cpu, &cpu->D, &cpu->E); break; }
-                case INX_HL: { OP_INX_PAIR(cpu, &cpu->H, &cpu->L); break; }
-                case INX_SP: { OP_INX(cpu, &cpu->SP); break; }
-
-                case JC: { OP_JC(cpu); break; }
-                case JMP: { OP_JMP(cpu); break; }
-                case JM: { OP_JM(cpu); break; }
-                case JNC: { OP_JNC(cpu); break; }
-                case JNZ: { OP_JNZ(cpu); break; }
-                case JP: { OP_JP(cpu); break; }
-                case JPE: { OP_JPE(cpu); break; }
-                case JPO: { OP_JPO(cpu); break; }
-                case JZ: { OP_JZ(cpu); break; }
-
-                case LDA: { OP_LDA(cpu); break; }
-                case LDAX_BC: { OP_LDAX(cpu, read_memp_BC(cpu)); break; }
-                case LDAX_DE: { OP_LDAX(cpu, read_memp_DE(cpu)); break; }
-                case LHLD: { OP_LHLD(cpu); break; }
-                case NOP: { break; }
-
-                case MOV_A_B: { OP_MOV(&cpu->A, &cpu->B); break; }
-                case MOV_A_C: { OP_MOV(&cpu->A, &cpu->C); break; }
-                case MOV_A_D: { OP_MOV(&cpu->A, &cpu->D); break; }
-                case MOV_A_E: { OP_MOV(&cpu->A, &cpu->E); break; }
-                case MOV_A_H: { OP_MOV(&cpu->A, &cpu->H); break; }
-                case MOV_A_L: { OP_MOV(&cpu->A, &cpu->L); break; }
-                case MOV_A_M: { OP_MOV(&cpu->A, read_memp_HL(cpu)); break; }
-                case MOV_A_A: { break; }
-
-                case MOV_B_B: { break; }
-                case MOV_B_C: { OP_MOV(&cpu->B, &cpu->C); break; }
-                case MOV_B_D: { OP_MOV(&cpu->B, &cpu->D); break; }
-                case MOV_B_E: { OP_MOV(&cpu->B, &cpu->E); break; }
-                case MOV_B_H: { OP_MOV(&cpu->B, &cpu->H); break; }
-                case MOV_B_L: { OP_MOV(&cpu->B, &cpu->L); break; }
-                case MOV_B_M: { OP_MOV(&cpu->B, read_memp_HL(cpu)); break; }
-                case MOV_B_A: { OP_MOV(&cpu->B, &cpu->A); break; }
-
-                case MOV_C_B: { OP_MOV(&cpu->C, &cpu->B); break; }
-                case MOV_C_C: { break; }
-                case MOV_C_D: { OP_MOV(&cpu->C, &cpu->D); break; }
-                case MOV_C_E: { OP_MOV(&cpu->C, &cpu->E); break; }
-                case MOV_C_H: { OP_MOV(&cpu->C, &cpu->H); break; }
-                case MOV_C_L: { OP_MOV(&cpu->C, &cpu->L); break; }
-                case MOV_C_M: { OP_MOV(&cpu->C, read_memp_HL(cpu)); break; }
-                case MOV_C_A: { OP_MOV(&cpu->C, &cpu->A); break; }
-
-                case MOV_D_B: { OP_MOV(&cpu->D, &cpu->B); break; }
-                case MOV_D_C: { OP_MOV(&cpu->D, &cpu->C); break; }
-                case MOV_D_D: { break; }
-                case MOV_D_E: { OP_MOV(&cpu->D, &cpu->E); break; }
-                case MOV_D_H: { OP_MOV(&cpu->D, &cpu->H); break; }
-                case MOV_D_L: { OP_MOV(&cpu->D, &cpu->L); break; }
-                case MOV_D_M: { OP_MOV(&cpu->D, read_memp_HL(cpu)); break; }
-                case MOV_D_A: { OP_MOV(&cpu->D, &cpu->A); break; }
-
-                case MOV_E_B: { OP_MOV(&cpu->E, &cpu->B); break; }
-                case MOV_E_C: { OP_MOV(&cpu->E, &cpu->C); break; }
-                case MOV_E_D: { OP_MOV(&cpu->E, &cpu->D); break; }
-                case MOV_E_E: { break; }
-                case MOV_E_H: { OP_MOV(&cpu->E, &cpu->H); break; }
-                case MOV_E_L: { OP_MOV(&cpu->E, &cpu->L); break; }
-                case MOV_E_M: { OP_MOV(&cpu->E, read_memp_HL(cpu)); break; }
-                case MOV_E_A: { OP_MOV(&cpu->E, &cpu->A); break; }
-
-                case MOV_H_B: { OP_MOV(&cpu->H, &cpu->B); break; }
-                case MOV_H_C: { OP_MOV(&cpu->H, &cpu->C); break; }
-                case MOV_H_D: { OP_MOV(&cpu->H, &cpu->D); break; }
-                case MOV_H_E: { OP_MOV(&cpu->H, &cpu->E); break; }
-                case MOV_H_H: { break; }
-                case MOV_H_L: { OP_MOV(&cpu->H, &cpu->L); break; }
-                case MOV_H_M: { OP_MOV(&cpu->H, read_memp_HL(cpu)); break; }
-                case MOV_H_A: { OP_MOV(&cpu->H, &cpu->A); break; }
-
-                case MOV_L_B: { OP_MOV(&cpu->L, &cpu->B); break; }
-                case MOV_L_C: { OP_MOV(&cpu->L, &cpu->C); break; }
-                case MOV_L_D: { OP_MOV(&cpu->L, &cpu->D); break; }
-                case MOV_L_E: { OP_MOV(&cpu->L, &cpu->E); break; }
-                case MOV_L_H: { OP_MOV(&cpu->L, &cpu->L); break; }
-                case MOV_L_L: { break; }
-                case MOV_L_M: { OP_MOV(&cpu->L, read_memp_HL(cpu)); break; }
-                case MOV_L_A: { OP_MOV(&cpu->L, &cpu->A); break; }
-
-                case MOV_M_B: { OP_MOV(read_memp_HL(cpu), &cpu->B); break; }
-                case MOV_M_C: { OP_MOV(read_memp_HL(cpu), &cpu->C); break; }
-                case MOV_M_D: { OP_MOV(read_memp_HL(cpu), &cpu->D); break; }
-                case MOV_M_E: { OP_MOV(read_memp_HL(cpu), &cpu->E); break; }
-                case MOV_M_H: { OP_MOV(read_memp_HL(cpu), &cpu->H); break; }
-                case MOV_M_L: { OP_MOV(read_memp_HL(cpu), &cpu->L); break; }
-                case MOV_M_A: { OP_MOV(read_memp_HL(cpu), &cpu->A); break; }
-
-                case MVI_B: { OP_MVI(cpu, &cpu->B); break; }
-                case MVI_C: { OP_MVI(cpu, &cpu->C); break; }
-                case MVI_D: { OP_MVI(cpu, &cpu->D); break; }
-                case MVI_E: { OP_MVI(cpu, &cpu->E); break; }
-                case MVI_H: { OP_MVI(cpu, &cpu->H); break; }
-                case MVI_L: { OP_MVI(cpu, &cpu->L); break; }
-                case MVI_M: { OP_MVI(cpu, read_memp_HL(cpu)); break; }
-                case MVI_A: { OP_MVI(cpu, &cpu->A); break; }
-
-                case RST_000: { OP_RST_000(cpu); break; }
-                case RST_001: { OP_RST_001(cpu); break; }
-                case RST_010: { OP_RST_010(cpu); break; }
-                case RST_100: { OP_RST_100(cpu); break; }
-                case RST_101: { OP_RST_101(cpu); break; }
-                case RST_110: { OP_RST_110(cpu); break; }
-                case RST_111: { OP_RST_111(cpu); break; }
-
-                case ORA_B: { OP_ORA(cpu, &cpu->B); break; }
-                case ORA_C: { OP_ORA(cpu, &cpu->C); break; }
-                case ORA_D: { OP_ORA(cpu, &cpu->D); break; }
-                case ORA_E: { OP_ORA(cpu, &cpu->E); break; }
-                case ORA_H: { OP_ORA(cpu, &cpu->H); break; }
-                case ORA_L: { OP_ORA(cpu, &cpu->L); break; }
-                case ORA_M: { OP_ORA(cpu, read_memp_HL(cpu)); break; }
-                case ORA_A: { OP_ORA(cpu, &cpu->A); break; }
-
-                case ORI: { OP_ORI(cpu); break; }
-                case PCHL: { OP_PCHL(cpu); break; }
-
-                case POP_BC: { OP_POP_BC(cpu); break; }
-                case POP_DE: { OP_POP_DE(cpu); break; }
-                case POP_HL: { OP_POP_HL(cpu); break; }
-                case POP_PSW: { OP_POP_PSW(cpu); break; }
-
-                case PUSH_BC: { OP_PUSH_BC(cpu); break; }
-                case PUSH_DE: { OP_PUSH_DE(cpu); break; }
-                case PUSH_HL: { OP_PUSH_HL(cpu); break; }
-                case PUSH_PSW: { OP_PUSH_PSW(cpu); break; }
-
-                case RAL: { OP_RAL(cpu); break; }
-                case RAR: { OP_RAR(cpu); break; }
-                case RC: { OP_RC(cpu); break; }
-                case RET: { OP_RET(cpu); break; }
-                case RLC: { OP_RLC(cpu); break; }
-                case RM: { OP_RM(cpu); break; }
-                case RNC: { OP_RNC(cpu); break; }
-                case RNZ: { OP_RNZ(cpu); break; }
-                case RP: { OP_RP(cpu); break; }
-                case RPE: { OP_RPE(cpu); break; }
-                case RPO: { OP_RPO(cpu); break; }
-                case RRC: { OP_RRC(cpu); break; }
-                case RZ: { OP_RZ(cpu); break; }
-
-                case SBB_B: { OP_SBB(cpu, &cpu->B); break; }
-                case SBB_C: { OP_SBB(cpu, &cpu->C); break; }
-                case SBB_D: { OP_SBB(cpu, &cpu->D); break; }
-                case SBB_E: { OP_SBB(cpu, &cpu->E); break; }
-                case SBB_H: { OP_SBB(cpu, &cpu->H); break; }
-                case SBB_L: { OP_SBB(cpu, &cpu->L); break; }
-                case SBB_M: { OP_SBB(cpu, read_memp_HL(cpu)); break; }
-                case SBB_A: { OP_SBB(cpu, &cpu->A); break; }
-
-                case SBI: { OP_SBI(cpu); break; }
-                case SHLD: { OP_SHLD(cpu); break; }
-                case SPHL: { OP_SPHL(cpu); break; }
-                case STC: { flag_set(cpu, F_CY); break; }
-
-                case SUB_B: { OP_SUB(cpu, &cpu->B); break; }
-                case SUB_C: { OP_SUB(cpu, &cpu->C); break; }
-                case SUB_D: { OP_SUB(cpu, &cpu->D); break; }
-                case SUB_E: { OP_SUB(cpu, &cpu->E); break; }
-                case SUB_H: { OP_SUB(cpu, &cpu->H); break; }
-                case SUB_L: { OP_SUB(cpu, &cpu->L); break; }
-                case SUB_M: { OP_SUB(cpu, read_memp_HL(cpu)); break; }
-                case SUB_A: { OP_SUB(cpu, &cpu->A); break; }
-
-                case SUI: { OP_SUI(cpu); break; }
-                case STA: { OP_STA(cpu); break; }
-                case STAX_BC: { OP_STAX(cpu, read_memp_BC(cpu)); break; }
-                case STAX_DE: { OP_STAX(cpu, read_memp_DE(cpu)); break; }
-
-                case XCHG: { OP_XCHG(cpu); break; }
-                case XTHL: { OP_XTHL(cpu); break; }
-
-                case XRA_B: { OP_XRA(cpu, &cpu->B); break; }
-                case XRA_C: { OP_XRA(cpu, &cpu->C); break; }
-                case XRA_D: { OP_XRA(cpu, &cpu->D); break; }
-                case XRA_E: { OP_XRA(cpu, &cpu->E); break; }
-                case XRA_H: { OP_XRA(cpu, &cpu->H); break; }
-                case XRA_L: { OP_XRA(cpu, &cpu->L); break; }
-                case XRA_M: { OP_XRA(cpu, read_memp_HL(cpu)); break; }
-                case XRA_A: { OP_XRA(cpu, &cpu->A); break; }
-
-                case XRI: { OP_XRI(cpu); break; }
-
-                default: { fprintf(stderr, "Unrecognized opcode %02X\n", op); exit(1); }
+#define INSTR(code, body) case code: { body; break; }
+#include "instructions.def"
+#undef INSTR
+
+                default: { fault(cpu, op); }
+        }
+}
+
+
+/* -------------------------------------------------------------------------- |
+ |                                                                            |
+ |                                BLOCK ENGINE                                |
+ |                                                                            |
+ | -------------------------------------------------------------------------- */
+
+/* Immediate operands of instructions.def, as decoded into the micro-op. */
+#undef IMM8
+#undef IMM16
+#define IMM8 ((uint8_t)u->operand)
+#define IMM16 (u->operand)
+
+#define INSTR(code, body) static void uop_##code(i8080 *cpu, const uop *u) { body; }
+#include "instructions.def"
+#undef INSTR
+
+static const uop_fn uop_handlers[256] = {
+#define INSTR(code, body) [code] = uop_##code,
+#include "instructions.def"
+#undef INSTR
+};
+
+static void
+uop_unrecognized(i8080 *cpu, const uop *u)
+{
+        // Only the opcode byte was fetched, as far as the interpreters go
+        cpu->PC = (uint16_t)(u->next_pc - length_table[u->op] + 1);
+        fault(cpu, u->op);
+}
+
+/* Move on to the next instruction of a superinstruction, and return it. */
+inline static const uop *
+fused_step(i8080 *cpu, const uop *u)
+{
+        ++u;
+        cpu->PC = u->next_pc;
+        cpu->cycles += u->cycles;
+        return u;
+}
+
+/* DCR r; JNZ */
+inline static void
+fused_dcr_jnz(i8080 *cpu, const uop *u, uint8_t *reg)
+{
+        OP_DCR(cpu, reg);
+        u = fused_step(cpu, u);
+        // With lazy flags, S, Z and P stay pending
+        jump_if(cpu, *reg != 0, u->operand);
+}
+
+/* MOV A,hi; ORA lo; JNZ */
+inline static void
+fused_test_pair_jnz(i8080 *cpu, const uop *u, uint8_t hi, uint8_t lo)
+{
+        cpu->A = hi | lo;
+        update_logic_flags(cpu, cpu->A, 0);
+        u = fused_step(cpu, fused_step(cpu, u));
+        jump_if(cpu, cpu->A != 0, u->operand);
+}
+
+/* MOV r,M; INX H, for r other than H and L. */
+inline static void
+fused_load_inx(i8080 *cpu, const uop *u, uint8_t *reg)
+{
+        uint16_t addr = pack_u16(cpu->H, cpu->L);
+        *reg = *read_memp_HL(cpu);
+        fused_step(cpu, u);
+        ++addr;
+        cpu->H = (uint8_t)(addr >> 8);
+        cpu->L = (uint8_t)(addr & 0xFF);
+}
+
+/* LXI rp; DAD rp */
+inline static void
+fused_lxi_dad(i8080 *cpu, const uop *u, uint8_t *rega, uint8_t *regb)
+{
+        uint32_t sum = pack_u16(cpu->H, cpu->L) + u->operand;
+        OP_LXI_PAIR(cpu, rega, regb, u->operand);
+        fused_step(cpu, u);
+        flag_write(cpu, F_CY, (sum > 0xFFFF) ? F_CY : 0);
+        cpu->H = (uint8_t)(sum >> 8);
+        cpu->L = (uint8_t)(sum & 0xFF);
+}
+
+/* LXI H; DAD SP */
+inline static void
+fused_lxi_dad_sp(i8080 *cpu, const uop *u)
+{
+        uint32_t sum = u->operand + cpu->SP;
+        fused_step(cpu, u);
+        flag_write(cpu, F_CY, (sum > 0xFFFF) ? F_CY : 0);
+        cpu->H = (uint8_t)(sum >> 8);
+        cpu->L = (uint8_t)(sum & 0xFF);
+}
+
+/* CPI; JZ if if_equal, else CPI; JNZ */
+inline static void
+fused_cpi_jump(i8080 *cpu, const uop *u, bool if_equal)
+{
+        bool equal = cpu->A == (uint8_t)u->operand;
+        OP_CPI(cpu, (uint8_t)u->operand);
+        u = fused_step(cpu, u);
+        jump_if(cpu, equal == if_equal, u->operand);
+}
+
+/*
+ * Superinstructions. Each does the work of its instructions in one handler,
+ * with the bookkeeping of PC and states of each instruction in between kept.
+ * Besides saving the dispatch of the later instructions, the branch ending a
+ * sequence tests the value the sequence computed rather than reading the
+ * flag back; with lazy flags, S, Z and P then stay pending past the branch.
+ */
+#define FUSE(first, second, body)                                               \
+        static void                                                             \
+        fuse_##first##_##second(i8080 *cpu, const uop *u)                       \
+        {                                                                       \
+                body;                                                           \
+        }
+#define FUSE3(first, second, third, body)                                       \
+        static void                                                             \
+        fuse_##first##_##second##_##third(i8080 *cpu, const uop *u)             \
+        {                                                                       \
+                body;                                                           \
+        }
+#include "fusions.def"
+#undef FUSE
+#undef FUSE3
+
+/*
+ * The superinstruction for the longest sequence in the table that the n
+ * micro-ops at ops start with, NULL if none. *span gets its length.
+ */
+static uop_fn
+fused_handler(const uop *ops, uint16_t n, uint8_t *span)
+{
+#define FUSE(a, b, body)
+#define FUSE3(a, b, c, body)                                                    \
+        if (n >= 3 && ops[0].op == a && ops[1].op == b && ops[2].op == c) {     \
+                *span = 3;                                                      \
+                return fuse_##a##_##b##_##c;                                    \
+        }
+#include "fusions.def"
+#undef FUSE
+#undef FUSE3
+
+#define FUSE(a, b, body)                                                        \
+        if (n >= 2 && ops[0].op == a && ops[1].op == b) {                       \
+                *span = 2;                                                      \
+                return fuse_##a##_##b;                                          \
+        }
+#define FUSE3(a, b, c, body)
+#include "fusions.def"
+#undef FUSE
+#undef FUSE3
+        return NULL;
+}
+
+/* Give the first micro-op of each sequence in the table its superinstruction. */
+static void
+fuse_block(uop *ops, uint16_t len)
+{
+        for (uint16_t i = 0; i + 1 < len; ++i) {
+                uint8_t span;
+                uop_fn fn = fused_handler(&ops[i], len - i, &span);
+                if (fn) {
+                        ops[i].fn = fn;
+                        ops[i].span = span;
+                        i += span - 1;
+                }
+        }
+}
+
+/*
+ * Whether the instruction may transfer control elsewhere than to the next
+ * instruction in memory. EI also ends a block, so that an interrupt waiting
+ * for it is taken on time.
+ */
+inline static bool
+ends_block(opcode op)
+{
+        switch (op) {
+                case JMP: case JC: case JNC: case JZ: case JNZ:
+                case JM: case JP: case JPE: case JPO: case PCHL:
+                case CALL: case CC: case CNC: case CZ: case CNZ:
+                case CM: case CP: case CPE: case CPO:
+                case RET: case RC: case RNC: case RZ: case RNZ:
+                case RM: case RP: case RPE: case RPO:
+                case RST_000: case RST_001: case RST_010: case RST_011:
+                case RST_100: case RST_101: case RST_110: case RST_111:
+                case HLT: case EI:
+                        return true;
+        }
+        return uop_handlers[op] == NULL;
+}
+
+static block *
+decode_block(i8080 *cpu, uint16_t pc)
+{
+        uop ops[BLOCK_MAX_OPS];
+        uint16_t addr = pc;
+        uint16_t n = 0;
+
+        while (n < BLOCK_MAX_OPS) {
+                // Device registers are read when executed, never ahead
+                if (n && (mem_is_mmio(&cpu->mem, addr) || mem_is_mmio(&cpu->mem, (uint16_t)(addr + 2))))
+                        break;
+
+                opcode op = mem_read(&cpu->mem, addr);
+                uop *u = &ops[n++];
+
+                u->fn = uop_handlers[op] ? uop_handlers[op] : uop_unrecognized;
+                u->op = op;
+                u->cycles = cycle_table[op];
+                u->span = 1;
+                u->operand = 0;
+                if (length_table[op] == 2)
+                        u->operand = mem_read(&cpu->mem, (uint16_t)(addr + 1));
+                else if (length_table[op] == 3)
+                        u->operand = pack_u16(mem_read(&cpu->mem, (uint16_t)(addr + 2)),
+                                              mem_read(&cpu->mem, (uint16_t)(addr + 1)));
+
+                addr += length_table[op];
+                u->next_pc = addr;
+
+                if (ends_block(op))
+                        break;
         }
-}
\ No newline at end of file
+        fuse_block(ops, n);
+
+        block *b = malloc(sizeof *b + n * sizeof *ops);
+        if (!b) {
+                perror("decode_block");
+                exit(1);
+        }
+        b->start = pc;
+        b->size = addr - pc;
+        b->len = n;
+        b->execs = 0;
+        b->native = NULL;
+        memcpy(b->ops, ops, n * sizeof *ops);
+        idiom_match(b);
+        block_cache_insert(cpu->bcache, b);
+
+        return b;
+}
+
+/*
+ * Compile a block that became hot. When the code arena is full, all compiled
+ * code is dropped and the arena starts over.
+ */
+static void
+compile_block(i8080 *cpu, block *b)
+{
+        b->native = jit_compile(cpu->jit, b);
+        if (b->native)
+                return;
+
+        drop_native_code(cpu->bcache);
+        jit_reset(cpu->jit);
+
+        b->native = jit_compile(cpu->jit, b);
+}
+
+/*
+ * Block engine. Interrupts, halts and the end of the run are only checked
+ * between blocks. A block whose code is overwritten while it runs is left
+ * right after the offending store.
+ */
+static void
+run_blocks(i8080 *cpu)
+{
+        block_cache *bc = cpu->bcache;
+
+        for (;;) {
+                if (deadline_reached(cpu) && !service(cpu))
+                        return;
+
+                if (bc->retired)
+                        block_cache_reclaim(bc);
+
+                // Code in or running into MMIO pages is interpreted
+                if (mem_is_mmio(&cpu->mem, cpu->PC) || mem_is_mmio(&cpu->mem, (uint16_t)(cpu->PC + 2))) {
+                        opcode op = mem_read(&cpu->mem, cpu->PC++);
+                        HOOK_STEP(cpu, cpu->PC - 1, op);
+                        cpu->cycles += cycle_table[op];
+                        dispatch(cpu, op);
+                        continue;
+                }
+
+                block *b = block_cache_lookup(bc, cpu->PC);
+                if (!b)
+                        b = decode_block(cpu, cpu->PC);
+
+                // Copy and fill loops get most of their iterations done at once
+                if (b->loop.kind != IDIOM_NONE && !HOOKED(cpu))
+                        idiom_run(cpu, b);
+
+                if (!b->native && cpu->jit && !HOOKED(cpu) && ++b->execs == JIT_HOT_THRESHOLD)
+                        compile_block(cpu, b);
+
+                if (b->native && !HOOKED(cpu)) {
+                        b->native(cpu);
+                        continue;
+                }
+
+                const uop *u = b->ops;
+                const uop *end = u + b->len;
+                if (HOOKED(cpu)) {
+                        // Observers see every instruction, so superinstructions
+                        // are split back into their pairs
+                        do {
+                                HOOK_STEP(cpu, cpu->PC, u->op);
+                                cpu->PC = u->next_pc;
+                                cpu->cycles += u->cycles;
+                                (u->span > 1 ? uop_handlers[u->op] : u->fn)(cpu, u);
+                        } while (++u < end && b->valid);
+                        continue;
+                }
+                do {
+                        cpu->PC = u->next_pc;
+                        cpu->cycles += u->cycles;
+                        u->fn(cpu, u);
+                } while ((u += u->span) < end && b->valid);
+        }
+}
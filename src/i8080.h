@@ -2,15 +2,34 @@
 #define i8080_h
 
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "libi8080.h"
+
+#include "block.h"
+#include "event.h"
+#include "io.h"
+#include "mem.h"
+
 
 #define ADDR_SPACE_SZ 0x10000
 #define BEGIN_ADDR 0x100
 
+/*
+ * Dispatch engine. Compilers with computed goto (GCC, Clang) get the threaded
+ * engine; define I8080_SWITCH_DISPATCH (make DISPATCH=switch) to fall back to
+ * the portable switch in dispatch().
+ */
+#if defined(__GNUC__) && !defined(I8080_SWITCH_DISPATCH)
+#define I8080_THREADED_DISPATCH 1
+#else
+#define I8080_THREADED_DISPATCH 0
+#endif
+
 /*
  *
  * Bit masks for the condition bits.
@@ -91,20 +110,38 @@
  */
 #define F_S 0x80
 
-#if defined(__has_builtin)
-#if __has_builtin(__builtin_parity)
-        static inline bool parity(uint8_t x) { return !__builtin_parity((unsigned)x); }
-#define PARITY_DEFINED 1
+/* The bits that follow from the result byte alone. */
+#define F_SZP (F_S | F_Z | F_P)
+
+/*
+ * Lazy flags. When enabled (make LAZY_FLAGS=1), ALU instructions record their
+ * result byte instead of writing S, Z and P into F, and the bits are only
+ * worked out when an instruction, PUSH PSW or the caller of emulate_cycles()
+ * reads them. Most results are overwritten before that happens.
+ */
+#ifndef I8080_LAZY_FLAGS
+#define I8080_LAZY_FLAGS 0
 #endif
+
+/*
+ * Profiler hooks in the engines (make PROFILE=1). Without them the profiler
+ * cannot be enabled and costs nothing.
+ */
+#ifndef I8080_PROFILE
+#define I8080_PROFILE 0
 #endif
 
+/* Same for the execution trace recorder (make TRACE=1). */
+#ifndef I8080_TRACE
+#define I8080_TRACE 0
+#endif
 
 /* Container for the five condition bits. */
 typedef uint8_t flag_t;
 
 typedef uint8_t opcode;
 
-typedef struct {
+typedef struct i8080 {
         /* From the Intel 8080 Assembly Language Programming Manual (i8080 ALPM):
          *
          * "A program will be stored in memory as a sequence of bits which represent
@@ -133,78 +170,228 @@ typedef struct {
         // The flag bits
         flag_t F;
 
+        // With lazy flags, the result byte S, Z and P are still to be
+        // derived from, when szp_lazy is set
+        uint8_t szp_result;
+        bool szp_lazy;
+
         // The Interrupt Enable flip-flop
         bool INTE;
+        // Cycle count just after the last EI. EI takes effect only after the
+        // instruction following it, so no interrupt is taken at that count.
+        uint64_t ei_cycles;
 
         // The halted state flip-flop
         bool halted;
 
+        // Whether an unrecognized opcode halts the CPU instead of ending the
+        // program, and whether one did
+        bool halt_on_fault, faulted;
+
+        // Interrupt controller: requested RST lines, bit n for RST n, set
+        // by request_interrupt() possibly from another thread; and the
+        // lines masked off
         int int_pending;
+        uint8_t int_mask;
 
-        // Memory. 65_536 bytes of memory available.
-        uint8_t mem[ADDR_SPACE_SZ];
+        // Wake-up for a halted CPU sleeping in emulate()
+        pthread_mutex_t int_lock;
+        pthread_cond_t int_cond;
+
+        // Decoded blocks when the block engine is enabled, otherwise NULL
+        block_cache *bcache;
+
+        // Host code generator for hot blocks when enabled, otherwise NULL
+        struct jit *jit;
+
+        // Execution profile when enabled, otherwise NULL. Compiled code is
+        // not run while profiling.
+        struct profile *prof;
+
+        // Recent history when the trace recorder is on, otherwise NULL
+        struct trace *trace;
+
+        // Devices attached to the I/O ports
+        port_bus io;
+
+        // Number of states (clock periods) executed since init
+        uint64_t cycles;
+
+        // Cycle count at which the current call to emulate_cycles() returns
+        uint64_t run_until;
+
+        // The engines only look beyond the next instruction once the cycle
+        // count reaches this: the end of the run, the next event, or 0 when
+        // an interrupt may need taking
+        uint64_t deadline;
+
+        // Events scheduled in guest time
+        event_queue events;
+
+        // Memory. 65_536 bytes of memory available, in pages shared
+        // copy-on-write with forked machines.
+        memory mem;
+
+        // Byte last read from an MMIO page for a handler taking its
+        // operand by pointer
+        uint8_t mmio_latch;
 } i8080;
 
 
-#ifndef PARITY_DEFINED
-        static inline bool
-        parity(uint8_t x)
-        {
-                static const uint8_t even[16] = { 1,0,0,1,0,1,1,0, 0,1,1,0,1,0,0,1 };
-                x ^= x >> 4;
-                return even[x & 0x0F];
+/* Sign, Zero and Parity bits of every result byte. */
+extern const uint8_t szp_table[256];
+
+static inline flag_t
+szp_bits(uint8_t x)
+{
+        return szp_table[x];
+}
+
+/* Bring lazily kept flag bits into F. */
+static inline void
+flags_materialize(i8080 *cpu)
+{
+#if I8080_LAZY_FLAGS
+        if (cpu->szp_lazy) {
+                cpu->F = (cpu->F & ~F_SZP) | szp_bits(cpu->szp_result);
+                cpu->szp_lazy = false;
         }
 #endif
+}
 
+/* Before touching the lazily kept bits, make sure F holds them. */
+static inline void
+flags_prepare(i8080 *cpu, flag_t mask)
+{
+        if (I8080_LAZY_FLAGS && (mask & F_SZP))
+                flags_materialize(cpu);
+}
+
+static inline flag_t
+flags_read(i8080 *cpu)
+{
+        flags_materialize(cpu);
+        return cpu->F;
+}
+
+static inline void
+flags_load(i8080 *cpu, flag_t byte)
+{
+        cpu->F = byte;
+        cpu->szp_lazy = false;
+}
 
 static inline void
 flag_set(i8080 *cpu, flag_t mask)
 {
+        flags_prepare(cpu, mask);
         cpu->F |= mask;
 }
 
 static inline void
 flag_clear(i8080 *cpu, flag_t mask)
 {
+        flags_prepare(cpu, mask);
         cpu->F &= ~mask;
 }
 
 static inline void
 flag_toggle(i8080 *cpu, flag_t mask)
 {
+        flags_prepare(cpu, mask);
         cpu->F ^= mask;
 }
 
 static inline bool
-flag_get(const i8080 *cpu, flag_t mask)
+flag_get(i8080 *cpu, flag_t mask)
 {
+        flags_prepare(cpu, mask);
         return cpu->F & mask;
 }
 
 static inline void
 flag_write(i8080 *cpu, uint8_t mask, uint8_t cond)
 {
+        flags_prepare(cpu, mask);
         cpu->F = (cpu->F & ~mask) | cond;
 }
 
-static void
-reset_flags(i8080 *cpu)
+/* Whether an interrupt line is requested and not masked off. */
+static inline bool
+interrupt_pending(const i8080 *cpu)
 {
-        cpu->F = 0;
-        cpu->F |= 0x02;
+        return (__atomic_load_n(&cpu->int_pending, __ATOMIC_RELAXED) & ~cpu->int_mask) != 0;
+}
+
+/* Whether an interrupt is taken at this instruction boundary. */
+static inline bool
+interrupt_acceptable(const i8080 *cpu)
+{
+        return cpu->INTE && cpu->cycles != cpu->ei_cycles && interrupt_pending(cpu);
+}
+
+/* Have the engine stop at the next instruction boundary to see what is due. */
+static inline void
+check_soon(i8080 *cpu)
+{
+        __atomic_store_n(&cpu->deadline, cpu->cycles, __ATOMIC_RELAXED);
+}
+
+/* End the current run at the next instruction boundary. */
+static inline void
+stop_run(i8080 *cpu)
+{
+        cpu->run_until = cpu->cycles;
+        check_soon(cpu);
 }
 
 static inline uint8_t
 stack_pop(i8080 *cpu)
 {
-        return cpu->mem[cpu->SP++];
+        return mem_read(&cpu->mem, cpu->SP++);
 }
 
 
-static inline void dispatch(i8080 *cpu, opcode op);
+/* Ways of executing guest code. All of them give the same results. */
+typedef enum {
+        ENGINE_INTERPRETER,     // dispatch() or the threaded engine
+        ENGINE_BLOCK_CACHE,     // pre-decoded basic blocks
+        ENGINE_JIT,             // blocks compiled to host code once hot
+} engine;
+
+
 void emulate(i8080 *cpu);
+void request_interrupt(i8080 *cpu, int int_num);
+void mask_interrupts(i8080 *cpu, uint8_t mask);
+bool schedule_interrupt(i8080 *cpu, uint64_t when, int int_num);
+bool schedule_event(i8080 *cpu, uint64_t when, event_fn fn, void *ctx);
+void cancel_events(i8080 *cpu, event_fn fn, void *ctx);
+bool enable_block_cache(i8080 *cpu);
+void disable_block_cache(i8080 *cpu);
+bool enable_jit(i8080 *cpu);
+void disable_jit(i8080 *cpu);
+void attach_port(i8080 *cpu, uint8_t num, port_read_fn read, port_write_fn write, void *ctx);
+void attach_port_buffered(i8080 *cpu, uint8_t num, port_read_fn read, port_write_block_fn write_block, void *ctx);
+bool enable_profiler(i8080 *cpu);
+void disable_profiler(i8080 *cpu);
+bool enable_trace(i8080 *cpu, size_t records, const char *dump_path);
+void disable_trace(i8080 *cpu);
+const char *opcode_name(opcode op);
+void invalidate_code(i8080 *cpu, uint16_t addr, size_t len);
+void dirty_pages(const i8080 *cpu, uint64_t bitmap[PAGE_COUNT / 64]);
+void clear_dirty(i8080 *cpu, uint16_t addr, size_t len);
+void map_ram(i8080 *cpu, uint16_t addr, size_t len);
+void map_rom(i8080 *cpu, uint16_t addr, size_t len);
+void map_mmio(i8080 *cpu, uint16_t addr, size_t len, mmio_read_fn read, mmio_write_fn write, void *ctx);
+uint64_t emulate_cycles(i8080 *cpu, uint64_t budget);
+uint64_t step(i8080 *cpu);
 void init(i8080 *cpu, const char *path);
-static void load(i8080 *cpu, const char *path);
+void init_at(i8080 *cpu, const char *path, uint16_t addr, uint16_t entry);
+bool load(i8080 *cpu, const char *path, uint16_t addr);
+void reset(i8080 *cpu);
+void release(i8080 *cpu);
+uint64_t state_hash(i8080 *cpu);
+bool select_engine(i8080 *cpu, engine e);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "i8080.h"
+#include "idiom.h"
+
+
+/* Longest block that can be a loop of idiom.h. */
+#define IDIOM_MAX_OPS 9
+
+/* Register pairs, as in 8080 opcodes. */
+#define PAIR_BC 0
+#define PAIR_DE 1
+#define PAIR_HL 2
+
+/* The 3-bit register field of 8080 opcodes. */
+static uint8_t *
+reg(i8080 *cpu, int r)
+{
+        switch (r) {
+                case 0: return &cpu->B;
+                case 1: return &cpu->C;
+                case 2: return &cpu->D;
+                case 3: return &cpu->E;
+                case 4: return &cpu->H;
+                case 5: return &cpu->L;
+        }
+        return &cpu->A;
+}
+
+static uint16_t
+get_pair(i8080 *cpu, int pair)
+{
+        return (uint16_t)(*reg(cpu, 2 * pair) << 8 | *reg(cpu, 2 * pair + 1));
+}
+
+static void
+set_pair(i8080 *cpu, int pair, uint16_t val)
+{
+        *reg(cpu, 2 * pair) = (uint8_t)(val >> 8);
+        *reg(cpu, 2 * pair + 1) = (uint8_t)val;
+}
+
+/* Bit per register of the 3-bit register field. */
+#define REG_BIT(r) (1u << (r))
+#define PAIR_BITS(pair) (REG_BIT(2 * (pair)) | REG_BIT(2 * (pair) + 1))
+
+/*
+ * Fill in b->loop if the block is one of the loops of idiom.h, otherwise leave
+ * it IDIOM_NONE.
+ */
+void
+idiom_match(block *b)
+{
+        const uop *ops = b->ops;
+        int n = b->len;
+        idiom l = { IDIOM_NONE };
+        // Registers the loop uses, which the counter must not be one of
+        unsigned used = PAIR_BITS(PAIR_HL);
+        int i = 0;
+
+        b->loop.kind = IDIOM_NONE;
+        if (n < 4 || n > IDIOM_MAX_OPS || ops[n - 1].op != 0xC2 || ops[n - 1].operand != b->start)
+                return;                                         // JNZ to itself
+
+        if (ops[0].op == 0x7E && ops[1].op == 0x12) {           // MOV A,M; STAX D
+                l = (idiom){ IDIOM_COPY, PAIR_HL, PAIR_DE };
+                used |= PAIR_BITS(PAIR_DE) | REG_BIT(7);
+                i = 2;
+        } else if (ops[0].op == 0x1A && ops[1].op == 0x77) {    // LDAX D; MOV M,A
+                l = (idiom){ IDIOM_COPY, PAIR_DE, PAIR_HL };
+                used |= PAIR_BITS(PAIR_DE) | REG_BIT(7);
+                i = 2;
+        } else if (ops[0].op == 0x36) {                         // MVI M
+                l = (idiom){ IDIOM_FILL, PAIR_HL, PAIR_HL, 0, IDIOM_IMM, (uint8_t)ops[0].operand };
+                i = 1;
+        } else if ((ops[0].op & 0xF8) == 0x70 && (ops[0].op & 7) != 4 && (ops[0].op & 7) != 5
+                   && (ops[0].op & 7) != 6) {
+                // MOV M,r other than H, L and M
+                l = (idiom){ IDIOM_FILL, PAIR_HL, PAIR_HL, 0, ops[0].op & 7 };
+                used |= REG_BIT(l.fill);
+                i = 1;
+        } else {
+                return;
+        }
+
+        // What steps the counter, ahead of the JNZ
+        int body_end;
+        if ((ops[n - 3].op == 0x78 && ops[n - 2].op == 0xB1)    // MOV A,B; ORA C
+            || (ops[n - 3].op == 0x79 && ops[n - 2].op == 0xB0)) {
+                l.counter = IDIOM_BC;
+                body_end = n - 3;
+                // The test leaves the counter in A
+                if (used & PAIR_BITS(PAIR_BC) || (l.kind == IDIOM_FILL && l.fill == 7))
+                        return;
+        } else if ((ops[n - 2].op & 0xC7) == 0x05 && ((ops[n - 2].op >> 3) & 7) != 6) {
+                // DCR r other than M
+                l.counter = (ops[n - 2].op >> 3) & 7;
+                if (used & REG_BIT(l.counter))
+                        return;
+                body_end = n - 2;
+        } else {
+                return;
+        }
+        // The rest steps each pointer once, and BC if it counts
+        bool inx_h = false, inx_d = false, dcx_b = false;
+        for (; i < body_end; ++i) {
+                bool *seen;
+                switch (ops[i].op) {
+                        case 0x23: { seen = &inx_h; break; }    // INX H
+                        case 0x13: { seen = &inx_d; break; }    // INX D
+                        case 0x0B: { seen = &dcx_b; break; }    // DCX B
+                        default: return;
+                }
+                if (*seen)
+                        return;
+                *seen = true;
+        }
+        if (!inx_h || inx_d != (l.kind == IDIOM_COPY) || dcx_b != (l.counter == IDIOM_BC))
+                return;
+
+        for (i = 0; i < n; ++i)
+                l.cycles += ops[i].cycles;
+        b->loop = l;
+}
+
+/*
+ * Bytes from addr on, up to len, that lie in pages the loop may access
+ * directly: RAM without decoded code if written, anything but MMIO if read.
+ */
+static size_t
+direct_len(i8080 *cpu, uint16_t addr, size_t len, bool write)
+{
+        size_t n = 0;
+        while (n < len) {
+                uint8_t page = (uint8_t)((addr + n) >> PAGE_SHIFT);
+                if (write ? cpu->mem.type[page] != MEM_RAM || cpu->bcache->code_page[page]
+                          : mem_is_mmio(&cpu->mem, (uint16_t)(addr + n)))
+                        break;
+                n += PAGE_SZ - ((addr + n) & (PAGE_SZ - 1));
+        }
+        return n < len ? n : len;
+}
+
+static size_t
+min_size(size_t a, size_t b)
+{
+        return a < b ? a : b;
+}
+
+/*
+ * Copy len bytes up from src to dst as a byte loop would: where dst lies just
+ * above src, bytes the loop stored are read back further on.
+ */
+static void
+copy_up(memory *mem, uint16_t src, uint16_t dst, size_t len)
+{
+        while (len) {
+                size_t n = min_size(len, PAGE_SZ - (src & (PAGE_SZ - 1)));
+                n = min_size(n, PAGE_SZ - (dst & (PAGE_SZ - 1)));
+                if (dst > src && (size_t)(dst - src) < n)
+                        n = (size_t)(dst - src);
+                // Owning the destination page first, since that may move the source
+                uint8_t *to = mem_own(mem, (uint8_t)(dst >> PAGE_SHIFT)) + (dst & (PAGE_SZ - 1));
+                const uint8_t *from = mem->rd[src >> PAGE_SHIFT] + (src & (PAGE_SZ - 1));
+                memmove(to, from, n);
+                src += (uint16_t)n;
+                dst += (uint16_t)n;
+                len -= n;
+        }
+}
+
+static void
+fill(memory *mem, uint16_t dst, uint8_t byte, size_t len)
+{
+        while (len) {
+                size_t n = min_size(len, PAGE_SZ - (dst & (PAGE_SZ - 1)));
+                memset(mem_own(mem, (uint8_t)(dst >> PAGE_SHIFT)) + (dst & (PAGE_SZ - 1)), byte, n);
+                dst += (uint16_t)n;
+                len -= n;
+        }
+}
+
+/*
+ * Run all but the last of the iterations of the loop in b that the block
+ * engine would run before reaching the deadline, as far as memory allows.
+ * Does nothing if that is none.
+ */
+void
+idiom_run(i8080 *cpu, const block *b)
+{
+        const idiom *l = &b->loop;
+
+        size_t count;
+        if (l->counter == IDIOM_BC)
+                count = get_pair(cpu, PAIR_BC) ? get_pair(cpu, PAIR_BC) : 0x10000;
+        else
+                count = *reg(cpu, l->counter) ? *reg(cpu, l->counter) : 0x100;
+
+        // Iterations until the deadline is reached or passed
+        uint64_t deadline = __atomic_load_n(&cpu->deadline, __ATOMIC_RELAXED);
+        if (cpu->cycles >= deadline)
+                return;
+        uint64_t until = (deadline - cpu->cycles - 1) / l->cycles + 1;
+        if (until < count)
+                count = (size_t)until;
+
+        uint16_t src = get_pair(cpu, l->src);
+        uint16_t dst = get_pair(cpu, l->dst);
+        size_t len = count - 1;
+        len = min_size(len, 0x10000 - (size_t)dst);
+        len = direct_len(cpu, dst, len, true);
+        if (l->kind == IDIOM_COPY) {
+                len = min_size(len, 0x10000 - (size_t)src);
+                len = direct_len(cpu, src, len, false);
+        }
+        if (!len)
+                return;
+
+        if (l->kind == IDIOM_COPY) {
+                copy_up(&cpu->mem, src, dst, len);
+                set_pair(cpu, l->src, (uint16_t)(src + len));
+        } else {
+                uint8_t byte = l->fill == IDIOM_IMM ? l->imm : *reg(cpu, l->fill);
+                fill(&cpu->mem, dst, byte, len);
+        }
+        set_pair(cpu, l->dst, (uint16_t)(dst + len));
+        if (l->counter == IDIOM_BC)
+                set_pair(cpu, PAIR_BC, (uint16_t)(get_pair(cpu, PAIR_BC) - len));
+        else
+                *reg(cpu, l->counter) -= (uint8_t)len;
+        cpu->cycles += (uint64_t)len * l->cycles;
+}
@@ -0,0 +1,60 @@
+#ifndef idiom_h
+#define idiom_h
+
+
+#include <stdint.h>
+
+
+/*
+ * Byte loop idioms of the block engine.
+ *
+ * A block that jumps back to its own start and does nothing else but copy or
+ * fill memory a byte per iteration is recognized when it is decoded:
+ *
+ *      MOV A,M; STAX D; INX H; INX D; count; JNZ loop      copy from HL to DE
+ *      LDAX D; MOV M,A; INX D; INX H; count; JNZ loop      copy from DE to HL
+ *      MVI M,n or MOV M,r; INX H; count; JNZ loop          fill from HL on
+ *
+ * where count is DCX B; MOV A,B; ORA C (or MOV A,C; ORA B) or DCR r, and the
+ * increments and DCX B come in any order. Before such a block runs,
+ * idiom_run() does all but the last of the iterations the block engine would
+ * run before its next deadline with a host memmove() or memset() per page,
+ * then lets the block run the last one. That one sets A and the flags the
+ * way the loop leaves them, so registers, flags and cycle count come out
+ * exactly as if every iteration had been interpreted.
+ *
+ * Only RAM holding no decoded code is written this way, and nothing wraps
+ * around the top of memory; the rest of a loop runs normally.
+ */
+
+struct block;
+struct i8080;
+
+enum {
+        IDIOM_NONE,
+        IDIOM_COPY,
+        IDIOM_FILL,
+};
+
+/* Counter or fill source that is not a single register. */
+#define IDIOM_BC 6
+#define IDIOM_IMM 6
+
+typedef struct {
+        uint8_t kind;
+        // Register pairs read from and written to, as in 8080 opcodes
+        // (0 BC, 1 DE, 2 HL)
+        uint8_t src, dst;
+        // Register stepped by DCR, as in 8080 opcodes, or IDIOM_BC
+        uint8_t counter;
+        // Register a fill stores, or IDIOM_IMM for the byte in imm
+        uint8_t fill, imm;
+        // States per iteration
+        uint16_t cycles;
+} idiom;
+
+void idiom_match(struct block *b);
+void idiom_run(struct i8080 *cpu, const struct block *b);
+
+
+#endif
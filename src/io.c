@@ -0,0 +1,52 @@
+#include "io.h"
+
+
+uint8_t
+port_in(port_bus *bus, uint8_t num)
+{
+        const port *p = &bus->ports[num];
+
+        // A device may be waiting on output it has not yet seen
+        if (bus->buf_len)
+                port_flush(bus);
+
+        return p->read ? p->read(p->ctx, num) : 0xFF;
+}
+
+/*
+ * Consecutive OUTs to a buffered port are gathered and handed to the device in
+ * one call, when the buffer fills, when the program moves on to another port,
+ * on an IN and whenever the emulator returns to its caller.
+ */
+void
+port_out(port_bus *bus, uint8_t num, uint8_t byte)
+{
+        const port *p = &bus->ports[num];
+
+        if (p->write_block) {
+                if (bus->buf_len && (bus->buf_port != num || bus->buf_len == PORT_BUF_SZ))
+                        port_flush(bus);
+                bus->buf_port = num;
+                bus->buf[bus->buf_len++] = byte;
+                return;
+        }
+
+        if (bus->buf_len)
+                port_flush(bus);
+
+        if (p->write)
+                p->write(p->ctx, num, byte);
+}
+
+void
+port_flush(port_bus *bus)
+{
+        const port *p = &bus->ports[bus->buf_port];
+        size_t len = bus->buf_len;
+
+        if (!len)
+                return;
+
+        bus->buf_len = 0;
+        p->write_block(p->ctx, bus->buf_port, bus->buf, len);
+}
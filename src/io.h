@@ -0,0 +1,50 @@
+#ifndef io_h
+#define io_h
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Port I/O bus.
+ *
+ * i8080 ALPM: "The IN and OUT instructions are used to transfer data between
+ * the accumulator and up to 256 input and 256 output devices." Each of the 256
+ * port numbers can have a device attached, in the form of callbacks that
+ * receive the device's context pointer. Reading a port without a device yields
+ * 0xFF (a floating data bus), and writes to it are discarded.
+ */
+
+typedef uint8_t (*port_read_fn)(void *ctx, uint8_t port);
+typedef void (*port_write_fn)(void *ctx, uint8_t port, uint8_t byte);
+
+/* Receives a run of consecutive OUT bytes to one buffered port. */
+typedef void (*port_write_block_fn)(void *ctx, uint8_t port, const uint8_t *buf, size_t len);
+
+/* Maximum number of OUT bytes gathered before a buffered port is flushed. */
+#define PORT_BUF_SZ 256
+
+typedef struct {
+        port_read_fn read;
+        port_write_fn write;
+        port_write_block_fn write_block;
+        void *ctx;
+} port;
+
+typedef struct {
+        port ports[256];
+
+        // Pending OUT bytes of a buffered port. buf_len == 0 if none.
+        uint8_t buf_port;
+        size_t buf_len;
+        uint8_t buf[PORT_BUF_SZ];
+} port_bus;
+
+
+uint8_t port_in(port_bus *bus, uint8_t num);
+void port_out(port_bus *bus, uint8_t num, uint8_t byte);
+void port_flush(port_bus *bus);
+
+
+#endif
@@ -0,0 +1,730 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i8080.h"
+#include "jit.h"
+
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/* Size of the executable arena. */
+#define JIT_ARENA_SZ (4 << 20)
+
+/* Worst-case host code emitted for one micro-op, prologue and epilogue. */
+#define JIT_MAX_UOP_SZ 192
+
+/* PC of a block ending in a conditional jump, chosen at run time into edx. */
+#define PC_IN_EDX 0x10000
+
+struct jit {
+        uint8_t *base;
+        size_t used;
+        size_t page_sz;
+};
+
+/* Host registers by their encoding. */
+enum {
+        EAX = 0, ECX = 1, EDX = 2,
+        R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12,
+};
+
+/*
+ * While inline code runs, the 8080 registers live in host registers: A in
+ * r8d, F in r10d, and the pairs BC, DE and HL in r11d, r12d and r9d with the
+ * high register in bits 8-15, each zero-extended. They are loaded on first
+ * use and stored back before a handler runs or the block returns. Handlers
+ * may clobber them, so nothing is assumed loaded after a call.
+ */
+enum {
+        HOST_A = 1 << 0,
+        HOST_F = 1 << 1,
+        HOST_BC = 1 << 2,
+        HOST_DE = 1 << 3,
+        HOST_HL = 1 << 4,
+};
+
+/* Register pairs by the 2-bit pair field of 8080 opcodes; SP stays in memory. */
+static const struct {
+        unsigned cached;
+        int host;
+        int offset;
+} pairs[4] = {
+        { HOST_BC, R11, offsetof(i8080, B) },
+        { HOST_DE, R12, offsetof(i8080, D) },
+        { HOST_HL, R9, offsetof(i8080, H) },
+        { 0, -1, offsetof(i8080, SP) },
+};
+
+_Static_assert(offsetof(i8080, C) == offsetof(i8080, B) + 1, "B and C must be adjacent");
+_Static_assert(offsetof(i8080, E) == offsetof(i8080, D) + 1, "D and E must be adjacent");
+_Static_assert(offsetof(i8080, L) == offsetof(i8080, H) + 1, "H and L must be adjacent");
+
+typedef struct {
+        uint8_t *p;
+        // Host registers holding their 8080 registers, and those to store back
+        unsigned loaded, dirty;
+} emitter;
+
+static void
+emit(emitter *e, const void *bytes, size_t n)
+{
+        memcpy(e->p, bytes, n);
+        e->p += n;
+}
+
+static void
+emit8(emitter *e, uint8_t byte)
+{
+        *e->p++ = byte;
+}
+
+static void
+emit16(emitter *e, uint16_t x)
+{
+        emit(e, &x, sizeof x);
+}
+
+static void
+emit32(emitter *e, uint32_t x)
+{
+        emit(e, &x, sizeof x);
+}
+
+static void
+emit64(emitter *e, uint64_t x)
+{
+        emit(e, &x, sizeof x);
+}
+
+/*
+ * Operand size prefix for word operations, then the REX prefix the reg and
+ * r/m fields need, then the opcode.
+ */
+static void
+emit_op(emitter *e, bool word, int reg, int rm, const void *opcode, size_t n)
+{
+        if (word)
+                emit8(e, 0x66);
+        if ((reg | rm) & 8)
+                emit8(e, 0x40 | (reg & 8) >> 1 | (rm & 8) >> 3);
+        emit(e, opcode, n);
+}
+
+/* <opcode> with register operands, reg being a register or opcode extension. */
+static void
+emit_rr(emitter *e, bool word, const void *opcode, size_t n, int reg, int rm)
+{
+        emit_op(e, word, reg, rm, opcode, n);
+        emit8(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* <opcode> with a register and [rbx + disp32]. */
+static void
+emit_rm(emitter *e, bool word, const void *opcode, size_t n, int reg, int32_t disp)
+{
+        emit_op(e, word, reg, 0, opcode, n);
+        emit8(e, 0x80 | (reg & 7) << 3 | 3);
+        emit32(e, (uint32_t)disp);
+}
+
+#define OP(...) (uint8_t[]){ __VA_ARGS__ }, sizeof (uint8_t[]){ __VA_ARGS__ }
+
+/* mov byte [rbx + disp], imm8 */
+static void
+emit_store_imm8(emitter *e, int32_t disp, uint8_t imm)
+{
+        emit_rm(e, false, OP(0xC6), 0, disp);
+        emit8(e, imm);
+}
+
+/* mov word [rbx + disp], imm16 */
+static void
+emit_store_imm16(emitter *e, int32_t disp, uint16_t imm)
+{
+        emit_rm(e, true, OP(0xC7), 0, disp);
+        emit16(e, imm);
+}
+
+/* add qword [rbx + cycles], imm32 */
+static void
+emit_add_cycles(emitter *e, uint32_t n)
+{
+        emit8(e, 0x48);
+        emit_rm(e, false, OP(0x81), 0, offsetof(i8080, cycles));
+        emit32(e, n);
+}
+
+/* <group 1 op> reg, imm32: 0 add, 1 or, 4 and, 6 xor */
+static void
+emit_alu_imm(emitter *e, int ext, int reg, uint32_t imm)
+{
+        if (imm < 0x80) {
+                emit_rr(e, false, OP(0x83), ext, reg);
+                emit8(e, (uint8_t)imm);
+        } else {
+                emit_rr(e, false, OP(0x81), ext, reg);
+                emit32(e, imm);
+        }
+}
+
+/*
+ * Load F into r10d. With lazy flags, S, Z and P are merged in first, and F is
+ * stored back materialized so that memory and r10d agree. Clobbers eax and
+ * ecx, so callers load F before anything else.
+ */
+static void
+emit_load_f(emitter *e)
+{
+        emit_rm(e, false, OP(0x0F, 0xB6), R10, offsetof(i8080, F)); // movzx r10d, byte [rbx + F]
+#if I8080_LAZY_FLAGS
+        emit_rm(e, false, OP(0x80), 7, offsetof(i8080, szp_lazy)); // cmp byte [rbx + szp_lazy], 0
+        emit8(e, 0x00);
+        uint8_t *skip = e->p;
+        emit(e, OP(0x74, 0x00));                                // je done
+        emit_rm(e, false, OP(0x0F, 0xB6), EAX, offsetof(i8080, szp_result)); // movzx eax, byte [rbx + szp_result]
+        emit(e, OP(0x48, 0xB9));                                // mov rcx, szp_table
+        emit64(e, (uint64_t)(uintptr_t)szp_table);
+        emit(e, OP(0x0F, 0xB6, 0x04, 0x01));                    // movzx eax, byte [rcx + rax]
+        emit_alu_imm(e, 4, R10, (uint8_t)~F_SZP);               // and r10d, ~F_SZP
+        emit_rr(e, false, OP(0x09), EAX, R10);                  // or r10d, eax
+        emit_rm(e, false, OP(0x88), R10, offsetof(i8080, F));   // mov [rbx + F], r10b
+        emit_store_imm8(e, offsetof(i8080, szp_lazy), 0);
+        skip[1] = (uint8_t)(e->p - (skip + 2));
+#endif
+}
+
+/* Make the host copies of the given registers valid. */
+static void
+emit_use(emitter *e, unsigned regs)
+{
+        regs &= ~e->loaded;
+
+        if (regs & HOST_F)
+                emit_load_f(e);
+        if (regs & HOST_A)
+                emit_rm(e, false, OP(0x0F, 0xB6), R8, offsetof(i8080, A)); // movzx r8d, byte [rbx + A]
+        for (int p = 0; p < 3; ++p) {
+                if (!(regs & pairs[p].cached))
+                        continue;
+                // movzx r, word [rbx + hi]; rol r16, 8
+                emit_rm(e, false, OP(0x0F, 0xB7), pairs[p].host, pairs[p].offset);
+                emit_rr(e, true, OP(0xC1), 0, pairs[p].host);
+                emit8(e, 8);
+        }
+        e->loaded |= regs;
+}
+
+/* Note that the host copies of the given registers were changed. */
+static void
+mark_dirty(emitter *e, unsigned regs)
+{
+        e->loaded |= regs;
+        e->dirty |= regs;
+}
+
+/* Store changed host copies back into the structure. Leaves edx alone. */
+static void
+emit_writeback(emitter *e)
+{
+        if (e->dirty & HOST_A)
+                emit_rm(e, false, OP(0x88), R8, offsetof(i8080, A)); // mov [rbx + A], r8b
+        if (e->dirty & HOST_F)
+                emit_rm(e, false, OP(0x88), R10, offsetof(i8080, F)); // mov [rbx + F], r10b
+        for (int p = 0; p < 3; ++p) {
+                if (!(e->dirty & pairs[p].cached))
+                        continue;
+                // mov eax, r; rol ax, 8; mov [rbx + hi], ax
+                emit_rr(e, false, OP(0x89), pairs[p].host, EAX);
+                emit(e, OP(0x66, 0xC1, 0xC0, 0x08));
+                emit_rm(e, true, OP(0x89), EAX, pairs[p].offset);
+        }
+        e->dirty = 0;
+}
+
+/* Load 8080 register r (not M) into ecx. */
+static void
+emit_get(emitter *e, int r)
+{
+        if (r == 7) {
+                emit_use(e, HOST_A);
+                emit_rr(e, false, OP(0x89), R8, ECX);           // mov ecx, r8d
+                return;
+        }
+
+        int p = r >> 1;
+        emit_use(e, pairs[p].cached);
+        if (r & 1) {
+                emit_rr(e, false, OP(0x0F, 0xB6), ECX, pairs[p].host); // movzx ecx, low byte
+        } else {
+                emit_rr(e, false, OP(0x89), pairs[p].host, ECX); // mov ecx, pair
+                emit(e, OP(0xC1, 0xE9, 0x08));                  // shr ecx, 8
+        }
+}
+
+/* Set 8080 register r (not M) from cl. Clobbers ecx. */
+static void
+emit_set(emitter *e, int r)
+{
+        if (r == 7) {
+                emit_rr(e, false, OP(0x0F, 0xB6), R8, ECX);     // movzx r8d, cl
+                mark_dirty(e, HOST_A);
+                return;
+        }
+
+        int p = r >> 1;
+        int host = pairs[p].host;
+        emit_use(e, pairs[p].cached);
+        emit(e, OP(0x0F, 0xB6, 0xC9));                          // movzx ecx, cl
+        if (r & 1) {
+                emit_alu_imm(e, 4, host, 0xFF00);               // and pair, 0xFF00
+        } else {
+                emit(e, OP(0xC1, 0xE1, 0x08));                  // shl ecx, 8
+                emit_alu_imm(e, 4, host, 0x00FF);               // and pair, 0xFF
+        }
+        emit_rr(e, false, OP(0x09), ECX, host);                 // or pair, ecx
+        mark_dirty(e, pairs[p].cached);
+}
+
+/*
+ * Merge the host flags captured by lahf into F. The 8080 keeps S, Z, AC, P
+ * and CY where lahf puts SF, ZF, AF, PF and CF; keep selects the bits taken
+ * over, and ac_inverted is set for subtractions, whose AC is the inverse of
+ * AF. extra is or'ed in from edx when set. Bits of F outside mask are kept.
+ */
+static void
+emit_merge_flags(emitter *e, uint8_t keep, uint8_t mask, bool ac_inverted, bool extra)
+{
+        emit(e, OP(0x0F, 0xB6, 0xC4));                          // movzx eax, ah
+        emit_alu_imm(e, 4, EAX, keep);                          // and eax, keep
+        if (ac_inverted)
+                emit_alu_imm(e, 6, EAX, F_AC);                  // xor eax, F_AC
+        if (extra)
+                emit_rr(e, false, OP(0x09), EDX, EAX);          // or eax, edx
+        emit_alu_imm(e, 4, R10, (uint8_t)~mask);                // and r10d, ~mask
+        emit_rr(e, false, OP(0x09), EAX, R10);                  // or r10d, eax
+        mark_dirty(e, HOST_F);
+}
+
+/* Set CY from the host carry flag. */
+static void
+emit_carry_to_cy(emitter *e)
+{
+        emit(e, OP(0x0F, 0x92, 0xC0));                          // setc al
+        emit(e, OP(0x0F, 0xB6, 0xC0));                          // movzx eax, al
+        emit_alu_imm(e, 4, R10, (uint8_t)~F_CY);                // and r10d, ~F_CY
+        emit_rr(e, false, OP(0x09), EAX, R10);                  // or r10d, eax
+        mark_dirty(e, HOST_F);
+}
+
+/* bt r10d, 0: the host carry flag takes CY. */
+static void
+emit_cy_to_carry(emitter *e)
+{
+        emit_rr(e, false, OP(0x0F, 0xBA), 4, R10);
+        emit8(e, 0);
+}
+
+/*
+ * ADD, ADC, SUB, SBB, ANA, XRA, ORA or CMP, by the operation field of the
+ * opcode, of A and the operand in ecx. F must already be loaded.
+ */
+static void
+emit_alu(emitter *e, int kind)
+{
+        // <op> r8b, cl
+        static const uint8_t opcode[8] = { 0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38 };
+        const uint8_t all = F_SZP | F_AC | F_CY;
+
+        emit_use(e, HOST_A);
+        if (kind == 1 || kind == 3)                             // ADC, SBB
+                emit_cy_to_carry(e);
+        if (kind == 4) {                                        // ANA: AC is bit 3 of A | operand
+                emit_rr(e, false, OP(0x89), R8, EDX);           // mov edx, r8d
+                emit_rr(e, false, OP(0x09), ECX, EDX);          // or edx, ecx
+                emit_alu_imm(e, 4, EDX, 0x08);                  // and edx, 8
+                emit(e, OP(0xD1, 0xE2));                        // shl edx, 1
+        }
+        emit_rr(e, false, &opcode[kind], 1, ECX, R8);
+        emit8(e, 0x9F);                                         // lahf
+
+        if (kind < 4 || kind == 7)
+                emit_merge_flags(e, all, all, kind >= 2, false);
+        else
+                emit_merge_flags(e, F_SZP, all, false, kind == 4);
+        if (kind != 7)
+                mark_dirty(e, HOST_A);
+}
+
+/* INR (inc = true) or DCR of register r (not M). The Carry bit is kept. */
+static void
+emit_step_reg(emitter *e, int r, bool inc)
+{
+        emit_use(e, HOST_F);
+        emit_get(e, r);
+        emit(e, OP(0xFE, inc ? 0xC1 : 0xC9));                   // inc/dec cl
+        emit8(e, 0x9F);                                         // lahf
+        emit_merge_flags(e, F_SZP | F_AC, F_SZP | F_AC, !inc, false);
+        emit_set(e, r);
+}
+
+/* INX (inc = true) or DCX of register pair p. */
+static void
+emit_step_pair(emitter *e, int p, bool inc)
+{
+        if (!pairs[p].cached) {
+                // inc/dec word [rbx + SP]
+                emit_rm(e, true, OP(0xFF), inc ? 0 : 1, pairs[p].offset);
+                return;
+        }
+
+        emit_use(e, pairs[p].cached);
+        emit_rr(e, true, OP(0xFF), inc ? 0 : 1, pairs[p].host); // inc/dec r16
+        mark_dirty(e, pairs[p].cached);
+}
+
+/* DAD: HL += pair p, setting only CY. */
+static void
+emit_dad(emitter *e, int p)
+{
+        emit_use(e, HOST_F | HOST_HL | pairs[p].cached);
+        if (pairs[p].cached)
+                emit_rr(e, false, OP(0x89), pairs[p].host, ECX); // mov ecx, pair
+        else
+                emit_rm(e, false, OP(0x0F, 0xB7), ECX, pairs[p].offset); // movzx ecx, word [rbx + SP]
+        emit_rr(e, true, OP(0x01), ECX, R9);                    // add r9w, cx
+        mark_dirty(e, HOST_HL);
+        emit_carry_to_cy(e);
+}
+
+/* RLC, RRC, RAL or RAR, by the operation field of the opcode. */
+static void
+emit_rotate(emitter *e, int kind)
+{
+        emit_use(e, HOST_F | HOST_A);
+        if (kind >= 2)                                          // RAL, RAR rotate through CY
+                emit_cy_to_carry(e);
+        emit_rr(e, false, OP(0xD0), kind, R8);                  // rol/ror/rcl/rcr r8b, 1
+        mark_dirty(e, HOST_A);
+        emit_carry_to_cy(e);
+}
+
+/*
+ * Conditional jump ending the block: edx gets the target or the address of
+ * the next instruction by the condition flag.
+ */
+static void
+emit_cond_jump(emitter *e, const uop *u)
+{
+        // Flag tested by NZ/Z, NC/C, PO/PE and P/M
+        static const uint8_t cond_flag[4] = { F_Z, F_CY, F_P, F_S };
+        uint8_t cond = (u->op >> 3) & 7;
+
+        emit_use(e, HOST_F);
+        emit8(e, 0xBA);                                         // mov edx, next_pc
+        emit32(e, u->next_pc);
+        emit8(e, 0xB9);                                         // mov ecx, target
+        emit32(e, u->operand);
+        emit_rr(e, false, OP(0xF6), 0, R10);                    // test r10b, flag
+        emit8(e, cond_flag[cond >> 1]);
+        // cmovnz/cmovz edx, ecx: jump if the flag is set for odd conditions
+        emit_rr(e, false, OP(0x0F, (cond & 1) ? 0x45 : 0x44), EDX, ECX);
+}
+
+/*
+ * Emit the micro-op inline if it works on registers only, and set *pc to the
+ * address execution continues at, or PC_IN_EDX. Returns false if the micro-op
+ * needs its handler.
+ */
+static bool
+emit_inline(emitter *e, const uop *u, uint32_t *pc)
+{
+        uint8_t op = u->op;
+        int dst = (op >> 3) & 7;
+        int src = op & 7;
+        int pair = (op >> 4) & 3;
+
+        *pc = u->next_pc;
+
+        if (op == 0x00)                                         // NOP
+                return true;
+
+        if ((op & 0xC0) == 0x40 && dst != 6 && src != 6) {      // MOV r, r
+                if (dst != src) {
+                        emit_get(e, src);
+                        emit_set(e, dst);
+                }
+                return true;
+        }
+
+        if ((op & 0xC7) == 0x06 && dst != 6) {                  // MVI r
+                emit8(e, 0xB9);                                 // mov ecx, imm
+                emit32(e, (uint8_t)u->operand);
+                emit_set(e, dst);
+                return true;
+        }
+
+        if ((op & 0xC0) == 0x80 && src != 6) {                  // ALU r
+                emit_use(e, HOST_F);
+                emit_get(e, src);
+                emit_alu(e, dst);
+                return true;
+        }
+
+        if ((op & 0xC7) == 0xC6) {                              // ALU immediate
+                emit_use(e, HOST_F);
+                emit8(e, 0xB9);                                 // mov ecx, imm
+                emit32(e, (uint8_t)u->operand);
+                emit_alu(e, dst);
+                return true;
+        }
+
+        if ((op & 0xC6) == 0x04 && dst != 6) {                  // INR, DCR
+                emit_step_reg(e, dst, (op & 1) == 0);
+                return true;
+        }
+
+        if ((op & 0xE7) == 0x07) {                              // RLC, RRC, RAL, RAR
+                emit_rotate(e, dst);
+                return true;
+        }
+
+        if (op == 0x2F) {                                       // CMA
+                emit_use(e, HOST_A);
+                emit_rr(e, false, OP(0xF6), 2, R8);             // not r8b
+                mark_dirty(e, HOST_A);
+                return true;
+        }
+
+        if (op == 0x37 || op == 0x3F) {                         // STC, CMC
+                emit_use(e, HOST_F);
+                emit_alu_imm(e, op == 0x37 ? 1 : 6, R10, F_CY); // or/xor r10d, F_CY
+                mark_dirty(e, HOST_F);
+                return true;
+        }
+
+        if ((op & 0xCF) == 0x01) {                              // LXI
+                if (pairs[pair].cached) {
+                        emit_op(e, false, 0, pairs[pair].host, OP(0xB8 | (pairs[pair].host & 7)));
+                        emit32(e, u->operand);                  // mov pair, imm
+                        mark_dirty(e, pairs[pair].cached);
+                } else {
+                        emit_store_imm16(e, pairs[pair].offset, u->operand);
+                }
+                return true;
+        }
+
+        if ((op & 0xCF) == 0x03 || (op & 0xCF) == 0x0B) {       // INX, DCX
+                emit_step_pair(e, pair, (op & 0x08) == 0);
+                return true;
+        }
+
+        if ((op & 0xCF) == 0x09) {                              // DAD
+                emit_dad(e, pair);
+                return true;
+        }
+
+        if (op == 0xEB) {                                       // XCHG
+                emit_use(e, HOST_DE | HOST_HL);
+                emit_rr(e, false, OP(0x87), R12, R9);           // xchg r9d, r12d
+                mark_dirty(e, HOST_DE | HOST_HL);
+                return true;
+        }
+
+        if (op == 0xC3) {                                       // JMP
+                *pc = u->operand;
+                return true;
+        }
+
+        if ((op & 0xC7) == 0xC2) {                              // Jcc
+                emit_cond_jump(e, u);
+                *pc = PC_IN_EDX;
+                return true;
+        }
+
+        return false;
+}
+
+/*
+ * Bring registers, PC and the cycle count up to date before a handler runs or
+ * the block returns. Inline code leaves all of them pending.
+ */
+static void
+emit_sync(emitter *e, uint32_t *cycles, uint32_t pc)
+{
+        emit_writeback(e);
+        if (*cycles)
+                emit_add_cycles(e, *cycles);
+        if (pc == PC_IN_EDX)
+                emit_rm(e, true, OP(0x89), EDX, offsetof(i8080, PC)); // mov [rbx + PC], dx
+        else
+                emit_store_imm16(e, offsetof(i8080, PC), (uint16_t)pc);
+        *cycles = 0;
+}
+
+static void
+emit_call_handler(emitter *e, const uop *u)
+{
+        emit(e, OP(0x48, 0x89, 0xDF));                          // mov rdi, rbx
+        emit(e, OP(0x48, 0xBE));                                // mov rsi, u
+        emit64(e, (uint64_t)(uintptr_t)u);
+        emit(e, OP(0x48, 0xB8));                                // mov rax, u->fn
+        emit64(e, (uint64_t)(uintptr_t)u->fn);
+        emit(e, OP(0xFF, 0xD0));                                // call rax
+        // The handler may have changed any register and clobbered their copies
+        e->loaded = 0;
+}
+
+/* Restore the callee-saved registers and return. */
+static void
+emit_return(emitter *e)
+{
+        emit(e, OP(0x48, 0x83, 0xC4, 0x08));                    // add rsp, 8
+        emit(e, OP(0x41, 0x5C));                                // pop r12
+        emit(e, OP(0x5B, 0xC3));                                // pop rbx; ret
+}
+
+/* Return right away if the last handler overwrote the code of this block. */
+static void
+emit_valid_check(emitter *e, const block *b)
+{
+        emit(e, OP(0x48, 0xB8));                                // mov rax, &b->valid
+        emit64(e, (uint64_t)(uintptr_t)&b->valid);
+        emit(e, OP(0x80, 0x38, 0x00));                          // cmp byte [rax], 0
+        uint8_t *skip = e->p;
+        emit(e, OP(0x75, 0x00));                                // jne past the return
+        emit_return(e);
+        skip[1] = (uint8_t)(e->p - (skip + 2));
+}
+
+jit *
+jit_new(void)
+{
+        jit *j = malloc(sizeof *j);
+        if (!j)
+                return NULL;
+
+        // Never writable and executable at once: see jit_compile()
+        j->base = mmap(NULL, JIT_ARENA_SZ, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (j->base == MAP_FAILED) {
+                free(j);
+                return NULL;
+        }
+        j->used = 0;
+        j->page_sz = (size_t)sysconf(_SC_PAGESIZE);
+
+        return j;
+}
+
+void
+jit_free(jit *j)
+{
+        if (!j)
+                return;
+
+        munmap(j->base, JIT_ARENA_SZ);
+        free(j);
+}
+
+void
+jit_reset(jit *j)
+{
+        j->used = 0;
+}
+
+/*
+ * Compile the block. Returns NULL if the arena has no room left, in which case
+ * the caller resets it after dropping every pointer into it. The pages written
+ * are made writable for the time of the compilation only, then executable.
+ */
+native_fn
+jit_compile(jit *j, const block *b)
+{
+        size_t worst = (size_t)(b->len + 2) * JIT_MAX_UOP_SZ;
+        if (JIT_ARENA_SZ - j->used < worst)
+                return NULL;
+
+        uint8_t *start = j->base + j->used;
+        size_t first = j->used & ~(j->page_sz - 1);
+        size_t span = (j->used + worst - first + j->page_sz - 1) & ~(j->page_sz - 1);
+        if (first + span > JIT_ARENA_SZ)
+                span = JIT_ARENA_SZ - first;
+        if (mprotect(j->base + first, span, PROT_READ | PROT_WRITE))
+                return NULL;
+
+        emitter e = { start };
+        uint32_t cycles = 0;
+        uint32_t pc = b->start;
+        // Whether inline code has run since PC was last stored
+        bool pending = false;
+
+        emit(&e, OP(0x53));                                     // push rbx
+        emit(&e, OP(0x41, 0x54));                               // push r12
+        emit(&e, OP(0x48, 0x83, 0xEC, 0x08));                   // sub rsp, 8
+        emit(&e, OP(0x48, 0x89, 0xFB));                         // mov rbx, rdi
+
+        for (uint16_t i = 0; i < b->len; ++i) {
+                const uop *u = &b->ops[i];
+
+                cycles += u->cycles;
+                if (emit_inline(&e, u, &pc)) {
+                        pending = true;
+                        continue;
+                }
+
+                emit_sync(&e, &cycles, u->next_pc);
+                emit_call_handler(&e, u);
+                // A superinstruction runs the micro-ops after it too
+                i += u->span - 1;
+                if (i + 1 < b->len)
+                        emit_valid_check(&e, b);
+                // The handler has set PC itself if it branched
+                pending = false;
+        }
+
+        if (pending)
+                emit_sync(&e, &cycles, pc);
+
+        emit_return(&e);
+
+        if (mprotect(j->base + first, span, PROT_READ | PROT_EXEC))
+                return NULL;
+
+        j->used = (size_t)(e.p - j->base);
+        // Keep entry points 16-byte aligned
+        j->used = (j->used + 15) & ~(size_t)15;
+
+        return (native_fn)(void *)start;
+}
+
+#else
+
+jit *
+jit_new(void)
+{
+        return NULL;
+}
+
+void
+jit_free(jit *j)
+{
+}
+
+native_fn
+jit_compile(jit *j, const block *b)
+{
+        return NULL;
+}
+
+void
+jit_reset(jit *j)
+{
+}
+
+#endif
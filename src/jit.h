@@ -0,0 +1,44 @@
+#ifndef jit_h
+#define jit_h
+
+
+#include <stdbool.h>
+
+#include "block.h"
+
+
+/*
+ * Native code generator for hot blocks of the block cache.
+ *
+ * Compiled code is a function taking the CPU. Instructions working on
+ * registers only are emitted inline: moves, immediate loads, the ALU
+ * operations and rotates, INR/DCR, register pair arithmetic, XCHG, JMP and
+ * the conditional jumps. A, F, BC, DE and HL stay in host registers across
+ * runs of such instructions and are spilled around handler calls.
+ * Instructions touching memory or I/O call their micro-op handler, so the
+ * block engine's handlers remain the reference for those.
+ *
+ * Flags are computed eagerly even under I8080_LAZY_FLAGS: one lahf after the
+ * host operation yields S, Z and P along with AC and CY, so deferring them
+ * would save nothing inside compiled code, while keeping them pending would
+ * cost a table lookup at every handler call and block exit. The JIT with
+ * lazy flags measured 10-25% slower than without on the bench workloads.
+ * Code lives in one mmap'd arena that is never writable and executable at
+ * once, and is discarded wholesale with jit_reset() when it fills up.
+ *
+ * Only x86-64 hosts get a code generator. Elsewhere jit_new() returns NULL
+ * and the block engine interprets every block.
+ */
+
+/* Executions after which a block is compiled. */
+#define JIT_HOT_THRESHOLD 16
+
+typedef struct jit jit;
+
+jit *jit_new(void);
+void jit_free(jit *j);
+native_fn jit_compile(jit *j, const block *b);
+void jit_reset(jit *j);
+
+
+#endif
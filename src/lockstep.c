@@ -0,0 +1,402 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lockstep.h"
+
+
+/* Guests a worker takes at a time. */
+#define LOCKSTEP_CHUNK 16
+
+/* Guest numbers are 16 bits wide on the mailbox ports. */
+#define LOCKSTEP_MAX_GUESTS 0x10000
+
+typedef struct {
+        // Destination in an outbox, sender in an inbox
+        uint32_t peer;
+        uint32_t off;
+        uint8_t len;
+} message;
+
+/* Messages back to back in data, the first unread one at head. */
+typedef struct {
+        message *msgs;
+        size_t head, len, cap;
+        uint8_t *data;
+        size_t data_len, data_cap;
+} mailbox;
+
+typedef struct {
+        lockstep *ls;
+        i8080 *cpu;
+        uint32_t id;
+
+        // Message being put together
+        uint16_t dest;
+        uint8_t msg[LOCKSTEP_MSG_MAX];
+        uint8_t msg_len;
+
+        mailbox inbox, outbox;
+        // Bytes of the first inbox message read so far
+        uint8_t pos;
+        // Mail delivered at the end of this round
+        bool mail;
+
+        // Cycle count when added. Round r ends at start + (r + 1) * quantum.
+        uint64_t start;
+} guest;
+
+struct lockstep {
+        lockstep_options opts;
+        guest **guests;
+        size_t len, cap;
+
+        // Rounds run so far
+        uint64_t round;
+
+        // Shared with the workers; written only between barriers
+        size_t next;
+        bool done;
+        pthread_barrier_t start, end;
+        // Held while workers are being started, until the barriers are set
+        // up for the number that were
+        pthread_mutex_t gate;
+};
+
+
+/* ---------------------------------------------------------------- mailbox */
+
+static bool
+mailbox_push(mailbox *mb, uint32_t peer, const uint8_t *bytes, uint8_t len)
+{
+        if (mb->len == mb->cap) {
+                size_t cap = mb->cap ? mb->cap * 2 : 8;
+                message *msgs = realloc(mb->msgs, cap * sizeof *msgs);
+                if (!msgs)
+                        return false;
+                mb->msgs = msgs;
+                mb->cap = cap;
+        }
+        if (mb->data_cap - mb->data_len < len) {
+                size_t cap = mb->data_cap ? mb->data_cap : 256;
+                while (cap - mb->data_len < len)
+                        cap *= 2;
+                uint8_t *data = realloc(mb->data, cap);
+                if (!data)
+                        return false;
+                mb->data = data;
+                mb->data_cap = cap;
+        }
+        memcpy(mb->data + mb->data_len, bytes, len);
+        mb->msgs[mb->len++] = (message){ peer, (uint32_t)mb->data_len, len };
+        mb->data_len += len;
+        return true;
+}
+
+static void
+mailbox_clear(mailbox *mb)
+{
+        mb->head = mb->len = mb->data_len = 0;
+}
+
+/*
+ * Drop the messages already read once they make up more than half the
+ * mailbox, so that a guest that never empties it does not grow it forever.
+ */
+static void
+mailbox_compact(mailbox *mb)
+{
+        if (mb->head * 2 <= mb->len)
+                return;
+        if (mb->head == mb->len) {
+                mailbox_clear(mb);
+                return;
+        }
+        uint32_t off = mb->msgs[mb->head].off;
+        mb->len -= mb->head;
+        memmove(mb->msgs, mb->msgs + mb->head, mb->len * sizeof *mb->msgs);
+        for (size_t i = 0; i < mb->len; ++i)
+                mb->msgs[i].off -= off;
+        mb->data_len -= off;
+        memmove(mb->data, mb->data + off, mb->data_len);
+        mb->head = 0;
+}
+
+static void
+mailbox_free(mailbox *mb)
+{
+        free(mb->msgs);
+        free(mb->data);
+}
+
+static const message *
+first_message(const guest *g)
+{
+        return g->inbox.head < g->inbox.len ? &g->inbox.msgs[g->inbox.head] : NULL;
+}
+
+static uint8_t
+mailbox_in(void *ctx, uint8_t port)
+{
+        guest *g = ctx;
+        const message *m = first_message(g);
+
+        switch ((uint8_t)(port - g->ls->opts.port)) {
+                case 0: { return (uint8_t)g->id; }
+                case 1: { return (uint8_t)(g->id >> 8); }
+                case 2: { return m && g->pos < m->len ? g->inbox.data[m->off + g->pos++] : 0; }
+                case 3: {
+                        // Polling an empty mailbox gives up the rest of the quantum
+                        if (!m)
+                                stop_run(g->cpu);
+                        return m ? m->len : 0;
+                }
+                case 4: { return m ? (uint8_t)m->peer : 0; }
+                case 5: { return m ? (uint8_t)(m->peer >> 8) : 0; }
+        }
+        return 0xFF;
+}
+
+static void
+mailbox_out(void *ctx, uint8_t port, uint8_t byte)
+{
+        guest *g = ctx;
+
+        switch ((uint8_t)(port - g->ls->opts.port)) {
+                case 0: { g->dest = (uint16_t)((g->dest & 0xFF00) | byte); break; }
+                case 1: { g->dest = (uint16_t)((g->dest & 0x00FF) | byte << 8); break; }
+                case 2: {
+                        if (g->msg_len < LOCKSTEP_MSG_MAX)
+                                g->msg[g->msg_len++] = byte;
+                        break;
+                }
+                case 3: {
+                        // Empty messages would read as an empty mailbox
+                        if (g->msg_len)
+                                mailbox_push(&g->outbox, g->dest, g->msg, g->msg_len);
+                        g->msg_len = 0;
+                        break;
+                }
+                case 4: {
+                        if (first_message(g) && ++g->inbox.head == g->inbox.len)
+                                mailbox_clear(&g->inbox);
+                        g->pos = 0;
+                        break;
+                }
+        }
+}
+
+
+/* ------------------------------------------------------------- scheduling */
+
+/* Whether the guest has anything to do: not halted, or about to be woken. */
+static bool
+runnable(const guest *g)
+{
+        const i8080 *cpu = g->cpu;
+        return !cpu->halted
+            || (cpu->INTE && (interrupt_pending(cpu) || event_next(&cpu->events) != UINT64_MAX));
+}
+
+static void
+run_guest(lockstep *ls, guest *g)
+{
+        i8080 *cpu = g->cpu;
+        uint64_t end = g->start + (ls->round + 1) * ls->opts.quantum;
+
+        if (runnable(g) && cpu->cycles < end)
+                emulate_cycles(cpu, end - cpu->cycles);
+        // Waiting and yielding take up the rest of the round; a guest done
+        // for good keeps its count
+        if (cpu->cycles < end && (!cpu->halted || cpu->INTE))
+                cpu->cycles = end;
+}
+
+static void
+run_round(lockstep *ls)
+{
+        size_t i;
+        while ((i = __atomic_fetch_add(&ls->next, LOCKSTEP_CHUNK, __ATOMIC_RELAXED)) < ls->len) {
+                size_t last = i + LOCKSTEP_CHUNK < ls->len ? i + LOCKSTEP_CHUNK : ls->len;
+                for (; i < last; ++i)
+                        run_guest(ls, ls->guests[i]);
+        }
+}
+
+/*
+ * Hand the messages sent in the round to their destinations: senders in
+ * order, each sender's messages in the order sent.
+ */
+static void
+deliver(lockstep *ls)
+{
+        for (size_t i = 0; i < ls->len; ++i)
+                mailbox_compact(&ls->guests[i]->inbox);
+        for (size_t s = 0; s < ls->len; ++s) {
+                guest *from = ls->guests[s];
+                const mailbox *out = &from->outbox;
+                for (size_t i = 0; i < out->len; ++i) {
+                        const message *m = &out->msgs[i];
+                        if (m->peer >= ls->len)
+                                continue;
+                        guest *to = ls->guests[m->peer];
+                        if (mailbox_push(&to->inbox, from->id, out->data + m->off, m->len))
+                                to->mail = true;
+                }
+                mailbox_clear(&from->outbox);
+        }
+        for (size_t i = 0; i < ls->len; ++i) {
+                guest *g = ls->guests[i];
+                if (g->mail)
+                        request_interrupt(g->cpu, ls->opts.vector);
+                g->mail = false;
+        }
+}
+
+static bool
+any_runnable(const lockstep *ls)
+{
+        for (size_t i = 0; i < ls->len; ++i)
+                if (runnable(ls->guests[i]))
+                        return true;
+        return false;
+}
+
+static void *
+worker_main(void *arg)
+{
+        lockstep *ls = arg;
+        pthread_mutex_lock(&ls->gate);
+        pthread_mutex_unlock(&ls->gate);
+        for (;;) {
+                pthread_barrier_wait(&ls->start);
+                if (ls->done)
+                        return NULL;
+                run_round(ls);
+                pthread_barrier_wait(&ls->end);
+        }
+}
+
+
+/* -------------------------------------------------------------------- API */
+
+lockstep *
+lockstep_new(const lockstep_options *opts)
+{
+        lockstep *ls = calloc(1, sizeof *ls);
+        if (!ls)
+                return NULL;
+        ls->opts = *opts;
+        pthread_mutex_init(&ls->gate, NULL);
+        if (!ls->opts.quantum)
+                ls->opts.quantum = LOCKSTEP_QUANTUM;
+        if (ls->opts.vector < 1 || ls->opts.vector > 7)
+                ls->opts.vector = LOCKSTEP_VECTOR;
+        return ls;
+}
+
+/*
+ * Free the scheduler and the guests' mailboxes. The machines are the caller's
+ * and must not run again with the mailbox ports attached.
+ */
+void
+lockstep_free(lockstep *ls)
+{
+        for (size_t i = 0; i < ls->len; ++i) {
+                mailbox_free(&ls->guests[i]->inbox);
+                mailbox_free(&ls->guests[i]->outbox);
+                free(ls->guests[i]);
+        }
+        free(ls->guests);
+        pthread_mutex_destroy(&ls->gate);
+        free(ls);
+}
+
+/*
+ * Add a machine as the next guest, attaching its mailbox ports. It joins at
+ * the next round. Returns false if out of memory or guest numbers.
+ */
+bool
+lockstep_add(lockstep *ls, i8080 *cpu)
+{
+        if (ls->len == LOCKSTEP_MAX_GUESTS)
+                return false;
+        if (ls->len == ls->cap) {
+                size_t cap = ls->cap ? ls->cap * 2 : 64;
+                guest **guests = realloc(ls->guests, cap * sizeof *guests);
+                if (!guests)
+                        return false;
+                ls->guests = guests;
+                ls->cap = cap;
+        }
+        guest *g = calloc(1, sizeof *g);
+        if (!g)
+                return false;
+        g->ls = ls;
+        g->cpu = cpu;
+        g->id = (uint32_t)ls->len;
+        g->start = cpu->cycles - ls->round * ls->opts.quantum;
+        ls->guests[ls->len++] = g;
+        // A bad guest halts rather than ending the whole run
+        cpu->halt_on_fault = true;
+
+        for (int i = 0; i < 6; ++i)
+                attach_port(cpu, (uint8_t)(ls->opts.port + i), mailbox_in, mailbox_out, g);
+        return true;
+}
+
+/*
+ * Run rounds until no guest has anything left to do, or for max_rounds
+ * rounds if that is not 0. Returns the rounds run; another call carries on.
+ */
+uint64_t
+lockstep_run(lockstep *ls, uint64_t max_rounds)
+{
+        unsigned nworkers = ls->opts.threads;
+        if (!nworkers) {
+                long online = sysconf(_SC_NPROCESSORS_ONLN);
+                nworkers = online > 0 ? (unsigned)online : 1;
+        }
+        // More workers than chunks of guests would only wait at the barriers
+        size_t chunks = (ls->len + LOCKSTEP_CHUNK - 1) / LOCKSTEP_CHUNK;
+        if (nworkers > chunks)
+                nworkers = chunks ? (unsigned)chunks : 1;
+
+        // The calling thread is worker 0. Short of memory or threads, the
+        // round runs on the workers that could be started.
+        pthread_t *threads = calloc(nworkers, sizeof *threads);
+        if (!threads)
+                nworkers = 1;
+        pthread_mutex_lock(&ls->gate);
+        for (unsigned i = 1; i < nworkers; ++i) {
+                if (pthread_create(&threads[i], NULL, worker_main, ls)) {
+                        nworkers = i;
+                        break;
+                }
+        }
+        pthread_barrier_init(&ls->start, NULL, nworkers);
+        pthread_barrier_init(&ls->end, NULL, nworkers);
+        pthread_mutex_unlock(&ls->gate);
+
+        uint64_t rounds = 0;
+        for (;;) {
+                ls->done = (max_rounds && rounds == max_rounds) || !any_runnable(ls);
+                ls->next = 0;
+                pthread_barrier_wait(&ls->start);
+                if (ls->done)
+                        break;
+                run_round(ls);
+                pthread_barrier_wait(&ls->end);
+                deliver(ls);
+                ++ls->round;
+                ++rounds;
+        }
+
+        for (unsigned i = 1; i < nworkers; ++i)
+                pthread_join(threads[i], NULL);
+        free(threads);
+        pthread_barrier_destroy(&ls->start);
+        pthread_barrier_destroy(&ls->end);
+        return rounds;
+}
@@ -0,0 +1,72 @@
+#ifndef lockstep_h
+#define lockstep_h
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "i8080.h"
+
+
+/*
+ * Lockstep scheduler.
+ *
+ * Runs a set of machines that talk to each other, many per worker thread, in
+ * rounds of one quantum of cycles each. In a round every guest runs its
+ * quantum on whichever worker picks it up; in between, the messages sent
+ * during the round are delivered. Delivery goes in sender order, and in send
+ * order for each sender, so every guest sees the same inputs at the same
+ * point of its execution whatever the number of threads: runs are
+ * deterministic for a given quantum and engine. (The block engine and the JIT
+ * only end a quantum between blocks, so they are not in step with the
+ * interpreter.)
+ *
+ * Guests use a mailbox on six ports from lockstep_options.port (P) on:
+ *
+ *      port    OUT                             IN
+ *      P       destination guest, low byte     own guest number, low byte
+ *      P+1     destination guest, high byte    own guest number, high byte
+ *      P+2     append a byte to the message    next byte of the first message
+ *      P+3     send the message                length of the first message
+ *      P+4     drop the first message          sender of the first message, low
+ *      P+5                                     sender of the first message, high
+ *
+ * Guests are numbered in the order they were added. Messages hold up to
+ * LOCKSTEP_MSG_MAX bytes, and those to no guest are dropped. Reading a length
+ * of 0 (an empty mailbox) ends the guest's quantum, as does HLT. A halted
+ * guest with interrupts enabled is not run again until a message arrives,
+ * which requests an interrupt on lockstep_options.vector, or one of its
+ * scheduled events is due. A guest waiting or yielding still has its clock
+ * advanced to the end of the round. An unrecognized opcode halts the guest
+ * for good, with interrupts disabled.
+ */
+
+#define LOCKSTEP_MSG_MAX 255
+
+typedef struct lockstep lockstep;
+
+typedef struct {
+        // Worker threads. 0 for one per online processor.
+        unsigned threads;
+        // Cycles each guest runs per round
+        uint64_t quantum;
+        // First mailbox port
+        uint8_t port;
+        // RST vector (1 to 7) raised when mail arrives
+        int vector;
+} lockstep_options;
+
+/* Defaults for lockstep_options */
+#define LOCKSTEP_QUANTUM 10000
+#define LOCKSTEP_PORT 0xE8
+#define LOCKSTEP_VECTOR 7
+
+
+lockstep *lockstep_new(const lockstep_options *opts);
+void lockstep_free(lockstep *ls);
+bool lockstep_add(lockstep *ls, i8080 *cpu);
+uint64_t lockstep_run(lockstep *ls, uint64_t max_rounds);
+
+
+#endif
@@ -1,12 +1,326 @@
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "cpm.h"
+#include "lockstep.h"
 #include "i8080.h"
+#include "profile.h"
+#include "snapshot.h"
+
+
+/*
+ * Records the trace recorder keeps by default (-n). Each instruction and each
+ * byte stored takes one, so this is a count of records, not of instructions.
+ */
+#define TRACE_RECORDS (1 << 20)
+
+/* States run between checks for a profile dump request. */
+#define PROFILE_SLICE 1000000
+
+static volatile sig_atomic_t profile_signal;
+
+
+static void
+usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [-l load_addr] [-p entry] [-w state] [-P prefix] [-T trace [-n records]]\n"
+                "          ROM | -r state\n"
+                "       %s -L guests [-t threads] [-q quantum] [-c max_cycles] [-e interp|block|jit]\n"
+                "          [-l load_addr] [-p entry] ROM\n"
+                "       %s -C dir [-e interp|block|jit] COM [ARG...]\n"
+                "       %s -B [-t threads] [-q quantum] [-c max_cycles] [-a input_addr]\n"
+                "          [-e interp|block|jit] [-l load_addr] [-p entry] ROM | -r state INPUT...\n",
+                prog, prog, prog, prog);
+        exit(EXIT_FAILURE);
+}
+
+static uint8_t *
+read_file(const char *path, size_t *len)
+{
+        FILE *f = fopen(path, "rb");
+        if (!f) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        size_t cap = 4096, n = 0;
+        uint8_t *buf = malloc(cap);
+        size_t got;
+        while ((got = fread(buf + n, 1, cap - n, f)) > 0) {
+                n += got;
+                if (n == cap)
+                        buf = realloc(buf, cap *= 2);
+        }
+        fclose(f);
+        *len = n;
+        return buf;
+}
 
+static engine
+parse_engine(const char *name, const char *prog)
+{
+        if (!strcmp(name, "interp"))
+                return ENGINE_INTERPRETER;
+        if (!strcmp(name, "block"))
+                return ENGINE_BLOCK_CACHE;
+        if (!strcmp(name, "jit"))
+                return ENGINE_JIT;
+        usage(prog);
+        return ENGINE_INTERPRETER;
+}
+
+static const char *status_names[] = {
+        [BATCH_HALTED] = "halted",
+        [BATCH_CYCLE_LIMIT] = "cycle-limit",
+        [BATCH_FAULTED] = "faulted",
+        [BATCH_FAILED] = "failed",
+};
+
+static void
+on_profile_signal(int sig)
+{
+        profile_signal = sig;
+}
+
+static void
+write_profile(const profile *prof, const char *prefix)
+{
+        char path[4096];
+        FILE *f;
+
+        snprintf(path, sizeof path, "%s.report", prefix);
+        if ((f = fopen(path, "w"))) {
+                profile_write_report(prof, f);
+                fclose(f);
+        } else {
+                perror(path);
+        }
+        snprintf(path, sizeof path, "%s.folded", prefix);
+        if ((f = fopen(path, "w"))) {
+                profile_write_folded(prof, f);
+                fclose(f);
+        } else {
+                perror(path);
+        }
+}
+
+/*
+ * Run under the profiler and write prefix.report and prefix.folded when the
+ * CPU halts. SIGUSR1 writes them on the fly; SIGINT and SIGTERM write them
+ * and exit. Nothing in the CLI raises interrupts, so any halt ends the run.
+ */
+static void
+profile_main(i8080 *cpu, const char *prefix)
+{
+        if (!enable_profiler(cpu)) {
+                fprintf(stderr, "profiler not available, build with make PROFILE=1\n");
+                exit(EXIT_FAILURE);
+        }
+        signal(SIGUSR1, on_profile_signal);
+        signal(SIGINT, on_profile_signal);
+        signal(SIGTERM, on_profile_signal);
+
+        while (!cpu->halted) {
+                emulate_cycles(cpu, PROFILE_SLICE);
+                if (profile_signal) {
+                        int sig = profile_signal;
+                        profile_signal = 0;
+                        write_profile(cpu->prof, prefix);
+                        if (sig != SIGUSR1)
+                                exit(128 + sig);
+                }
+        }
+        write_profile(cpu->prof, prefix);
+}
+
+/*
+ * Run ROM, or the machine saved in state, once per INPUT file and print one
+ * line per job, in argument order.
+ */
+static int
+batch_main(int argc, char *argv[], const batch_options *opts, const batch_job *proto)
+{
+        const char *rom = NULL;
+        if (!proto->state) {
+                if (optind >= argc)
+                        usage(argv[0]);
+                rom = argv[optind++];
+        }
+        if (optind >= argc)
+                usage(argv[0]);
+        size_t n = (size_t)(argc - optind);
+        batch_job *jobs = calloc(n, sizeof *jobs);
+        batch_result *results = calloc(n, sizeof *results);
+        for (size_t i = 0; i < n; ++i) {
+                jobs[i] = *proto;
+                jobs[i].rom_path = rom;
+                jobs[i].input = read_file(argv[optind + i], &jobs[i].input_len);
+        }
+
+        run_batch(jobs, results, n, opts);
+
+        int failed = 0;
+        for (size_t i = 0; i < n; ++i) {
+                batch_result *r = &results[i];
+                printf("%s %s cycles=%" PRIu64 " A=%02x B=%02x C=%02x D=%02x E=%02x H=%02x L=%02x F=%02x PC=%04x SP=%04x\n",
+                       argv[optind + i], status_names[r->status], r->cycles,
+                       r->A, r->B, r->C, r->D, r->E, r->H, r->L, r->F, r->PC, r->SP);
+                failed |= r->status == BATCH_FAILED || r->status == BATCH_FAULTED;
+                free((void *)jobs[i].input);
+        }
+        free(jobs);
+        free(results);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Run guests copies of ROM in lockstep, each a fork of one booted machine, and
+ * print one line per guest in guest order. max_cycles in job bounds the run,
+ * rounded up to whole quanta.
+ */
+static int
+lockstep_main(int argc, char *argv[], size_t guests, const lockstep_options *opts, engine e, const batch_job *job)
+{
+        if (optind >= argc)
+                usage(argv[0]);
+
+        i8080 boot;
+        init_at(&boot, argv[optind], job->load_addr, job->entry);
+        select_engine(&boot, e);
+
+        lockstep *ls = lockstep_new(opts);
+        i8080 **cpus = calloc(guests, sizeof *cpus);
+        if (!ls || !cpus) {
+                perror("lockstep");
+                return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < guests; ++i) {
+                if (!(cpus[i] = i8080_fork(&boot)) || !lockstep_add(ls, cpus[i])) {
+                        perror("lockstep");
+                        return EXIT_FAILURE;
+                }
+        }
+        uint64_t quantum = opts->quantum ? opts->quantum : LOCKSTEP_QUANTUM;
+        lockstep_run(ls, job->max_cycles ? (job->max_cycles + quantum - 1) / quantum : 0);
+
+        for (size_t i = 0; i < guests; ++i) {
+                i8080 *cpu = cpus[i];
+                const char *status = cpu->faulted ? "faulted" : !cpu->halted ? "running"
+                                   : cpu->INTE ? "waiting" : "halted";
+                printf("%zu %s cycles=%" PRIu64 " A=%02x B=%02x C=%02x D=%02x E=%02x H=%02x L=%02x F=%02x PC=%04x SP=%04x\n",
+                       i, status, cpu->cycles, cpu->A, cpu->B, cpu->C, cpu->D, cpu->E, cpu->H, cpu->L,
+                       cpu->F, cpu->PC, cpu->SP);
+        }
+        lockstep_free(ls);
+        for (size_t i = 0; i < guests; ++i)
+                i8080_free(cpus[i]);
+        free(cpus);
+        release(&boot);
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Run a CP/M program with its files in dir, the arguments after it making up
+ * its command line.
+ */
+static int
+cpm_main(int argc, char *argv[], const char *dir, engine e)
+{
+        if (optind >= argc)
+                usage(argv[0]);
+
+        i8080 cpu;
+        init(&cpu, argv[optind]);
+        if (!select_engine(&cpu, e))
+                select_engine(&cpu, ENGINE_INTERPRETER);
+        cpm *sys = cpm_attach(&cpu, dir, argc - optind - 1, argv + optind + 1);
+        if (!sys) {
+                perror("cpm_attach");
+                return EXIT_FAILURE;
+        }
+        emulate(&cpu);
+        cpm_detach(sys);
+        release(&cpu);
+        return EXIT_SUCCESS;
+}
 
 int
 main(int argc, char *argv[])
 {
+        bool batch_mode = false;
+        // A quantum of 0 picks the batch or lockstep default
+        batch_options opts = { 0, 0, ENGINE_JIT };
+        bool engine_set = false;
+        size_t guests = 0;
+        batch_job job = { .input_addr = 0x8000, .load_addr = BEGIN_ADDR, .entry = BEGIN_ADDR };
+        bool entry_set = false;
+        const char *save_path = NULL, *profile_prefix = NULL, *trace_path = NULL, *cpm_dir = NULL;
+        size_t trace_records = TRACE_RECORDS;
+        int c;
+
+        while ((c = getopt(argc, argv, "Bt:q:c:a:e:r:w:l:p:P:T:n:C:L:")) != -1) {
+                switch (c) {
+                        case 'B': { batch_mode = true; break; }
+                        case 't': { opts.threads = (unsigned)strtoul(optarg, NULL, 0); break; }
+                        case 'q': { opts.quantum = strtoull(optarg, NULL, 0); break; }
+                        case 'c': { job.max_cycles = strtoull(optarg, NULL, 0); break; }
+                        case 'a': { job.input_addr = (uint16_t)strtoul(optarg, NULL, 0); break; }
+                        case 'e': { opts.engine = parse_engine(optarg, argv[0]); engine_set = true; break; }
+                        case 'L': { guests = strtoull(optarg, NULL, 0); break; }
+                        case 'r': { job.state = optarg; break; }
+                        case 'w': { save_path = optarg; break; }
+                        case 'P': { profile_prefix = optarg; break; }
+                        case 'T': { trace_path = optarg; break; }
+                        case 'n': { trace_records = strtoull(optarg, NULL, 0); break; }
+                        case 'C': { cpm_dir = optarg; break; }
+                        case 'l': { job.load_addr = (uint16_t)strtoul(optarg, NULL, 0); break; }
+                        case 'p': { job.entry = (uint16_t)strtoul(optarg, NULL, 0); entry_set = true; break; }
+                        default: usage(argv[0]);
+                }
+        }
+        // Programs start where they are loaded unless told otherwise
+        if (!entry_set)
+                job.entry = job.load_addr;
+        if (batch_mode)
+                return batch_main(argc, argv, &opts, &job);
+        if (cpm_dir)
+                return cpm_main(argc, argv, cpm_dir, opts.engine);
+        if (guests) {
+                // Per-guest translation caches add up, so interpret by default
+                lockstep_options lo = { opts.threads, opts.quantum, LOCKSTEP_PORT, LOCKSTEP_VECTOR };
+                return lockstep_main(argc, argv, guests, &lo, engine_set ? opts.engine : ENGINE_INTERPRETER, &job);
+        }
+
         i8080 cpu;
-        init(&cpu, argv[1]);
-        emulate(&cpu);
+        if (job.state) {
+                reset(&cpu);
+                if (!restore_state(&cpu, job.state)) {
+                        perror(job.state);
+                        return EXIT_FAILURE;
+                }
+        } else {
+                if (optind >= argc)
+                        usage(argv[0]);
+                init_at(&cpu, argv[optind], job.load_addr, job.entry);
+        }
+        // The trace is only written if the guest faults
+        if (trace_path && !enable_trace(&cpu, trace_records, trace_path)) {
+                fprintf(stderr, "trace recorder not available, build with make TRACE=1\n");
+                return EXIT_FAILURE;
+        }
+        if (profile_prefix)
+                profile_main(&cpu, profile_prefix);
+        else
+                emulate(&cpu);
 
+        if (save_path && !save_state(&cpu, save_path)) {
+                perror(save_path);
+                return EXIT_FAILURE;
+        }
         return 0;
-}
\ No newline at end of file
+}
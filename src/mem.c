@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+
+/*
+ * Backs every page no one has written yet. Never owned, never freed and
+ * never written, so it is shared by all machines in the process.
+ */
+static const mem_page zero_page;
+
+#define ZERO_PAGE ((mem_page *)&zero_page)
+
+/* Note that the page may have changed, for mem_hash() and the dirty bitmap. */
+static void
+mark_changed(memory *m, size_t page)
+{
+        m->stale[page / 64] |= (uint64_t)1 << (page % 64);
+        m->dirty[page / 64] |= (uint64_t)1 << (page % 64);
+}
+
+
+void
+mem_init(memory *m)
+{
+        for (size_t i = 0; i < PAGE_COUNT; ++i) {
+                m->page[i] = ZERO_PAGE;
+                m->rd[i] = zero_page.bytes;
+                m->wr[i] = NULL;
+                m->type[i] = MEM_RAM;
+                m->dev[i] = (mmio){ NULL, NULL, NULL };
+                m->hash[i] = 0;
+        }
+        for (size_t i = 0; i < MEM_MAX_MAPPINGS; ++i)
+                m->maps[i] = NULL;
+        for (size_t i = 0; i < PAGE_COUNT / 64; ++i)
+                m->stale[i] = m->dirty[i] = ~(uint64_t)0;
+        m->hash_sum = 0;
+}
+
+static void
+page_put(mem_page *p)
+{
+        if (p && p != ZERO_PAGE && __atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0)
+                free(p);
+}
+
+static void
+mapping_put(mem_mapping *map)
+{
+        if (map && __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+                munmap(map->base, map->len);
+                free(map);
+        }
+}
+
+void
+mem_free(memory *m)
+{
+        for (size_t i = 0; i < PAGE_COUNT; ++i)
+                page_put(m->page[i]);
+        for (size_t i = 0; i < MEM_MAX_MAPPINGS; ++i)
+                mapping_put(m->maps[i]);
+        mem_init(m);
+}
+
+/*
+ * Make dst refer to the same pages as src. Both lose write access to them,
+ * so whichever stores to a page first gets its own copy.
+ */
+void
+mem_share(memory *dst, memory *src)
+{
+        for (size_t i = 0; i < PAGE_COUNT; ++i) {
+                mem_page *p = src->page[i];
+                if (p && p != ZERO_PAGE)
+                        __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+                dst->page[i] = p;
+                dst->rd[i] = src->rd[i];
+                dst->wr[i] = NULL;
+                src->wr[i] = NULL;
+                dst->type[i] = src->type[i];
+                dst->dev[i] = src->dev[i];
+                dst->hash[i] = src->hash[i];
+        }
+        for (size_t i = 0; i < PAGE_COUNT / 64; ++i) {
+                dst->stale[i] = src->stale[i];
+                dst->dirty[i] = src->dirty[i];
+        }
+        dst->hash_sum = src->hash_sum;
+        for (size_t i = 0; i < MEM_MAX_MAPPINGS; ++i) {
+                if (src->maps[i])
+                        __atomic_add_fetch(&src->maps[i]->refs, 1, __ATOMIC_RELAXED);
+                dst->maps[i] = src->maps[i];
+        }
+}
+
+/*
+ * Give the memory a private copy of the page, unless it already is the only
+ * one referring to it, and return the page's bytes for writing. The page
+ * becomes directly writable if it is RAM. Not for MMIO pages.
+ */
+uint8_t *
+mem_own(memory *m, uint8_t page)
+{
+        mem_page *p = m->page[page];
+
+        mark_changed(m, page);
+
+        // Only this memory could share the page further, so a count of one
+        // cannot change under us.
+        if (p && p != ZERO_PAGE && __atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) == 1) {
+                if (m->type[page] == MEM_RAM)
+                        m->wr[page] = p->bytes;
+                return p->bytes;
+        }
+
+        mem_page *copy = malloc(sizeof *copy);
+        if (!copy) {
+                perror("mem_own");
+                exit(1);
+        }
+        copy->refs = 1;
+        memcpy(copy->bytes, m->rd[page], PAGE_SZ);
+        page_put(p);
+
+        m->page[page] = copy;
+        m->rd[page] = copy->bytes;
+        if (m->type[page] == MEM_RAM)
+                m->wr[page] = copy->bytes;
+        return copy->bytes;
+}
+
+#define HASH_K1 0x9E3779B97F4A7C15ull
+#define HASH_K2 0xC2B2AE3D27D4EB4Full
+
+static uint64_t
+hash_mix(uint64_t h)
+{
+        h ^= h >> 33;
+        h *= HASH_K2;
+        h ^= h >> 29;
+        h *= HASH_K1;
+        h ^= h >> 32;
+        return h;
+}
+
+/* Hash of the page's number, type and contents, MMIO pages having none. */
+static uint64_t
+page_hash(const memory *m, size_t page)
+{
+        uint64_t seed = (page << 8 | m->type[page]) * HASH_K1;
+        const uint8_t *p = m->rd[page];
+        if (!p)
+                return hash_mix(seed);
+
+        // Four independent lanes, so that the multiplies overlap
+        uint64_t a = seed, b = seed ^ HASH_K2, c = seed + HASH_K1, d = seed - HASH_K2;
+        for (size_t i = 0; i < PAGE_SZ; i += 32) {
+                uint64_t w[4];
+                memcpy(w, p + i, sizeof w);
+                a = (a ^ w[0]) * HASH_K1;
+                b = (b ^ w[1]) * HASH_K2;
+                c = (c ^ w[2]) * HASH_K1;
+                d = (d ^ w[3]) * HASH_K2;
+                a ^= a >> 31;
+                b ^= b >> 29;
+                c ^= c >> 31;
+                d ^= d >> 29;
+        }
+        return hash_mix(a ^ hash_mix(b ^ hash_mix(c ^ hash_mix(d))));
+}
+
+/*
+ * Hash of the whole memory: types and contents of all pages. Only the pages
+ * made writable or changed since the last call are hashed again.
+ */
+uint64_t
+mem_hash(memory *m)
+{
+        for (size_t w = 0; w < PAGE_COUNT / 64; ++w) {
+                while (m->stale[w]) {
+                        size_t page = w * 64 + (size_t)__builtin_ctzll(m->stale[w]);
+                        m->stale[w] &= m->stale[w] - 1;
+                        // Stores have to come through mem_own() again to mark it
+                        m->wr[page] = NULL;
+                        m->hash_sum -= m->hash[page];
+                        m->hash[page] = page_hash(m, page);
+                        m->hash_sum += m->hash[page];
+                }
+        }
+        return m->hash_sum;
+}
+
+/*
+ * Unmark count pages from first on in the dirty bitmap, and write protect
+ * them so that the next store to each marks it again.
+ */
+void
+mem_clear_dirty(memory *m, uint8_t first, size_t count)
+{
+        for (size_t page = first; page < PAGE_COUNT && page < first + count; ++page) {
+                m->dirty[page / 64] &= ~((uint64_t)1 << (page % 64));
+                m->wr[page] = NULL;
+        }
+}
+
+uint8_t
+mem_read_slow(const memory *m, uint16_t addr)
+{
+        const mmio *dev = &m->dev[addr >> PAGE_SHIFT];
+        return dev->read ? dev->read(dev->ctx, addr) : 0xFF;
+}
+
+void
+mem_write_slow(memory *m, uint16_t addr, uint8_t byte)
+{
+        uint8_t page = addr >> PAGE_SHIFT;
+        switch (m->type[page]) {
+                case MEM_RAM: { mem_own(m, page)[addr & (PAGE_SZ - 1)] = byte; break; }
+                case MEM_ROM: break;
+                case MEM_MMIO: {
+                        const mmio *dev = &m->dev[page];
+                        if (dev->write)
+                                dev->write(dev->ctx, addr, byte);
+                        break;
+                }
+        }
+}
+
+/*
+ * Change what a page is. Its contents survive switching between RAM and ROM;
+ * an MMIO page has none, and reads as zero if it is made RAM or ROM again.
+ * dev is only used for MMIO.
+ */
+void
+mem_set_type(memory *m, uint8_t page, mem_type type, const mmio *dev)
+{
+        if (type == MEM_MMIO) {
+                page_put(m->page[page]);
+                m->page[page] = ZERO_PAGE;
+                m->rd[page] = NULL;
+                m->dev[page] = *dev;
+        } else {
+                if (m->type[page] == MEM_MMIO)
+                        m->rd[page] = zero_page.bytes;
+                m->dev[page] = (mmio){ NULL, NULL, NULL };
+        }
+        m->wr[page] = NULL;
+        m->type[page] = (uint8_t)type;
+        mark_changed(m, page);
+}
+
+/* Give dst the page types and devices of src, keeping its own contents. */
+void
+mem_copy_layout(memory *dst, const memory *src)
+{
+        for (size_t i = 0; i < PAGE_COUNT; ++i)
+                if (src->type[i] != dst->type[i] || src->type[i] == MEM_MMIO)
+                        mem_set_type(dst, (uint8_t)i, (mem_type)src->type[i], &src->dev[i]);
+}
+
+/*
+ * Copy len bytes into memory from addr on, wrapping at the top. ROM pages
+ * are written too; the part falling on MMIO pages is skipped.
+ */
+void
+mem_load(memory *m, uint16_t addr, const void *buf, size_t len)
+{
+        const uint8_t *src = buf;
+        while (len) {
+                size_t off = addr & (PAGE_SZ - 1);
+                size_t n = PAGE_SZ - off < len ? PAGE_SZ - off : len;
+                uint8_t *p = m->wr[addr >> PAGE_SHIFT];
+                if (!p && m->type[addr >> PAGE_SHIFT] != MEM_MMIO)
+                        p = mem_own(m, addr >> PAGE_SHIFT);
+                if (p)
+                        memcpy(p + off, src, n);
+                src += n;
+                len -= n;
+                addr += n;
+        }
+}
+
+/*
+ * Copy len bytes out of memory from addr on, wrapping at the top. MMIO pages
+ * read as zero, without involving their devices.
+ */
+void
+mem_dump(const memory *m, uint16_t addr, void *buf, size_t len)
+{
+        uint8_t *dst = buf;
+        while (len) {
+                size_t off = addr & (PAGE_SZ - 1);
+                size_t n = PAGE_SZ - off < len ? PAGE_SZ - off : len;
+                const uint8_t *p = m->rd[addr >> PAGE_SHIFT];
+                memcpy(dst, (p ? p : zero_page.bytes) + off, n);
+                dst += n;
+                len -= n;
+                addr += n;
+        }
+}
+
+/*
+ * Back len bytes of memory from addr on with the file contents at offset,
+ * without reading them. addr must be page aligned and offset a multiple of
+ * the host page size. A trailing partial page is copied, and MMIO pages are
+ * left alone. Returns false if
+ * the range cannot be mapped, in which case memory is unchanged.
+ */
+bool
+mem_map_file(memory *m, uint16_t addr, int fd, size_t offset, size_t len)
+{
+        long host_page = sysconf(_SC_PAGESIZE);
+        if (addr % PAGE_SZ || host_page <= 0 || offset % (size_t)host_page
+            || len == 0 || len > 0x10000 - (size_t)addr)
+                return false;
+
+        size_t slot = 0;
+        while (slot < MEM_MAX_MAPPINGS && m->maps[slot])
+                ++slot;
+        if (slot == MEM_MAX_MAPPINGS)
+                return false;
+
+        mem_mapping *map = malloc(sizeof *map);
+        if (!map)
+                return false;
+        map->base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, (off_t)offset);
+        if (map->base == MAP_FAILED) {
+                free(map);
+                return false;
+        }
+        map->len = len;
+        map->refs = 1;
+        m->maps[slot] = map;
+
+        const uint8_t *src = map->base;
+        size_t first = addr >> PAGE_SHIFT;
+        size_t full = len >> PAGE_SHIFT;
+        for (size_t i = 0; i < full; ++i) {
+                if (m->type[first + i] == MEM_MMIO)
+                        continue;
+                page_put(m->page[first + i]);
+                m->page[first + i] = NULL;
+                m->rd[first + i] = src + (i << PAGE_SHIFT);
+                m->wr[first + i] = NULL;
+                mark_changed(m, first + i);
+        }
+        if (len % PAGE_SZ)
+                mem_load(m, (uint16_t)(addr + (full << PAGE_SHIFT)), src + (full << PAGE_SHIFT), len % PAGE_SZ);
+        return true;
+}
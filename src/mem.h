@@ -0,0 +1,143 @@
+#ifndef mem_h
+#define mem_h
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Paged guest memory.
+ *
+ * The 64 KiB address space is split into 256-byte pages held by pointer, so
+ * that machines forked from one another share every page neither has written
+ * since. A shared page is copied on the first store to it. Untouched memory
+ * reads as zero from a single static page.
+ *
+ * Pages can also be read straight out of a file mapping, which the memory
+ * and its forks keep alive for as long as any of them refers to it. Such a
+ * page is copied too on the first store.
+ *
+ * Each page is RAM, ROM or memory-mapped I/O. Stores to ROM are ignored, and
+ * MMIO pages hand every access to the device attached to them.
+ *
+ * Reads go through rd[], stores through wr[]. A NULL rd[] entry marks an MMIO
+ * page; a NULL wr[] entry sends the store down the slow path, which is where
+ * copy-on-write, write protection and MMIO happen. Plain RAM and ROM accesses
+ * thus stay a single indexed load.
+ *
+ * Each page also has a hash of its type and contents, kept for mem_hash().
+ * Pages whose hash is out of date are marked in stale[], and only those are
+ * hashed again. A page is marked whenever it is made writable, so after
+ * hashing it is write protected: the next store takes the slow path once
+ * and marks it again. Hashes depend on the host's byte order.
+ *
+ * dirty[] is marked the same way, and cleared only by mem_clear_dirty(). It
+ * holds the pages that may have changed since then: a page stays marked from
+ * its first store on, even if that stored the byte already there. Stores to
+ * MMIO pages go to their devices and mark nothing.
+ */
+
+#define PAGE_SHIFT 8
+#define PAGE_SZ (1 << PAGE_SHIFT)
+#define PAGE_COUNT (0x10000 >> PAGE_SHIFT)
+
+typedef struct {
+        // Number of memories referring to the page
+        unsigned refs;
+        uint8_t bytes[PAGE_SZ];
+} mem_page;
+
+/* Read-only file mapping pages can be backed by. */
+typedef struct {
+        unsigned refs;
+        void *base;
+        size_t len;
+} mem_mapping;
+
+typedef uint8_t (*mmio_read_fn)(void *ctx, uint16_t addr);
+typedef void (*mmio_write_fn)(void *ctx, uint16_t addr, uint8_t byte);
+
+/* Device behind an MMIO page. Either callback may be NULL. */
+typedef struct {
+        mmio_read_fn read;
+        mmio_write_fn write;
+        void *ctx;
+} mmio;
+
+typedef enum {
+        MEM_RAM,
+        MEM_ROM,
+        MEM_MMIO,
+} mem_type;
+
+/* File mappings one memory can have at a time. */
+#define MEM_MAX_MAPPINGS 4
+
+typedef struct {
+        const uint8_t *rd[PAGE_COUNT];
+        // NULL unless the page is private to this memory
+        uint8_t *wr[PAGE_COUNT];
+        // NULL for pages read from a mapping, the zero page for MMIO
+        mem_page *page[PAGE_COUNT];
+        mem_mapping *maps[MEM_MAX_MAPPINGS];
+        uint8_t type[PAGE_COUNT];
+        mmio dev[PAGE_COUNT];
+        uint64_t hash[PAGE_COUNT];
+        // Pages whose hash needs redoing, and pages changed since last
+        // cleared, a bit each
+        uint64_t stale[PAGE_COUNT / 64];
+        uint64_t dirty[PAGE_COUNT / 64];
+        // Sum of hash[]
+        uint64_t hash_sum;
+} memory;
+
+
+void mem_init(memory *m);
+void mem_free(memory *m);
+void mem_share(memory *dst, memory *src);
+uint8_t *mem_own(memory *m, uint8_t page);
+void mem_load(memory *m, uint16_t addr, const void *buf, size_t len);
+void mem_dump(const memory *m, uint16_t addr, void *buf, size_t len);
+bool mem_map_file(memory *m, uint16_t addr, int fd, size_t offset, size_t len);
+void mem_set_type(memory *m, uint8_t page, mem_type type, const mmio *dev);
+void mem_copy_layout(memory *dst, const memory *src);
+uint8_t mem_read_slow(const memory *m, uint16_t addr);
+void mem_write_slow(memory *m, uint16_t addr, uint8_t byte);
+uint64_t mem_hash(memory *m);
+void mem_clear_dirty(memory *m, uint8_t first, size_t count);
+
+static inline uint8_t
+mem_read(const memory *m, uint16_t addr)
+{
+        const uint8_t *p = m->rd[addr >> PAGE_SHIFT];
+        if (__builtin_expect(p != NULL, 1))
+                return p[addr & (PAGE_SZ - 1)];
+        return mem_read_slow(m, addr);
+}
+
+static inline void
+mem_write(memory *m, uint16_t addr, uint8_t byte)
+{
+        uint8_t *p = m->wr[addr >> PAGE_SHIFT];
+        if (__builtin_expect(p != NULL, 1))
+                p[addr & (PAGE_SZ - 1)] = byte;
+        else
+                mem_write_slow(m, addr, byte);
+}
+
+static inline bool
+mem_is_dirty(const memory *m, uint8_t page)
+{
+        return m->dirty[page / 64] >> (page % 64) & 1;
+}
+
+static inline bool
+mem_is_mmio(const memory *m, uint16_t addr)
+{
+        return m->rd[addr >> PAGE_SHIFT] == NULL;
+}
+
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "i8080.h"
+#include "profile.h"
+
+
+/* Addresses listed in the report. */
+#define REPORT_TOP 40
+
+/* A call path: the chain of subroutines entered to get here. */
+typedef struct {
+        uint16_t addr;
+        uint32_t parent;
+        uint32_t child;
+        uint32_t sibling;
+        // SP right after the call pushed its return address
+        uint16_t sp;
+        uint64_t execs;
+        uint64_t cycles;
+} call_node;
+
+struct profile {
+        uint64_t pc_execs[0x10000];
+        uint64_t pc_cycles[0x10000];
+        uint64_t op_execs[256];
+        uint64_t op_cycles[256];
+
+        // Node 0 is the root, for code outside any call seen
+        call_node *nodes;
+        uint32_t nodes_len, nodes_cap;
+        uint32_t cur;
+
+        // The instruction before the one being counted
+        bool have_prev;
+        uint16_t prev_pc;
+        uint8_t prev_op;
+        uint16_t prev_sp;
+        uint32_t prev_node;
+        // Cycle count when it started, or when it was last charged
+        uint64_t mark;
+};
+
+
+profile *
+profile_new(void)
+{
+        profile *prof = calloc(1, sizeof *prof);
+        if (!prof)
+                return NULL;
+        prof->nodes_cap = 256;
+        prof->nodes = calloc(prof->nodes_cap, sizeof *prof->nodes);
+        if (!prof->nodes) {
+                free(prof);
+                return NULL;
+        }
+        prof->nodes_len = 1;
+        return prof;
+}
+
+void
+profile_free(profile *prof)
+{
+        if (!prof)
+                return;
+        free(prof->nodes);
+        free(prof);
+}
+
+static bool
+is_call(uint8_t op)
+{
+        // CALL, Ccc and RST
+        return op == 0xCD || (op & 0xC7) == 0xC4 || (op & 0xC7) == 0xC7;
+}
+
+static bool
+is_return(uint8_t op)
+{
+        // RET and Rcc
+        return op == 0xC9 || (op & 0xC7) == 0xC0;
+}
+
+/* The child of the current node for a call to addr, created if new. */
+static uint32_t
+enter(profile *prof, uint16_t addr, uint16_t sp)
+{
+        call_node *n = prof->nodes;
+        for (uint32_t c = n[prof->cur].child; c; c = n[c].sibling) {
+                if (n[c].addr == addr) {
+                        n[c].sp = sp;
+                        return c;
+                }
+        }
+
+        if (prof->nodes_len == prof->nodes_cap) {
+                call_node *grown = realloc(prof->nodes, 2 * prof->nodes_cap * sizeof *grown);
+                if (!grown)
+                        return prof->cur;
+                prof->nodes = n = grown;
+                prof->nodes_cap *= 2;
+        }
+        uint32_t c = prof->nodes_len++;
+        n[c] = (call_node){ .addr = addr, .parent = prof->cur, .sibling = n[prof->cur].child, .sp = sp };
+        n[prof->cur].child = c;
+        return c;
+}
+
+/*
+ * Count the instruction at pc, about to run, and charge the previous one
+ * with the states it took. sp and cycles are the machine's before the
+ * instruction at pc. Whether the previous one called or returned shows in
+ * how it moved SP.
+ */
+void
+profile_step(profile *prof, uint16_t pc, uint8_t op, uint16_t sp, uint64_t cycles)
+{
+        if (prof->have_prev) {
+                uint64_t spent = cycles - prof->mark;
+                prof->pc_cycles[prof->prev_pc] += spent;
+                prof->op_cycles[prof->prev_op] += spent;
+                prof->nodes[prof->prev_node].cycles += spent;
+
+                if (is_call(prof->prev_op) && sp == (uint16_t)(prof->prev_sp - 2)) {
+                        prof->cur = enter(prof, pc, sp);
+                } else if (is_return(prof->prev_op) && sp == (uint16_t)(prof->prev_sp + 2)) {
+                        // Unwind every frame the return pops, so that
+                        // code dropping frames does not grow the stack
+                        while (prof->cur && prof->nodes[prof->cur].sp < sp)
+                                prof->cur = prof->nodes[prof->cur].parent;
+                }
+        }
+
+        ++prof->pc_execs[pc];
+        ++prof->op_execs[op];
+        ++prof->nodes[prof->cur].execs;
+        prof->have_prev = true;
+        prof->prev_pc = pc;
+        prof->prev_op = op;
+        prof->prev_sp = sp;
+        prof->prev_node = prof->cur;
+        prof->mark = cycles;
+}
+
+/* Charge the last instruction counted with the states it took so far. */
+void
+profile_flush(profile *prof, uint64_t cycles)
+{
+        if (!prof->have_prev)
+                return;
+        uint64_t spent = cycles - prof->mark;
+        prof->pc_cycles[prof->prev_pc] += spent;
+        prof->op_cycles[prof->prev_op] += spent;
+        prof->nodes[prof->prev_node].cycles += spent;
+        prof->mark = cycles;
+}
+
+typedef struct {
+        uint64_t cycles;
+        uint32_t index;
+} ranked;
+
+static int
+by_cycles_desc(const void *a, const void *b)
+{
+        uint64_t x = ((const ranked *)a)->cycles;
+        uint64_t y = ((const ranked *)b)->cycles;
+        return (x < y) - (x > y);
+}
+
+static ranked *
+rank(const uint64_t *cycles, size_t n)
+{
+        ranked *r = malloc(n * sizeof *r);
+        if (!r)
+                return NULL;
+        for (size_t i = 0; i < n; ++i)
+                r[i] = (ranked){ cycles[i], (uint32_t)i };
+        qsort(r, n, sizeof *r, by_cycles_desc);
+        return r;
+}
+
+void
+profile_write_report(const profile *prof, FILE *out)
+{
+        uint64_t execs = 0, cycles = 0;
+        for (size_t i = 0; i < 256; ++i) {
+                execs += prof->op_execs[i];
+                cycles += prof->op_cycles[i];
+        }
+        fprintf(out, "instructions %llu\nstates %llu\n",
+                (unsigned long long)execs, (unsigned long long)cycles);
+
+        ranked *r = rank(prof->pc_cycles, 0x10000);
+        fprintf(out, "\n%-8s %14s %7s %14s\n", "address", "states", "%", "executions");
+        for (size_t i = 0; r && i < REPORT_TOP && r[i].cycles; ++i) {
+                uint32_t pc = r[i].index;
+                fprintf(out, "0x%04X   %14llu %6.2f%% %14llu\n", pc,
+                        (unsigned long long)r[i].cycles, 100.0 * (double)r[i].cycles / (double)cycles,
+                        (unsigned long long)prof->pc_execs[pc]);
+        }
+        free(r);
+
+        r = rank(prof->op_cycles, 256);
+        fprintf(out, "\n%-8s %14s %7s %14s\n", "opcode", "states", "%", "executions");
+        for (size_t i = 0; r && i < 256 && r[i].cycles; ++i) {
+                uint32_t op = r[i].index;
+                fprintf(out, "%-8s %14llu %6.2f%% %14llu\n", opcode_name((uint8_t)op),
+                        (unsigned long long)r[i].cycles, 100.0 * (double)r[i].cycles / (double)cycles,
+                        (unsigned long long)prof->op_execs[op]);
+        }
+        free(r);
+}
+
+static void
+write_path(const profile *prof, FILE *out, uint32_t node)
+{
+        if (!node) {
+                fputs("root", out);
+                return;
+        }
+        write_path(prof, out, prof->nodes[node].parent);
+        fprintf(out, ";0x%04X", prof->nodes[node].addr);
+}
+
+void
+profile_write_folded(const profile *prof, FILE *out)
+{
+        for (uint32_t i = 0; i < prof->nodes_len; ++i) {
+                if (!prof->nodes[i].cycles)
+                        continue;
+                write_path(prof, out, i);
+                fprintf(out, " %llu\n", (unsigned long long)prof->nodes[i].cycles);
+        }
+}
@@ -0,0 +1,36 @@
+#ifndef profile_h
+#define profile_h
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/*
+ * Instruction-level profiler.
+ *
+ * Built in with make PROFILE=1 and switched on per machine with
+ * enable_profiler(); otherwise the engines contain no trace of it. Every
+ * instruction executed is counted against its address, its opcode and the
+ * call stack it ran in, along with the states it took. Call stacks are
+ * rebuilt from the CALL, RST and RET instructions actually taken; interrupts
+ * are charged to whatever they interrupted.
+ *
+ * The report lists the hottest addresses and opcodes. The folded stacks are
+ * one line per call path, "root;0x0234;0x0456 <states>" with the entry points
+ * of the subroutines called, the input format of flamegraph.pl.
+ */
+
+typedef struct profile profile;
+
+
+profile *profile_new(void);
+void profile_free(profile *prof);
+void profile_step(profile *prof, uint16_t pc, uint8_t op, uint16_t sp, uint64_t cycles);
+void profile_flush(profile *prof, uint64_t cycles);
+void profile_write_report(const profile *prof, FILE *out);
+void profile_write_folded(const profile *prof, FILE *out);
+
+
+#endif
@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+
+#define SNAPSHOT_HEADER_SZ 48
+
+static const char magic[8] = "i8080ss";
+
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+        put16(p, (uint16_t)v);
+        put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void
+put64(uint8_t *p, uint64_t v)
+{
+        put32(p, (uint32_t)v);
+        put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+        return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+        return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint64_t
+get64(const uint8_t *p)
+{
+        return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static bool
+write_all(int fd, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+        while (len) {
+                ssize_t n = write(fd, p, len);
+                if (n < 0)
+                        return false;
+                p += n;
+                len -= (size_t)n;
+        }
+        return true;
+}
+
+static bool
+read_all(int fd, void *buf, size_t len, size_t offset)
+{
+        uint8_t *p = buf;
+        while (len) {
+                ssize_t n = pread(fd, p, len, (off_t)offset);
+                if (n <= 0)
+                        return false;
+                p += n;
+                offset += (size_t)n;
+                len -= (size_t)n;
+        }
+        return true;
+}
+
+/*
+ * Write the state of a stopped machine to path. Attached devices, the memory
+ * map and the translation caches are not part of it; MMIO pages are saved as
+ * zeros. The state is written to a new file that then replaces path, so
+ * machines whose memory is mapped from the old file, this one included, keep
+ * it intact. Returns false on I/O errors, with errno set.
+ */
+bool
+save_state(i8080 *cpu, const char *path)
+{
+        uint8_t header[SNAPSHOT_MEM_OFFSET] = { 0 };
+        memcpy(header, magic, sizeof magic);
+        put32(header + 8, SNAPSHOT_VERSION);
+        put32(header + 12, SNAPSHOT_MEM_OFFSET);
+        put32(header + 16, ADDR_SPACE_SZ);
+        header[20] = cpu->A;
+        header[21] = cpu->B;
+        header[22] = cpu->C;
+        header[23] = cpu->D;
+        header[24] = cpu->E;
+        header[25] = cpu->H;
+        header[26] = cpu->L;
+        header[27] = flags_read(cpu);
+        put16(header + 28, cpu->PC);
+        put16(header + 30, cpu->SP);
+        header[32] = cpu->INTE;
+        header[33] = cpu->halted;
+        header[34] = cpu->int_mask;
+        put32(header + 36, (uint32_t)__atomic_load_n(&cpu->int_pending, __ATOMIC_ACQUIRE));
+        put64(header + 40, cpu->cycles);
+
+        // In the same directory, for rename() to replace path atomically
+        size_t len = strlen(path);
+        char *tmp = malloc(len + sizeof ".XXXXXX");
+        if (!tmp)
+                return false;
+        memcpy(tmp, path, len);
+        memcpy(tmp + len, ".XXXXXX", sizeof ".XXXXXX");
+
+        int fd = mkstemp(tmp);
+        if (fd < 0) {
+                free(tmp);
+                return false;
+        }
+        bool ok = fchmod(fd, 0644) == 0 && write_all(fd, header, sizeof header);
+        for (size_t i = 0; ok && i < PAGE_COUNT; ++i) {
+                uint8_t page[PAGE_SZ];
+                mem_dump(&cpu->mem, (uint16_t)(i << PAGE_SHIFT), page, PAGE_SZ);
+                ok = write_all(fd, page, PAGE_SZ);
+        }
+        if (close(fd) < 0)
+                ok = false;
+        if (ok && rename(tmp, path) < 0)
+                ok = false;
+        if (!ok) {
+                int saved = errno;
+                unlink(tmp);
+                errno = saved;
+        }
+        free(tmp);
+        return ok;
+}
+
+/*
+ * Put a machine into the state saved in path. The machine keeps its devices,
+ * memory map and engine; its scheduled events are left as they are. Returns
+ * false if the file cannot be read or is not a save state of a known version,
+ * with errno set and the machine untouched.
+ */
+bool
+restore_state(i8080 *cpu, const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return false;
+
+        uint8_t header[SNAPSHOT_HEADER_SZ];
+        if (!read_all(fd, header, sizeof header, 0)
+            || memcmp(header, magic, sizeof magic)
+            || get32(header + 8) < 1 || get32(header + 8) > SNAPSHOT_VERSION
+            || get32(header + 16) != ADDR_SPACE_SZ) {
+                close(fd);
+                errno = EINVAL;
+                return false;
+        }
+        size_t offset = get32(header + 12);
+
+        memory mem;
+        mem_init(&mem);
+        if (!mem_map_file(&mem, 0, fd, offset, ADDR_SPACE_SZ)) {
+                // Not mappable here: read it page by page instead
+                for (size_t i = 0; i < PAGE_COUNT; ++i) {
+                        if (!read_all(fd, mem_own(&mem, (uint8_t)i), PAGE_SZ, offset + (i << PAGE_SHIFT))) {
+                                mem_free(&mem);
+                                close(fd);
+                                return false;
+                        }
+                }
+        }
+        close(fd);
+
+        mem_copy_layout(&mem, &cpu->mem);
+        mem_free(&cpu->mem);
+        cpu->mem = mem;
+        if (cpu->bcache)
+                for (size_t i = 0; i < PAGE_COUNT; ++i)
+                        if (cpu->bcache->code_page[i])
+                                block_cache_invalidate_page(cpu->bcache, (uint8_t)i);
+
+        cpu->A = header[20];
+        cpu->B = header[21];
+        cpu->C = header[22];
+        cpu->D = header[23];
+        cpu->E = header[24];
+        cpu->H = header[25];
+        cpu->L = header[26];
+        flags_load(cpu, header[27]);
+        cpu->PC = get16(header + 28);
+        cpu->SP = get16(header + 30);
+        cpu->INTE = header[32];
+        cpu->halted = header[33];
+        int pending = (int)get32(header + 36);
+        if (get32(header + 8) == 1) {
+                // A vector number, with vector 0 standing for none
+                pending = pending ? 1 << (pending & 7) : 0;
+        } else {
+                cpu->int_mask = header[34];
+        }
+        __atomic_store_n(&cpu->int_pending, pending, __ATOMIC_RELEASE);
+        cpu->cycles = get64(header + 40);
+        // Nothing of the machine's previous run carries over: no fault, and
+        // no EI just executed
+        cpu->faulted = false;
+        cpu->ei_cycles = cpu->cycles - 1;
+        return true;
+}
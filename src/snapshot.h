@@ -0,0 +1,48 @@
+#ifndef snapshot_h
+#define snapshot_h
+
+
+#include <stdbool.h>
+
+#include "i8080.h"
+
+
+/*
+ * Save states.
+ *
+ * A save state file holds the CPU state in a fixed-size header followed by
+ * the full 64 KiB of memory, starting on a 4 KiB boundary of the file:
+ *
+ *      offset  size
+ *      0       8       magic "i8080ss\0"
+ *      8       4       format version (SNAPSHOT_VERSION)
+ *      12      4       offset of memory in the file
+ *      16      4       size of memory
+ *      20      8       A, B, C, D, E, H, L, F
+ *      28      2       PC
+ *      30      2       SP
+ *      32      1       INTE
+ *      33      1       halted
+ *      34      1       interrupt mask
+ *      35      1       reserved, 0
+ *      36      4       requested interrupt lines, bit n for RST n
+ *      40      8       cycle count
+ *
+ * Multi-byte fields are little-endian. Version 1 files, which held a single
+ * pending vector at offset 36 and no mask, are still read. Restoring maps the memory image
+ * instead of reading it, so any number of machines restored from one file
+ * share its pages in the page cache until they write to them.
+ */
+
+#define SNAPSHOT_VERSION 2
+
+/* Offset of the memory image. Restores copy instead of mapping on hosts
+ * with larger pages. */
+#define SNAPSHOT_MEM_OFFSET 4096
+
+
+bool save_state(i8080 *cpu, const char *path);
+bool restore_state(i8080 *cpu, const char *path);
+
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+
+/*
+ * A recorder keeping the last records written, rounded up to a power of two.
+ * dump_path, if not NULL, is where the ring goes when the guest faults.
+ */
+trace *
+trace_new(size_t records, const char *dump_path)
+{
+        size_t cap = 1;
+        while (cap < records)
+                cap <<= 1;
+
+        trace *t = calloc(1, sizeof *t);
+        if (!t)
+                return NULL;
+        t->ring = calloc(cap, sizeof *t->ring);
+        t->dump_path = dump_path ? strdup(dump_path) : NULL;
+        if (!t->ring || (dump_path && !t->dump_path)) {
+                trace_free(t);
+                return NULL;
+        }
+        t->mask = cap - 1;
+        return t;
+}
+
+void
+trace_free(trace *t)
+{
+        if (!t)
+                return;
+        free(t->ring);
+        free(t->dump_path);
+        free(t);
+}
+
+/* Write the records in the ring to path, oldest first. */
+bool
+trace_dump(const trace *t, const char *path)
+{
+        uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        uint64_t n = head < t->mask + 1 ? head : t->mask + 1;
+
+        FILE *f = fopen(path, "wb");
+        if (!f)
+                return false;
+
+        uint8_t header[32] = "i8080tr";
+        uint32_t version = TRACE_VERSION, size = sizeof(trace_record);
+        memcpy(header + 8, &version, 4);
+        memcpy(header + 12, &size, 4);
+        memcpy(header + 16, &n, 8);
+        memcpy(header + 24, &head, 8);
+        bool ok = fwrite(header, sizeof header, 1, f) == 1;
+
+        // Oldest first: from the slot after the newest record to the end of
+        // the ring, then from its start
+        uint64_t first = head - n;
+        size_t start = first & t->mask;
+        size_t tail = n < t->mask + 1 - start ? n : t->mask + 1 - start;
+        ok = ok && fwrite(t->ring + start, sizeof *t->ring, tail, f) == tail;
+        ok = ok && fwrite(t->ring, sizeof *t->ring, n - tail, f) == n - tail;
+        if (fclose(f) != 0)
+                ok = false;
+        return ok;
+}
@@ -0,0 +1,96 @@
+#ifndef trace_h
+#define trace_h
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Execution trace recorder.
+ *
+ * Built in with make TRACE=1 and switched on per machine with
+ * enable_trace(). The engines then append a record for every instruction
+ * about to run and for every byte stored to memory to a fixed-size ring, so
+ * the ring always holds the most recent history. Only the CPU's own thread
+ * writes the ring and nothing is locked; the count of records written is
+ * published with release ordering after each record.
+ *
+ * An instruction record carries the registers as they were before the
+ * instruction ran, so each register change can be read off the next record;
+ * the decoder (i8080-trace) prints only what changed. The ring is written to
+ * a file by trace_dump(), which also happens when the guest faults.
+ *
+ * A dump is a header followed by its records, oldest first, in host byte
+ * order:
+ *
+ *      offset  size
+ *      0       8       magic "i8080tr\0"
+ *      8       4       format version (TRACE_VERSION)
+ *      12      4       record size
+ *      16      8       number of records in the file
+ *      24      8       number of records ever written
+ */
+
+#define TRACE_VERSION 1
+
+typedef enum {
+        TRACE_INSN,
+        TRACE_WRITE,
+} trace_kind;
+
+/* One record. Sixteen bytes, so four share a cache line. */
+typedef struct {
+        uint8_t kind;
+        // TRACE_INSN: the opcode. TRACE_WRITE: the byte stored.
+        uint8_t op;
+        // TRACE_INSN: address of the instruction. TRACE_WRITE: the address
+        // stored to.
+        uint16_t addr;
+        // Remaining fields are for TRACE_INSN only
+        uint16_t sp;
+        uint8_t a, f, b, c, d, e, h, l;
+        // Low bits of the cycle count
+        uint16_t cycles;
+} trace_record;
+
+typedef struct trace {
+        trace_record *ring;
+        // Capacity in records, a power of two
+        size_t mask;
+        // Records ever written
+        uint64_t head;
+        // Written on a fault, or NULL
+        char *dump_path;
+} trace;
+
+
+trace *trace_new(size_t records, const char *dump_path);
+void trace_free(trace *t);
+bool trace_dump(const trace *t, const char *path);
+
+static inline trace_record *
+trace_next(trace *t)
+{
+        return &t->ring[t->head & t->mask];
+}
+
+static inline void
+trace_commit(trace *t)
+{
+        __atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+trace_write(trace *t, uint16_t addr, uint8_t byte)
+{
+        trace_record *r = trace_next(t);
+        r->kind = TRACE_WRITE;
+        r->op = byte;
+        r->addr = addr;
+        trace_commit(t);
+}
+
+
+#endif
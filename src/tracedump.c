@@ -0,0 +1,117 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i8080.h"
+#include "trace.h"
+
+
+/*
+ * Offline decoder for trace dumps. Prints one line per instruction with the
+ * registers it changed, the states it took and the stores it made:
+ *
+ *      #1041  0x0113  INX_HL      H=12 L=00            5
+ *      #1042  0x0114  MOV_M_A                          7  [0x1200]=41
+ */
+
+static const char *reg_names[] = { "A", "F", "B", "C", "D", "E", "H", "L" };
+
+static void
+regs_of(const trace_record *r, uint8_t out[8])
+{
+        uint8_t v[8] = { r->a, r->f, r->b, r->c, r->d, r->e, r->h, r->l };
+        memcpy(out, v, sizeof v);
+}
+
+static void
+print_insn(uint64_t index, const trace_record *r, const trace_record *next,
+           const trace_record *writes, size_t nwrites)
+{
+        char changes[64] = "";
+        size_t len = 0;
+        if (next) {
+                uint8_t before[8], after[8];
+                regs_of(r, before);
+                regs_of(next, after);
+                for (size_t i = 0; i < 8; ++i)
+                        if (before[i] != after[i])
+                                len += (size_t)snprintf(changes + len, sizeof changes - len, "%s=%02X ",
+                                                        reg_names[i], after[i]);
+                if (r->sp != next->sp)
+                        snprintf(changes + len, sizeof changes - len, "SP=%04X", next->sp);
+        }
+
+        printf("#%-10" PRIu64 " 0x%04X  %-10s  %-28s", index, r->addr, opcode_name(r->op), changes);
+        if (next)
+                printf(" %3u", (uint16_t)(next->cycles - r->cycles));
+        else
+                printf("   ?");
+        for (size_t i = 0; i < nwrites; ++i)
+                printf("  [0x%04X]=%02X", writes[i].addr, writes[i].op);
+        putchar('\n');
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc != 2) {
+                fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+        FILE *f = fopen(argv[1], "rb");
+        if (!f) {
+                perror(argv[1]);
+                return EXIT_FAILURE;
+        }
+
+        uint8_t header[32];
+        uint32_t version, size;
+        uint64_t count, total;
+        if (fread(header, sizeof header, 1, f) != 1 || memcmp(header, "i8080tr", 8)) {
+                fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+        memcpy(&version, header + 8, 4);
+        memcpy(&size, header + 12, 4);
+        memcpy(&count, header + 16, 8);
+        memcpy(&total, header + 24, 8);
+        if (version != TRACE_VERSION || size != sizeof(trace_record)) {
+                fprintf(stderr, "%s: unsupported trace version %u\n", argv[1], version);
+                return EXIT_FAILURE;
+        }
+        printf("%" PRIu64 " of %" PRIu64 " records\n", count, total);
+
+        // An instruction is printed once the next one shows its effects
+        trace_record cur, rec;
+        bool have_cur = false;
+        uint64_t cur_index = 0;
+        trace_record writes[8];
+        size_t nwrites = 0;
+        bool first = true;
+
+        for (uint64_t i = 0; i < count && fread(&rec, sizeof rec, 1, f) == 1; ++i) {
+                uint64_t index = total - count + i;
+                if (rec.kind == TRACE_WRITE) {
+                        if (have_cur && nwrites < sizeof writes / sizeof *writes)
+                                writes[nwrites++] = rec;
+                        continue;
+                }
+                if (first) {
+                        printf("start: PC=%04X SP=%04X A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X\n",
+                               rec.addr, rec.sp, rec.a, rec.f, rec.b, rec.c, rec.d, rec.e, rec.h, rec.l);
+                        first = false;
+                }
+                if (have_cur)
+                        print_insn(cur_index, &cur, &rec, writes, nwrites);
+                cur = rec;
+                cur_index = index;
+                have_cur = true;
+                nwrites = 0;
+        }
+        if (have_cur)
+                print_insn(cur_index, &cur, NULL, writes, nwrites);
+
+        fclose(f);
+        return EXIT_SUCCESS;
+}